@@ -2,11 +2,14 @@
 #define TESTCLASS_HPP
 
 #include <chrono>
+#include <cmath>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <thread>
 #include <unordered_map>
 #include <vector>
+#include <vrpc/adapter.hpp>
 
 namespace fixture {
 
@@ -17,6 +20,28 @@ struct Entry {
   std::vector<uint16_t> member4;
 };
 
+enum class Color { red, green, blue };
+
+VRPC_JSON_SERIALIZE_ENUM(Color,
+                         {{Color::red, "red"},
+                          {Color::green, "green"},
+                          {Color::blue, "blue"}})
+
+// Serialized as [x, y, z]
+struct Vec3 {
+  float x = 0;
+  float y = 0;
+  float z = 0;
+};
+
+inline void to_json(vrpc::json& j, const Vec3& v) { j = {v.x, v.y, v.z}; }
+
+inline void from_json(const vrpc::json& j, Vec3& v) {
+  v.x = j.at(0).get<float>();
+  v.y = j.at(1).get<float>();
+  v.z = j.at(2).get<float>();
+}
+
 class TestClass {
  public:
   typedef std::function<void(const Entry&)> Callback;
@@ -34,6 +59,10 @@ class TestClass {
     return _registry.find(key) != _registry.end();
   }
 
+  int32_t countEntries() const {
+    return static_cast<int32_t>(_registry.size());
+  }
+
   void notifyOnNew(const Callback& callback) { _callbacks["new"] = callback; }
 
   void notifyOnRemoved(const Callback& callback) {
@@ -70,6 +99,32 @@ class TestClass {
     done(100);
   }
 
+  void sleepFor(int32_t milliseconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+  }
+
+  // Sleeps holding a shared lock, then upgrades it by requesting sleepFor
+  void sleepLockedFor(const std::string& instance_id,
+                      int32_t milliseconds) const {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+    vrpc::json request = {
+        {"c", instance_id}, {"f", "sleepFor"}, {"a", {milliseconds}}};
+    vrpc::LocalFactory::call(request);
+    if (request.contains("e"))
+      throw std::runtime_error(request["e"].get<std::string>());
+  }
+
+  // Waits for the call to be cancelled, for at most the given time
+  static bool waitForCancel(int32_t milliseconds) {
+    const auto until = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(milliseconds);
+    while (std::chrono::steady_clock::now() < until) {
+      if (vrpc::CancelToken::current().cancelled()) return true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return false;
+  }
+
   bool usingDefaults(const std::string& arg1, bool arg2 = true) { return arg2; }
 
   static std::string usingStaticDefaults(const std::string& arg1,
@@ -84,6 +139,171 @@ class TestClass {
     return who + " is crazy!";
   }
 
+  static std::string colorName(Color color) {
+    return vrpc::json(color).get<std::string>();
+  }
+
+  static float norm(const Vec3& v) {
+    return std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+  }
+
+  static std::string typeOf(bool) { return "boolean"; }
+
+  static std::string typeOf(double) { return "number"; }
+
+  static std::string typeOf(const std::string&) { return "string"; }
+
+  static std::string typeOf(const std::vector<int32_t>&) { return "array"; }
+
+  static std::string typeOf(const Entry&) { return "object"; }
+
+  static std::vector<float> scale(const std::vector<float>& samples,
+                                  float factor) {
+    std::vector<float> scaled(samples);
+    for (auto& sample : scaled) sample *= factor;
+    return scaled;
+  }
+
+  // More arguments than a signature code holds
+  static int32_t sum(int32_t a,
+                     int32_t b,
+                     int32_t c,
+                     int32_t d,
+                     int32_t e,
+                     int32_t f,
+                     int32_t g,
+                     int32_t h,
+                     int32_t i,
+                     int32_t j,
+                     int32_t k,
+                     int32_t l,
+                     int32_t m,
+                     int32_t n,
+                     int32_t o,
+                     int32_t p,
+                     int32_t q,
+                     int32_t r,
+                     int32_t s,
+                     int32_t t,
+                     int32_t u,
+                     int32_t v) {
+    return a + b + c + d + e + f + g + h + i + j + k + l + m + n + o +
+           p + q + r + s + t + u + v;
+  }
+
+  // Replaces the function handles to sum were resolved to
+  static void bindSumAgain() {
+    vrpc::bind_class<TestClass>("TestClass")
+        .static_method<decltype(&TestClass::sum), &TestClass::sum>("sum");
+  }
+
+  static vrpc::bytes echo(const vrpc::bytes& data) { return data; }
+
+  static vrpc::bytes invert(const vrpc::bytes& data) {
+    std::vector<uint8_t> inverted(data.begin(), data.end());
+    for (auto& byte : inverted) byte = ~byte;
+    return vrpc::bytes(std::move(inverted));
+  }
+
+  static std::string toString(const vrpc::bytes& data) {
+    return std::string(data.begin(), data.end());
+  }
+
+  // Uses in-process proxies, typed ones or ones falling back to json
+  static std::string createOther(const std::string& instance_id) {
+    return vrpc::Proxy::create("TestClass", instance_id).context();
+  }
+
+  static bool hasEntryOf(const std::string& instance_id,
+                         const std::string& key,
+                         bool typed) {
+    vrpc::Proxy proxy(instance_id);
+    if (typed) return proxy.method<bool(const std::string&)>("hasEntry")(key);
+    return proxy.method<bool(std::string)>("hasEntry")(key);
+  }
+
+  static Entry removeEntryOf(const std::string& instance_id,
+                             const std::string& key,
+                             bool typed) {
+    vrpc::Proxy proxy(instance_id);
+    if (typed)
+      return proxy.method<Entry(const std::string&)>("removeEntry")(key);
+    return proxy.method<Entry(std::string)>("removeEntry")(key);
+  }
+
+  static void countTo(int32_t n, const std::function<void(int32_t)>& count) {
+    for (int32_t i = 0; i < n; ++i) count(i);
+  }
+
+  // Carries a ballast along, as large requests do
+  static void countTo(const std::string& /* ballast */,
+                      int32_t n,
+                      const std::function<void(int32_t)>& count) {
+    countTo(n, count);
+  }
+
+  static void countToLatest(
+      int32_t n,
+      const vrpc::callback<vrpc::keep_latest(int32_t)>& count) {
+    for (int32_t i = 0; i < n; ++i) count(i);
+  }
+
+  // Settles from another thread after the delay, right away without delay
+  static vrpc::Promise<int32_t> squareLater(int32_t x, int32_t delay) {
+    vrpc::Promise<int32_t> promise;
+    if (delay == 0) {
+      promise.resolve(x * x);
+      return promise;
+    }
+    std::thread([promise, x, delay]() mutable {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+      promise.resolve(x * x);
+    }).detach();
+    return promise;
+  }
+
+  static std::future<std::string> echoLater(const std::string& message) {
+    return std::async(std::launch::async, [message] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      return message;
+    });
+  }
+
+  static std::shared_future<void> failLater(const std::string& message) {
+    return std::async(std::launch::deferred, [message] {
+             throw std::runtime_error(message);
+           })
+        .share();
+  }
+
+  static std::future<int32_t> sleepDeferred(int32_t delay) {
+    return std::async(std::launch::deferred, [delay] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+      return delay;
+    });
+  }
+
+#ifdef VRPC_WITH_COROUTINES
+  static vrpc::Task<int32_t> squareTask(int32_t x) {
+    co_return co_await squareLater(x, 10);
+  }
+
+  // Awaits a promise, a future and a nested task without blocking a thread
+  static vrpc::Task<int32_t> sumOfSquares(int32_t x, int32_t y, int32_t z) {
+    const int32_t xx = co_await squareLater(x, 20);
+    const int32_t yy = co_await std::async(std::launch::async, [y] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      return y * y;
+    });
+    co_return xx + yy + co_await squareTask(z);
+  }
+
+  static vrpc::Task<> failTask(std::string message) {
+    co_await vrpc::resume_on_pool();
+    throw std::runtime_error(message);
+  }
+#endif
+
  private:
   Registry _registry;
   Callbacks _callbacks;
@@ -4,6 +4,13 @@ using namespace fixture;
 
 namespace vrpc {
 VRPC_DEFINE_TYPE(Entry, member1, member2, member3, member4);
+
+static_assert(kind_of<TestClass::Callback>::value == json_kind::string,
+              "callbacks are passed by id");
+#ifdef __cpp_lib_string_view
+static_assert(kind_of<std::string_view>::value == json_kind::string,
+              "string views are strings, not containers");
+#endif
 VRPC_CTOR_X(TestClass, "Creates an empty TestClass");
 VRPC_CTOR_X(TestClass,
             "Creates a pre-filled TestClass",
@@ -26,6 +33,12 @@ VRPC_MEMBER_FUNCTION(TestClass,
                      const Entry&);
 VRPC_MEMBER_FUNCTION(TestClass, Entry, removeEntry, const std::string&);
 VRPC_CONST_MEMBER_FUNCTION(TestClass, void, callMeBack, VRPC_CALLBACK(int32_t));
+VRPC_MEMBER_FUNCTION(TestClass, void, sleepFor, int32_t);
+VRPC_CONST_MEMBER_FUNCTION(TestClass,
+                           void,
+                           sleepLockedFor,
+                           const std::string&,
+                           int32_t);
 VRPC_MEMBER_FUNCTION_X(TestClass,
                        bool,
                        "by default returns true",
@@ -40,7 +53,9 @@ VRPC_MEMBER_FUNCTION_X(TestClass,
                        true,
                        "toggles the return value");
 
+VRPC_STATIC_FUNCTION(TestClass, bool, waitForCancel, int32_t);
 VRPC_STATIC_FUNCTION(TestClass, std::string, crazy);
+VRPC_STATIC_FUNCTION(TestClass, void, bindSumAgain);
 VRPC_STATIC_FUNCTION_X(TestClass,
                        std::string,
                        "returned message",
@@ -50,4 +65,84 @@ VRPC_STATIC_FUNCTION_X(TestClass,
                        "who",
                        required(),
                        "Provides customized part of the message");
+VRPC_STATIC_FUNCTION(TestClass, std::string, colorName, Color);
+VRPC_STATIC_FUNCTION(TestClass, float, norm, const Vec3&);
+VRPC_STATIC_FUNCTION(TestClass, std::string, typeOf, bool);
+VRPC_STATIC_FUNCTION(TestClass, std::string, typeOf, double);
+VRPC_STATIC_FUNCTION(TestClass, std::string, typeOf, const std::string&);
+VRPC_STATIC_FUNCTION(TestClass,
+                     std::string,
+                     typeOf,
+                     const std::vector<int32_t>&);
+VRPC_STATIC_FUNCTION(TestClass, std::string, typeOf, const Entry&);
+VRPC_STATIC_FUNCTION(TestClass,
+                     std::vector<float>,
+                     scale,
+                     const std::vector<float>&,
+                     float);
+VRPC_STATIC_FUNCTION(TestClass, vrpc::bytes, echo, const vrpc::bytes&);
+VRPC_STATIC_FUNCTION(TestClass, vrpc::bytes, invert, const vrpc::bytes&);
+VRPC_STATIC_FUNCTION(TestClass, std::string, toString, const vrpc::bytes&);
+VRPC_STATIC_FUNCTION(TestClass,
+                     std::string,
+                     createOther,
+                     const std::string&);
+VRPC_STATIC_FUNCTION(TestClass,
+                     bool,
+                     hasEntryOf,
+                     const std::string&,
+                     const std::string&,
+                     bool);
+VRPC_STATIC_FUNCTION(TestClass,
+                     Entry,
+                     removeEntryOf,
+                     const std::string&,
+                     const std::string&,
+                     bool);
+VRPC_STATIC_FUNCTION(TestClass, void, countTo, int32_t, VRPC_CALLBACK(int32_t));
+VRPC_STATIC_FUNCTION(TestClass,
+                     void,
+                     countTo,
+                     const std::string&,
+                     int32_t,
+                     VRPC_CALLBACK(int32_t));
+VRPC_STATIC_FUNCTION(TestClass,
+                     void,
+                     countToLatest,
+                     int32_t,
+                     VRPC_CALLBACK_X(vrpc::keep_latest, int32_t));
+VRPC_STATIC_FUNCTION(TestClass,
+                     vrpc::Promise<int32_t>,
+                     squareLater,
+                     int32_t,
+                     int32_t);
+VRPC_STATIC_FUNCTION(TestClass,
+                     std::future<std::string>,
+                     echoLater,
+                     const std::string&);
+VRPC_STATIC_FUNCTION(TestClass,
+                     std::shared_future<void>,
+                     failLater,
+                     const std::string&);
+VRPC_STATIC_FUNCTION(TestClass,
+                     std::future<int32_t>,
+                     sleepDeferred,
+                     int32_t);
+#ifdef VRPC_WITH_COROUTINES
+VRPC_STATIC_FUNCTION(TestClass, vrpc::Task<int32_t>, squareTask, int32_t);
+VRPC_STATIC_FUNCTION(TestClass,
+                     vrpc::Task<int32_t>,
+                     sumOfSquares,
+                     int32_t,
+                     int32_t,
+                     int32_t);
+VRPC_STATIC_FUNCTION(TestClass, vrpc::Task<>, failTask, std::string);
+#endif
+
+// Same class, extended without macros
+const auto test_class =
+    bind_class<TestClass>("TestClass")
+        .method<decltype(&TestClass::countEntries), &TestClass::countEntries>(
+            "countEntries")
+        .static_method<decltype(&TestClass::sum), &TestClass::sum>("sum");
 }  // namespace vrpc
@@ -3,6 +3,7 @@
 const sinon = require('sinon')
 const { assert } = require('chai')
 const addon = require('../../build/Release/vrpc_test')
+const msgpack = require('../../vrpc/msgpack')
 
 /* global describe, it */
 
@@ -114,6 +115,1352 @@ describe('The native addon', () => {
       callback = sinon.spy()
       addon.call(JSON.stringify(json))
       assert(callback.calledOnce)
+      assert.deepEqual(JSON.parse(callback.args[0][0]), {
+        i: 'callback-1',
+        a: [100]
+      })
+    })
+
+    it('should only carry id, sender and arguments in callbacks', () => {
+      const json = {
+        c: instanceId,
+        f: 'callMeBack',
+        a: ['callback-2'],
+        s: 'sender',
+        i: 'request-2'
+      }
+      callback = sinon.spy()
+      addon.call(JSON.stringify(json))
+      assert.deepEqual(JSON.parse(callback.args[0][0]), {
+        i: 'callback-2',
+        s: 'sender',
+        a: [100]
+      })
+    })
+  })
+
+  describe('should properly handle asynchronous calls', () => {
+    let instanceId
+
+    it('should reject illegal arguments', () => {
+      assert.throws(
+        () => addon.callAsync(15),
+        Error,
+        'Wrong argument type, expecting string'
+      )
+    })
+
+    it('should reject a promise for non JSON parsable input', async () => {
+      let error
+      try {
+        await addon.callAsync('bad;')
+      } catch (err) {
+        error = err
+      }
+      assert.instanceOf(error, Error)
+    })
+
+    it('should be able to instantiate a TestClass', async () => {
+      const json = {
+        c: 'TestClass',
+        f: '__createIsolated__',
+        a: ['async123']
+      }
+      const ret = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      assert.strictEqual(ret.r, 'async123')
+      instanceId = ret.r
+    })
+
+    it('should not block the event loop during slow calls', async () => {
+      const json = {
+        c: instanceId,
+        f: 'callMeBack',
+        a: ['callback-async']
+      }
+      callback = sinon.spy()
+      let ticks = 0
+      const timer = setInterval(() => ticks++, 10)
+      const ret = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      clearInterval(timer)
+      assert.strictEqual(ret.r, null)
+      assert.isAbove(ticks, 3)
+      await new Promise(resolve => setImmediate(resolve))
+      assert(callback.calledOnce)
+      // callbacks from worker threads are delivered as batch
+      assert.isArray(callback.args[0][0])
+      assert.include(callback.args[0][0][0], 'callback-async')
+    })
+
+    it('should deliver callbacks from worker threads in batches', async () => {
+      const json = {
+        c: 'TestClass',
+        f: 'countTo',
+        a: [1000, 'callback-count']
+      }
+      callback = sinon.spy()
+      const ret = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      assert.strictEqual(ret.r, null)
+      await new Promise(resolve => setImmediate(resolve))
+      assert.isBelow(callback.callCount, 1000)
+      const counts = [].concat(...callback.args.map(x => x[0]))
+        .map(x => JSON.parse(x))
+        .map(x => x.a[0])
+      assert.deepEqual(counts, Array.from({ length: 1000 }, (_, i) => i))
+    })
+
+    describe('should apply callback delivery policies', () => {
+      const N = 10000
+      const countTo = async (f, id) => {
+        callback = sinon.spy()
+        const json = { c: 'TestClass', f, a: [N, id] }
+        const ret = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+        assert.strictEqual(ret.r, null)
+        await new Promise(resolve => setImmediate(resolve))
+        return [].concat(...callback.args.map(x => x[0]))
+          .map(x => JSON.parse(x).a[0])
+      }
+
+      it('latest (as bound)', async () => {
+        const { coalesced } = addon.getCallbackStats()
+        const counts = await countTo('countToLatest', 'callback-latest')
+        assert.strictEqual(counts[counts.length - 1], N - 1)
+        assert.isBelow(counts.length, N)
+        assert.strictEqual(
+          addon.getCallbackStats().coalesced - coalesced,
+          N - counts.length
+        )
+      })
+
+      it('bounded, dropping the oldest events', async () => {
+        const { dropped } = addon.getCallbackStats()
+        addon.setCallbackPolicy('callback-drop', 'dropOldest', 10)
+        const counts = await countTo('countTo', 'callback-drop')
+        addon.setCallbackPolicy('callback-drop')
+        assert.strictEqual(counts[counts.length - 1], N - 1)
+        assert.isBelow(counts.length, N)
+        assert.strictEqual(
+          addon.getCallbackStats().dropped - dropped,
+          N - counts.length
+        )
+        counts.reduce((a, b) => assert.isBelow(a, b) || b)
+      })
+
+      it('bounded, blocking the producer', async () => {
+        const stats = addon.getCallbackStats()
+        addon.setCallbackPolicy('callback-block', 'blockProducer', 10)
+        const counts = await countTo('countTo', 'callback-block')
+        addon.setCallbackPolicy('callback-block')
+        assert.deepEqual(counts, Array.from({ length: N }, (_, i) => i))
+        assert.isAbove(callback.callCount, N / 10 - 1)
+        assert.deepEqual(addon.getCallbackStats(), stats)
+      })
+
+      it('bounded, not blocking while a synchronous call waits', async () => {
+        const call = json => JSON.parse(addon.call(JSON.stringify(json)))
+        const entry = { member1: 'x', member2: 1, member3: 0.5, member4: [] }
+        call({ c: 'TestClass', f: '__createShared__', a: ['blocking'] })
+        call({ c: 'blocking', f: 'notifyOnNew', a: ['callback-blocking'] })
+        addon.setCallbackPolicy('callback-blocking', 'blockProducer', 1)
+        callback = sinon.spy()
+        const calls = ['first', 'second'].map(key =>
+          addon.callAsync(
+            JSON.stringify({ c: 'blocking', f: 'addEntry', a: [key, entry] })
+          )
+        )
+        // The second event blocks the mutating call, which the synchronous
+        // call then waits for
+        const start = Date.now()
+        while (Date.now() - start < 100);
+        assert.isTrue(call({ c: 'blocking', f: 'hasEntry', a: ['second'] }).r)
+        await Promise.all(calls)
+        await new Promise(resolve => setImmediate(resolve))
+        addon.setCallbackPolicy('callback-blocking')
+        call({ c: 'TestClass', f: '__delete__', a: ['blocking'] })
+        assert.lengthOf([].concat(...callback.args.map(x => x[0])), 2)
+      })
+
+      it('all, overriding the bound policy', async () => {
+        addon.setCallbackPolicy('callback-all', 'all')
+        const counts = await countTo('countToLatest', 'callback-all')
+        addon.setCallbackPolicy('callback-all')
+        assert.deepEqual(counts, Array.from({ length: N }, (_, i) => i))
+      })
+
+      it('rejecting unknown ones', () => {
+        assert.throws(
+          () => addon.setCallbackPolicy('callback-bad', 'sometimes'),
+          Error,
+          'Unknown delivery: sometimes'
+        )
+      })
+    })
+
+    describe('should route callbacks to registered functions', () => {
+      const countTo = (n, id) => {
+        const json = { c: 'TestClass', f: 'countTo', a: [n, id] }
+        return JSON.parse(addon.call(JSON.stringify(json)))
+      }
+
+      it('with converted arguments and without envelopes', () => {
+        callback = sinon.spy()
+        const count = sinon.spy()
+        const id = addon.registerCallback(count, false)
+        assert.isString(id)
+        assert.strictEqual(countTo(3, id).r, null)
+        assert.deepEqual(count.args, [[0], [1], [2]])
+        assert(callback.notCalled)
+        assert.isTrue(addon.releaseCallback(id))
+        assert.isFalse(addon.releaseCallback(id))
+      })
+
+      it('releasing one-shot functions after their first call', () => {
+        const count = sinon.spy()
+        const id = addon.registerCallback(count, true)
+        countTo(3, id)
+        assert.deepEqual(count.args, [[0]])
+        assert.isFalse(addon.releaseCallback(id))
+      })
+
+      it('from worker threads', async () => {
+        const count = sinon.spy()
+        const id = addon.registerCallback(count, false)
+        const json = { c: 'TestClass', f: 'countTo', a: [1000, id] }
+        const ret = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+        assert.strictEqual(ret.r, null)
+        await new Promise(resolve => setImmediate(resolve))
+        assert.deepEqual(
+          count.args.map(x => x[0]),
+          Array.from({ length: 1000 }, (_, i) => i)
+        )
+        addon.releaseCallback(id)
+      })
+
+      it('beyond any fixed number of handlers', () => {
+        const ids = Array.from({ length: 100 }, () =>
+          addon.registerCallback(() => {}, false)
+        )
+        assert.strictEqual(new Set(ids).size, 100)
+        ids.forEach(id => assert.isTrue(addon.releaseCallback(id)))
+      })
+    })
+
+    it('should report errors as part of the result', async () => {
+      const json = {
+        c: instanceId,
+        f: 'removeEntry',
+        a: ['not_there']
+      }
+      const ret = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      assert.equal(ret.e, 'Can not remove non-existing entry')
+    })
+  })
+
+  describe('should properly schedule asynchronous calls', () => {
+    const callAsync = async json =>
+      JSON.parse(await addon.callAsync(JSON.stringify(json)))
+    let poolSize
+
+    it('should allow to size the thread pool', () => {
+      poolSize = addon.getPoolSize()
+      assert.isAtLeast(poolSize, 1)
+      addon.setPoolSize(4)
+      assert.strictEqual(addon.getPoolSize(), 4)
+      assert.throws(
+        () => addon.setPoolSize(0),
+        Error,
+        'Wrong argument, expecting a positive number'
+      )
+    })
+
+    it('should create instances', async () => {
+      for (const id of ['strand1', 'strand2', 'strand3', 'strand4']) {
+        const ret = await callAsync({
+          c: 'TestClass',
+          f: '__createShared__',
+          a: [id]
+        })
+        assert.strictEqual(ret.r, id)
+      }
+    })
+
+    it('should keep the calls on one instance in order', async () => {
+      const entry = { member1: 'x', member2: 1, member3: 0.5, member4: [] }
+      const calls = []
+      for (let i = 0; i < 100; i++) {
+        const key = `${i}`
+        calls.push(callAsync({ c: 'strand1', f: 'addEntry', a: [key, entry] }))
+        calls.push(callAsync({ c: 'strand1', f: 'removeEntry', a: [key] }))
+      }
+      for (const ret of await Promise.all(calls)) assert.notProperty(ret, 'e')
+      const ret = await callAsync({ c: 'strand1', f: 'getRegistry', a: [] })
+      assert.deepEqual(ret.r, {})
+    })
+
+    it('should run const calls on one instance in parallel', async () => {
+      const json = { c: 'strand1', f: 'callMeBack', a: ['callback-strand'] }
+      const start = Date.now()
+      await Promise.all([1, 2, 3].map(() => callAsync(json)))
+      assert.isBelow(Date.now() - start, 300)
+    })
+
+    it('should run mutating calls on one instance alone', async () => {
+      const json = { c: 'strand1', f: 'sleepFor', a: [100] }
+      const start = Date.now()
+      await Promise.all([1, 2, 3].map(() => callAsync(json)))
+      assert.isAtLeast(Date.now() - start, 300)
+    })
+
+    it('should not run const calls alongside mutating calls', async () => {
+      const json = { c: 'strand1', f: 'callMeBack', a: ['callback-strand'] }
+      const start = Date.now()
+      await Promise.all([
+        callAsync(json),
+        callAsync({ c: 'strand1', f: 'sleepFor', a: [100] }),
+        callAsync(json)
+      ])
+      assert.isAtLeast(Date.now() - start, 300)
+    })
+
+    it('should hold synchronous calls back during mutating calls', async () => {
+      const start = Date.now()
+      const pending = callAsync({ c: 'strand1', f: 'sleepFor', a: [200] })
+      await new Promise(resolve => setTimeout(resolve, 50))
+      // Waits for the mutating call, which holds the instance exclusively
+      const ret = JSON.parse(
+        addon.call(JSON.stringify({ c: 'strand1', f: 'hasEntry', a: ['x'] }))
+      )
+      assert.isAtLeast(Date.now() - start, 200)
+      assert.isFalse(ret.r)
+      await pending
+    })
+
+    it('should refuse upgrading the shared locks of two calls', async () => {
+      // Both wait for the other to unlock when upgrading, one has to give up
+      const json = { c: 'strand1', f: 'sleepLockedFor', a: ['strand1', 50] }
+      const rets = await Promise.all([1, 2].map(() => callAsync(json)))
+      assert.sameMembers(
+        rets.map(x => x.e),
+        [undefined, 'Can not lock exclusively while another reader upgrades']
+      )
+    })
+
+    it('should run the calls on different instances in parallel', async () => {
+      const start = Date.now()
+      await Promise.all(
+        ['strand1', 'strand2', 'strand3', 'strand4'].map(c =>
+          callAsync({ c, f: 'callMeBack', a: ['callback-strand'] })
+        )
+      )
+      assert.isBelow(Date.now() - start, 300)
+    })
+
+    it('should delete the instances', async () => {
+      for (const id of ['strand1', 'strand2', 'strand3', 'strand4']) {
+        const json = { c: 'TestClass', f: '__delete__', a: [id] }
+        assert.isTrue((await callAsync(json)).r)
+      }
+      addon.setPoolSize(poolSize)
+    })
+  })
+
+  describe('should cancel calls', () => {
+    const callAsync = async json =>
+      JSON.parse(await addon.callAsync(JSON.stringify(json)))
+
+    it('should not start calls past their deadline', () => {
+      const json = {
+        c: 'TestClass',
+        f: 'waitForCancel',
+        a: [1000],
+        d: Date.now() - 1
+      }
+      const ret = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.strictEqual(ret.e, 'Call deadline exceeded')
+      assert.notProperty(ret, 'r')
+    })
+
+    it('should let running calls see their deadline', async () => {
+      const json = {
+        c: 'TestClass',
+        f: 'waitForCancel',
+        a: [2000],
+        d: Date.now() + 50
+      }
+      const start = Date.now()
+      const ret = await callAsync(json)
+      assert.isTrue(ret.r)
+      assert.isBelow(Date.now() - start, 1000)
+    })
+
+    it('should cancel running calls by their id', async () => {
+      const json = { c: 'TestClass', f: 'waitForCancel', a: [2000], i: 'c-1' }
+      const pending = callAsync(json)
+      await new Promise(resolve => setTimeout(resolve, 50))
+      assert.isTrue(addon.cancel('c-1'))
+      assert.isTrue((await pending).r)
+      assert.isFalse(addon.cancel('c-1'))
+    })
+
+    it('should cancel running calls through the class', async () => {
+      const pending = callAsync({
+        c: 'TestClass',
+        f: 'waitForCancel',
+        a: [2000],
+        i: 'c-2'
+      })
+      await new Promise(resolve => setTimeout(resolve, 50))
+      const ret = JSON.parse(
+        addon.call(
+          JSON.stringify({ c: 'TestClass', f: '__cancel__', a: ['c-2'] })
+        )
+      )
+      assert.isTrue(ret.r)
+      assert.isTrue((await pending).r)
+    })
+
+    it('should drop queued calls that got cancelled', async () => {
+      await callAsync({ c: 'TestClass', f: '__createShared__', a: ['cancel1'] })
+      const busy = callAsync({ c: 'cancel1', f: 'sleepFor', a: [100] })
+      const queued = callAsync({
+        c: 'cancel1',
+        f: 'addEntry',
+        a: ['key', { member1: 'x', member2: 1, member3: 0.5, member4: [] }],
+        i: 'c-3'
+      })
+      assert.isFalse(addon.cancel('c-3'))
+      await busy
+      assert.strictEqual((await queued).e, 'Call cancelled')
+      const ret = await callAsync({ c: 'cancel1', f: 'getRegistry', a: [] })
+      assert.deepEqual(ret.r, {})
+      await callAsync({ c: 'TestClass', f: '__delete__', a: ['cancel1'] })
+    })
+
+    it('should answer calls without cancellations as usual', () => {
+      const json = { c: 'TestClass', f: 'waitForCancel', a: [10], i: 'c-4' }
+      const ret = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.isFalse(ret.r)
+    })
+  })
+
+  describe('should deliver results of promises and futures', () => {
+    // Results may arrive before the call returned the id of their promise
+    const results = new Map()
+    const collect = data => {
+      for (const x of [].concat(data).map(x => JSON.parse(x))) {
+        results.set(x.i, x)
+      }
+    }
+    const settled = async id => {
+      while (!results.has(id)) {
+        await new Promise(resolve => setTimeout(resolve, 5))
+      }
+      return results.get(id)
+    }
+
+    it('should return the id of a promise and deliver its result', async () => {
+      callback = collect
+      const json = {
+        c: 'TestClass',
+        f: 'squareLater',
+        a: [3, 50],
+        s: 'sender'
+      }
+      const { r } = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.match(r, /^__p__squareLater-\d+$/)
+      assert.deepEqual(await settled(r), { i: r, s: 'sender', r: 9 })
+    })
+
+    it('should deliver results settled before returning', () => {
+      callback = sinon.spy()
+      const json = { c: 'TestClass', f: 'squareLater', a: [4, 0] }
+      const { r } = JSON.parse(addon.call(JSON.stringify(json)))
+      assert(callback.calledOnce)
+      assert.deepEqual(JSON.parse(callback.args[0][0]), { i: r, r: 16 })
+    })
+
+    it('should deliver results of futures', async () => {
+      callback = collect
+      const json = { c: 'TestClass', f: 'echoLater', a: ['later'] }
+      const { r } = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      assert.deepEqual(await settled(r), { i: r, r: 'later' })
+    })
+
+    // Coroutine tasks are only available in C++20 builds
+    const itWithTasks = JSON.parse(addon.getStaticFunctions('TestClass')).some(
+      x => x.startsWith('squareTask')
+    )
+      ? it
+      : it.skip
+
+    itWithTasks('should deliver results of coroutine tasks', async () => {
+      callback = collect
+      const json = { c: 'TestClass', f: 'sumOfSquares', a: [1, 2, 3] }
+      const { r } = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.match(r, /^__p__sumOfSquares-\d+$/)
+      assert.deepEqual(await settled(r), { i: r, r: 14 })
+    })
+
+    itWithTasks('should deliver exceptions of coroutine tasks', async () => {
+      callback = collect
+      const json = { c: 'TestClass', f: 'failTask', a: ['failed task'] }
+      const { r } = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      assert.deepEqual(await settled(r), { i: r, e: 'failed task' })
+    })
+
+    it('should deliver exceptions of futures', async () => {
+      const json = { c: 'TestClass', f: 'failLater', a: ['failed later'] }
+      const { r } = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.deepEqual(await settled(r), { i: r, e: 'failed later' })
+    })
+
+    it('should not hold up futures by deferred ones', async () => {
+      const call = json => JSON.parse(addon.call(JSON.stringify(json)))
+      const slow = call({ c: 'TestClass', f: 'sleepDeferred', a: [500] }).r
+      const fast = call({ c: 'TestClass', f: 'echoLater', a: ['fast'] }).r
+      assert.deepEqual(await settled(fast), { i: fast, r: 'fast' })
+      assert.isFalse(results.has(slow))
+      assert.deepEqual(await settled(slow), { i: slow, r: 500 })
+      callback = undefined
+    })
+  })
+
+  describe('should properly handle calls by resolved handles', () => {
+    let handle
+
+    it('should create an instance', () => {
+      const json = {
+        c: 'TestClass',
+        f: '__createShared__',
+        a: ['handles1']
+      }
+      const ret = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.strictEqual(ret.r, 'handles1')
+    })
+
+    it('should resolve a member function to a stable handle', () => {
+      handle = addon.resolve('handles1', 'hasEntry-string')
+      assert.isNumber(handle)
+      assert.strictEqual(addon.resolve('handles1', 'hasEntry-string'), handle)
+    })
+
+    it('should throw when resolving unknown contexts or functions', () => {
+      assert.throws(
+        () => addon.resolve('wrong', 'hasEntry-string'),
+        Error,
+        'Could not find context: wrong'
+      )
+      assert.throws(
+        () => addon.resolve('handles1', 'hasEntry-number'),
+        Error,
+        'Could not find function: hasEntry-number'
+      )
+    })
+
+    it('should reject handles that are no non-negative safe integers', () => {
+      for (const bad of [NaN, -1, Infinity, 1.5, 2 ** 53, '1']) {
+        assert.throws(
+          () => addon.callById(bad, '[]'),
+          TypeError,
+          'Wrong arguments, expecting handle and arguments'
+        )
+      }
+    })
+
+    it('should call a member function given its handle', () => {
+      const ret = JSON.parse(addon.callById(handle, JSON.stringify(['test'])))
+      assert.deepEqual(ret, { r: false })
+    })
+
+    it('should call a static function given its handle', () => {
+      const crazy = addon.resolve('TestClass', 'crazy-string')
+      const ret = JSON.parse(addon.callById(crazy, JSON.stringify(['VRPC'])))
+      assert.deepEqual(ret, { r: 'VRPC is crazy!' })
+    })
+
+    it('should invalidate handles of deleted instances', () => {
+      const json = {
+        c: 'TestClass',
+        f: '__delete__',
+        a: ['handles1']
+      }
+      assert.isTrue(JSON.parse(addon.call(JSON.stringify(json))).r)
+      const ret = JSON.parse(addon.callById(handle, JSON.stringify(['test'])))
+      assert.equal(ret.e, `Invalid function handle: ${handle}`)
+    })
+    it('should invalidate handles resolved while deleting', async () => {
+      const callAsync = async json =>
+        JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      const poolSize = addon.getPoolSize()
+      addon.setPoolSize(4)
+      const handles = []
+      for (let i = 0; i < 100; i++) {
+        const c = `handles-stress${i}`
+        const error = `Could not find context: ${c}`
+        addon.call(
+          JSON.stringify({ c: 'TestClass', f: '__createShared__', a: [c] })
+        )
+        const calls = [
+          callAsync({ c, f: 'hasEntry', a: ['test'] }),
+          callAsync({ c: 'TestClass', f: '__delete__', a: [c] }),
+          callAsync({ c, f: 'hasEntry', a: ['test'] })
+        ]
+        try {
+          handles.push(addon.resolve(c, 'hasEntry-string'))
+        } catch (e) {
+          assert.strictEqual(e.message, error)
+        }
+        for (const ret of await Promise.all(calls)) {
+          if ('e' in ret) assert.strictEqual(ret.e, error)
+        }
+      }
+      addon.setPoolSize(poolSize)
+      for (const handle of handles) {
+        const ret = JSON.parse(addon.callById(handle, JSON.stringify(['test'])))
+        assert.equal(ret.e, `Invalid function handle: ${handle}`)
+      }
+    })
+  })
+
+  describe('should properly handle binary calls', () => {
+    const encoder = new msgpack.Encoder()
+
+    it('should reject non-buffer arguments', () => {
+      assert.throws(
+        () => addon.callBinary('{}'),
+        TypeError,
+        'Wrong argument type, expecting buffer'
+      )
+    })
+
+    it('should answer a MessagePack request with a MessagePack response', () => {
+      const json = {
+        c: 'TestClass',
+        f: '__createShared__',
+        a: ['binary1']
+      }
+      const ret = msgpack.decode(addon.callBinary(encoder.encode(json)))
+      assert.deepEqual(ret, { c: 'TestClass', f: '__createShared__', r: 'binary1' })
+    })
+
+    it('should transport nested values and errors', () => {
+      const entry = {
+        member1: 'binary',
+        member2: 7,
+        member3: 0.5,
+        member4: [1, 2, 3]
+      }
+      let ret = msgpack.decode(
+        addon.callBinary(
+          encoder.encode({ c: 'binary1', f: 'addEntry', a: ['test', entry] })
+        )
+      )
+      assert.notProperty(ret, 'e')
+      ret = msgpack.decode(
+        addon.callBinary(encoder.encode({ c: 'binary1', f: 'getRegistry', a: [] }))
+      )
+      assert.deepEqual(ret.r, { test: [entry] })
+      ret = msgpack.decode(
+        addon.callBinary(encoder.encode({ c: 'binary1', f: 'not_there', a: [] }))
+      )
+      assert.equal(ret.e, 'Could not find function: not_there')
+    })
+
+    it('should transport bytes as MessagePack binaries', () => {
+      const json = {
+        c: 'TestClass',
+        f: 'invert',
+        a: [Buffer.from([0, 255, 15])]
+      }
+      const ret = msgpack.decode(addon.callBinary(encoder.encode(json)))
+      assert.instanceOf(ret.r, Buffer)
+      assert.deepEqual(Array.from(ret.r), [255, 0, 240])
+      json.f = 'scale'
+      json.a = [new Float32Array([1, 2.5]), 2]
+      const scaled = msgpack.decode(addon.callBinary(encoder.encode(json)))
+      assert.deepEqual(scaled.r, [2, 5])
+    })
+
+    it('should accept MessagePack arguments on resolved handles', () => {
+      const handle = addon.resolve('binary1', 'hasEntry-string')
+      const ret = addon.callById(handle, encoder.encode(['test']))
+      assert.instanceOf(ret, Buffer)
+      assert.deepEqual(msgpack.decode(ret), { r: true })
+    })
+
+    it('should accept MessagePack requests on asynchronous calls', async () => {
+      const json = { c: 'TestClass', f: '__delete__', a: ['binary1'] }
+      const ret = await addon.callAsync(encoder.encode(json))
+      assert.instanceOf(ret, Buffer)
+      assert.isTrue(msgpack.decode(ret).r)
+    })
+  })
+
+  describe('should properly handle batched calls', () => {
+    const entry = { member1: 'x', member2: 1, member3: 0.5, member4: [] }
+    const callBatch = (requests, parallel) =>
+      JSON.parse(addon.callBatch(JSON.stringify(requests), parallel))
+
+    it('should reject malformed batches', () => {
+      assert.throws(
+        () => addon.callBatch(15),
+        TypeError,
+        'Wrong argument type, expecting string'
+      )
+      assert.throws(
+        () => addon.callBatch('{"c":"TestClass"}'),
+        Error,
+        'Batch must be an array of requests'
+      )
+      assert.deepEqual(callBatch([]), [])
+    })
+
+    it('should answer all requests of a batch in order', () => {
+      const ret = callBatch([
+        { c: 'TestClass', f: '__createShared__', a: ['batch1'] },
+        { c: 'batch1', f: 'addEntry', a: ['key', entry] },
+        { c: 'batch1', f: 'hasEntry', a: ['key'] },
+        { c: 'batch1', f: 'not_there', a: [] },
+        { c: 'TestClass', f: 'crazy', a: ['VRPC'] }
+      ])
+      assert.lengthOf(ret, 5)
+      assert.strictEqual(ret[0].r, 'batch1')
+      assert.strictEqual(ret[1].r, null)
+      assert.deepEqual(ret[2], { c: 'batch1', f: 'hasEntry', r: true })
+      assert.equal(ret[3].e, 'Could not find function: not_there')
+      assert.equal(ret[4].r, 'VRPC is crazy!')
+    })
+
+    it('should answer MessagePack batches', () => {
+      const encoder = new msgpack.Encoder()
+      const ret = msgpack.decode(
+        addon.callBatch(
+          encoder.encode([
+            { c: 'batch1', f: 'removeEntry', a: ['key'] },
+            { c: 'batch1', f: 'hasEntry', a: ['key'] }
+          ])
+        )
+      )
+      assert.deepEqual(ret[0].r, entry)
+      assert.isFalse(ret[1].r)
+    })
+
+    it('should run the requests of different instances in parallel', () => {
+      const poolSize = addon.getPoolSize()
+      addon.setPoolSize(4)
+      const ids = ['batch2', 'batch3', 'batch4']
+      callBatch(
+        ids.map(id => ({ c: 'TestClass', f: '__createShared__', a: [id] }))
+      )
+      const requests = []
+      for (const c of ['batch1', ...ids]) {
+        requests.push({ c, f: 'sleepFor', a: [100] })
+        requests.push({ c, f: 'addEntry', a: [c, entry] })
+        requests.push({ c, f: 'getRegistry', a: [] })
+      }
+      const start = Date.now()
+      const ret = callBatch(requests, true)
+      assert.isBelow(Date.now() - start, 300)
+      assert.lengthOf(ret, 12)
+      ret.forEach((x, i) => assert.strictEqual(x.c, requests[i].c))
+      for (let i = 2; i < 12; i += 3) {
+        assert.deepEqual(Object.keys(ret[i].r), [ret[i].c])
+      }
+      addon.setPoolSize(poolSize)
+    })
+
+    it('should run parallel batches while the pool is busy', async () => {
+      const poolSize = addon.getPoolSize()
+      addon.setPoolSize(1)
+      const busy = addon.callAsync(
+        JSON.stringify({ c: 'batch4', f: 'sleepFor', a: [500] })
+      )
+      await new Promise(resolve => setTimeout(resolve, 50))
+      const start = Date.now()
+      const ret = callBatch(
+        [
+          { c: 'batch1', f: 'sleepFor', a: [50] },
+          { c: 'batch2', f: 'sleepFor', a: [50] }
+        ],
+        true
+      )
+      assert.isBelow(Date.now() - start, 400)
+      assert.deepEqual(ret.map(x => x.r), [null, null])
+      await busy
+      addon.setPoolSize(poolSize)
+    })
+
+    it('should delete instances in a batch', () => {
+      const ret = callBatch(
+        ['batch1', 'batch2', 'batch3', 'batch4'].map(id => ({
+          c: 'TestClass',
+          f: '__delete__',
+          a: [id]
+        }))
+      )
+      ret.forEach(x => assert.isTrue(x.r))
+    })
+  })
+
+  describe('should call functions on all shared instances', () => {
+    const ids = ['callAll1', 'callAll2', 'callAll3', 'callAll4']
+    const call = json => JSON.parse(addon.call(JSON.stringify(json)))
+    const callAll = (...a) => call({ c: 'TestClass', f: '__callAll__', a })
+    const entry = { member1: 'x', member2: 1, member3: 0.5, member4: [] }
+
+    it('should create the instances', () => {
+      for (const id of ids) {
+        assert.strictEqual(
+          call({ c: 'TestClass', f: '__createShared__', a: [id] }).r,
+          id
+        )
+      }
+      call({ c: 'TestClass', f: '__createIsolated__', a: ['callAllIsolated'] })
+      call({ c: 'callAll2', f: 'addEntry', a: ['key', entry] })
+      const instances = JSON.parse(addon.getInstances('TestClass'))
+      assert.includeMembers(instances, ids)
+      assert.notInclude(instances, 'callAllIsolated')
+    })
+
+    it('should collect the results of all shared instances', () => {
+      const ret = callAll('hasEntry', 'key')
+      assert.deepEqual(ret.r, [
+        { id: 'callAll1', val: false, err: null },
+        { id: 'callAll2', val: true, err: null },
+        { id: 'callAll3', val: false, err: null },
+        { id: 'callAll4', val: false, err: null }
+      ])
+    })
+
+    it('should report errors per instance', () => {
+      const ret = callAll('removeEntry', 'key')
+      assert.deepEqual(ret.r[1], { id: 'callAll2', val: entry, err: null })
+      for (const i of [0, 2, 3]) {
+        assert.deepEqual(ret.r[i], {
+          id: ids[i],
+          val: null,
+          err: 'Can not remove non-existing entry'
+        })
+      }
+      assert.deepEqual(
+        callAll('not_there').r.map(x => x.err),
+        ids.map(() => 'Could not find function: not_there')
+      )
+      assert.equal(
+        call({ c: 'TestClass', f: '__callAll__', a: [] }).e,
+        'Expecting the function name as first argument'
+      )
+    })
+
+    it('should hand the same arguments to every instance', () => {
+      const shared = { member1: 'y', member2: 2, member3: 1.5, member4: [1, 2] }
+      const added = callAll('addEntry', 'shared', shared)
+      assert.deepEqual(added.r.map(x => x.err), [null, null, null, null])
+      const removed = callAll('removeEntry', 'shared')
+      assert.deepEqual(removed.r.map(x => x.val), ids.map(() => shared))
+    })
+
+    it('should call the instances in parallel', async () => {
+      const poolSize = addon.getPoolSize()
+      addon.setPoolSize(4)
+      const start = Date.now()
+      const ret = JSON.parse(
+        await addon.callAsync(
+          JSON.stringify({
+            c: 'TestClass',
+            f: '__callAll__',
+            a: ['sleepFor', 100]
+          })
+        )
+      )
+      assert.isBelow(Date.now() - start, 300)
+      assert.deepEqual(ret.r.map(x => x.id), ids)
+      addon.setPoolSize(poolSize)
+    })
+
+    it('should answer MessagePack requests', () => {
+      const encoder = new msgpack.Encoder()
+      const ret = msgpack.decode(
+        addon.callBinary(
+          encoder.encode({
+            c: 'TestClass',
+            f: '__callAll__',
+            a: ['hasEntry', 'key']
+          })
+        )
+      )
+      assert.deepEqual(ret.r.map(x => x.val), [false, false, false, false])
+    })
+
+    it('should forget deleted instances', () => {
+      for (const id of [...ids, 'callAllIsolated']) {
+        assert.isTrue(call({ c: 'TestClass', f: '__delete__', a: [id] }).r)
+      }
+      assert.deepEqual(callAll('hasEntry', 'key').r, [])
+      assert.notIncludeMembers(JSON.parse(addon.getInstances('TestClass')), ids)
+    })
+  })
+
+  describe('should derive signatures from the argument types', () => {
+    const call = json => JSON.parse(addon.call(JSON.stringify(json)))
+    const entry = { member1: 'x', member2: 1, member3: 0.5, member4: [] }
+
+    it('should take the kinds of custom json conversions', () => {
+      const functions = JSON.parse(addon.getStaticFunctions('TestClass'))
+      assert.includeMembers(functions, ['colorName-string', 'norm-array'])
+      assert.strictEqual(
+        call({ c: 'TestClass', f: 'colorName', a: ['green'] }).r,
+        'green'
+      )
+      assert.strictEqual(
+        call({ c: 'TestClass', f: 'norm', a: [[3, 4, 0]] }).r,
+        5
+      )
+    })
+
+    it('should find overloads by the kinds of the arguments', () => {
+      const args = [true, 1.5, 'x', [1], entry]
+      for (const a of args) {
+        const ret = call({ c: 'TestClass', f: 'typeOf', a: [a] })
+        assert.strictEqual(ret.r, Array.isArray(a) ? 'array' : typeof a)
+      }
+      assert.strictEqual(
+        call({ c: 'TestClass', f: 'typeOf', a: [null] }).e,
+        'Could not find function: typeOf-null'
+      )
+      assert.strictEqual(
+        call({ c: 'TestClass', f: 'typeOf', a: [1, 2] }).e,
+        'Could not find function: typeOf-number:number'
+      )
+    })
+
+    it('should not match more arguments than signatures hold', () => {
+      const a = Array.from({ length: 22 }, (_, i) => i)
+      assert.strictEqual(
+        call({ c: 'TestClass', f: 'typeOf', a }).e,
+        `Could not find function: typeOf-${a.map(() => 'number').join(':')}`
+      )
+    })
+  })
+
+  describe('should properly handle functions bound without macros', () => {
+    const call = json => JSON.parse(addon.call(JSON.stringify(json)))
+
+    it('should list the functions with deduced signatures', () => {
+      assert.include(
+        JSON.parse(addon.getMemberFunctions('TestClass')),
+        'countEntries'
+      )
+      assert.include(
+        JSON.parse(addon.getStaticFunctions('TestClass')),
+        `sum-${Array(22).fill('number').join(':')}`
+      )
+    })
+
+    it('should call member functions', () => {
+      call({ c: 'TestClass', f: '__createShared__', a: ['bound'] })
+      assert.strictEqual(call({ c: 'bound', f: 'countEntries', a: [] }).r, 0)
+      call({
+        c: 'bound',
+        f: 'addEntry',
+        a: ['key', { member1: 'x', member2: 1, member3: 0.5, member4: [] }]
+      })
+      assert.strictEqual(call({ c: 'bound', f: 'countEntries', a: [] }).r, 1)
+      call({ c: 'TestClass', f: '__delete__', a: ['bound'] })
+    })
+
+    it('should call static functions of any arity', () => {
+      const a = Array.from({ length: 22 }, (_, i) => i)
+      assert.strictEqual(call({ c: 'TestClass', f: 'sum', a }).r, 231)
+      assert.strictEqual(
+        call({ c: 'TestClass', f: 'sum', a: [...a.slice(1), 'x'] }).e,
+        `Could not find function: sum-${Array(21).fill('number').join(':')}` +
+          ':string'
+      )
+      assert.strictEqual(
+        call({ c: 'TestClass', f: 'sum', a: [1] }).e,
+        'Could not find function: sum-number'
+      )
+    })
+
+    it('should keep handles working when binding again', () => {
+      const a = Array.from({ length: 22 }, (_, i) => i)
+      const signature = Array(22).fill('number').join(':')
+      const handle = addon.resolve('TestClass', `sum-${signature}`)
+      call({ c: 'TestClass', f: 'bindSumAgain', a: [] })
+      // Churns the heap, the replaced function must not have been freed
+      for (let i = 0; i < 100; i++) call({ c: 'TestClass', f: 'crazy', a: [] })
+      assert.deepEqual(JSON.parse(addon.callById(handle, JSON.stringify(a))), {
+        r: 231
+      })
+      assert.strictEqual(addon.callDirect(handle, a), 231)
+      assert.strictEqual(call({ c: 'TestClass', f: 'sum', a }).r, 231)
+    })
+  })
+
+  describe('should properly stream return values', () => {
+    const encoder = new msgpack.Encoder()
+    const entry = {
+      member1: 'quote " backslash \\ newline \n tab \t bell \u0007 ü€',
+      member2: -70000,
+      member3: -0.25,
+      member4: Array.from({ length: 20 }, (_, i) => i * 3000)
+    }
+
+    it('should create an instance', () => {
+      const json = { c: 'TestClass', f: '__createShared__', a: ['stream1'] }
+      assert.equal(JSON.parse(addon.call(JSON.stringify(json))).r, 'stream1')
+    })
+
+    it('should write containers and escaped strings as json', () => {
+      let json = { c: 'stream1', f: 'addEntry', a: ['kéy "1"', entry] }
+      assert.isNull(JSON.parse(addon.call(JSON.stringify(json))).r)
+      json = { c: 'stream1', f: 'getRegistry', a: [] }
+      const ret = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.deepEqual(ret, {
+        c: 'stream1',
+        f: 'getRegistry',
+        r: { 'kéy "1"': [entry] }
+      })
+    })
+
+    it('should write containers and escaped strings as MessagePack', () => {
+      const json = { c: 'stream1', f: 'getRegistry', a: [] }
+      const ret = msgpack.decode(addon.callBinary(encoder.encode(json)))
+      assert.deepEqual(ret.r, { 'kéy "1"': [entry] })
+    })
+
+    it('should refuse returning strings that are no valid UTF-8', () => {
+      const toString = bytes =>
+        JSON.parse(
+          addon.call(JSON.stringify({ c: 'TestClass', f: 'toString', a: [bytes] }))
+        )
+      assert.strictEqual(toString([0x61, 0xc3, 0xa9]).r, 'a\u00e9')
+      assert.strictEqual(
+        toString([0x61, 0xff]).e,
+        '[json.exception.type_error.316] invalid UTF-8 byte at index 1: 0xFF'
+      )
+      // Surrogates are no characters
+      assert.strictEqual(
+        toString([0xed, 0xa0, 0x80]).e,
+        '[json.exception.type_error.316] invalid UTF-8 byte at index 1: 0xA0'
+      )
+      assert.strictEqual(
+        toString([0x61, 0xc3]).e,
+        '[json.exception.type_error.316] incomplete UTF-8 string; last byte: 0xC3'
+      )
+    })
+
+    it('should echo the request but its arguments around errors', () => {
+      const json = { c: 'stream1', f: 'removeEntry', a: ['missing'], i: 'id1' }
+      const expected = {
+        c: 'stream1',
+        f: 'removeEntry',
+        i: 'id1',
+        e: 'Can not remove non-existing entry'
+      }
+      assert.deepEqual(JSON.parse(addon.call(JSON.stringify(json))), expected)
+      assert.deepEqual(
+        msgpack.decode(addon.callBinary(encoder.encode(json))),
+        expected
+      )
+    })
+
+    it('should delete the instance', () => {
+      const json = { c: 'TestClass', f: '__delete__', a: ['stream1'] }
+      assert.isTrue(JSON.parse(addon.call(JSON.stringify(json))).r)
+    })
+  })
+
+  describe('should properly handle direct calls', () => {
+    const entry = {
+      member1: 'direct',
+      member2: 7,
+      member3: 0.5,
+      member4: [1, 2, 3]
+    }
+    let handles
+
+    before(() => {
+      const json = {
+        c: 'TestClass',
+        f: '__createShared__',
+        a: ['direct1']
+      }
+      assert.strictEqual(JSON.parse(addon.call(JSON.stringify(json))).r, 'direct1')
+      handles = {
+        addEntry: addon.resolve('direct1', 'addEntry-string:object'),
+        getRegistry: addon.resolve('direct1', 'getRegistry'),
+        hasEntry: addon.resolve('direct1', 'hasEntry-string'),
+        notifyOnNew: addon.resolve('direct1', 'notifyOnNew-string'),
+        removeEntry: addon.resolve('direct1', 'removeEntry-string')
+      }
+    })
+
+    it('should reject illegal arguments', () => {
+      assert.throws(
+        () => addon.callDirect(handles.hasEntry, 'test'),
+        TypeError,
+        'Wrong arguments, expecting handle and arguments'
+      )
+    })
+
+    it('should hand over arguments and return values without encoding', () => {
+      callback = sinon.spy()
+      assert.isNull(addon.callDirect(handles.notifyOnNew, ['callback-direct']))
+      assert.isNull(addon.callDirect(handles.addEntry, ['test', entry]))
+      assert.isTrue(callback.calledOnce)
+      assert.isTrue(addon.callDirect(handles.hasEntry, ['test']))
+      // Numeric vectors are returned as typed arrays
+      const returned = { ...entry, member4: Uint16Array.from(entry.member4) }
+      assert.deepEqual(addon.callDirect(handles.getRegistry, []), {
+        test: [returned]
+      })
+      assert.deepEqual(
+        addon.callDirect(handles.removeEntry, ['test']),
+        returned
+      )
+      assert.strictEqual(
+        addon.callDirect(addon.resolve('TestClass', 'crazy-string'), ['VRPC']),
+        'VRPC is crazy!'
+      )
+    })
+
+    it('should exchange numeric vectors as typed arrays', () => {
+      const scale = addon.resolve('TestClass', 'scale-array:number')
+      let ret = addon.callDirect(scale, [new Float32Array([1, 2.5]), 2])
+      assert.instanceOf(ret, Float32Array)
+      assert.deepEqual(Array.from(ret), [2, 5])
+      ret = addon.callDirect(scale, [[1, 2.5], 2])
+      assert.deepEqual(Array.from(ret), [2, 5])
+      ret = addon.callDirect(scale, [new Int16Array([-1, 3]), 2])
+      assert.deepEqual(Array.from(ret), [-2, 6])
+      assert.lengthOf(addon.callDirect(scale, [new Float32Array(0), 2]), 0)
+    })
+
+    it('should exchange bytes as Buffers sharing their memory', () => {
+      const echo = addon.resolve('TestClass', 'echo-array')
+      const input = Buffer.from([1, 2, 3])
+      const ret = addon.callDirect(echo, [input])
+      assert.instanceOf(ret, Buffer)
+      input[0] = 42
+      assert.deepEqual(Array.from(ret), [42, 2, 3])
+      const invert = addon.resolve('TestClass', 'invert-array')
+      const bytes = new Uint8Array([0, 255, 15])
+      assert.deepEqual(
+        Array.from(addon.callDirect(invert, [bytes.subarray(1)])),
+        [0, 240]
+      )
+      assert.deepEqual(Array.from(addon.callDirect(invert, [[0]])), [255])
+    })
+
+    it('should throw on mismatching arguments', () => {
+      assert.throws(
+        () => addon.callDirect(handles.hasEntry, [42]),
+        Error,
+        'type must be string, but is number'
+      )
+      assert.throws(
+        () => addon.callDirect(handles.addEntry, ['test', { member1: 'x' }]),
+        Error,
+        "key 'member2' not found"
+      )
+    })
+
+    it('should reject numbers the parameters can not hold', () => {
+      const waitForCancel = addon.resolve('TestClass', 'waitForCancel-number')
+      for (const bad of [NaN, Infinity, 1.5, 2 ** 31, -(2 ** 31) - 1]) {
+        assert.throws(
+          () => addon.callDirect(waitForCancel, [bad]),
+          Error,
+          'type must be integer in range, but is number'
+        )
+      }
+      const scale = addon.resolve('TestClass', 'scale-array:number')
+      for (const bad of [NaN, -Infinity, 1e39]) {
+        assert.throws(
+          () => addon.callDirect(scale, [[1], bad]),
+          Error,
+          'type must be finite number in range, but is number'
+        )
+      }
+      assert.throws(
+        () => addon.callDirect(scale, [new Float64Array([NaN]), 1]),
+        Error,
+        'type must be finite number in range, but is number'
+      )
+      assert.throws(
+        () => addon.callDirect(NaN, []),
+        TypeError,
+        'Wrong arguments, expecting handle and arguments'
+      )
+    })
+
+    it('should throw native exceptions', () => {
+      assert.throws(
+        () => addon.callDirect(handles.removeEntry, ['test']),
+        Error,
+        'Can not remove non-existing entry'
+      )
+    })
+
+    it('should throw on invalid handles', () => {
+      const json = {
+        c: 'TestClass',
+        f: '__delete__',
+        a: ['direct1']
+      }
+      assert.isTrue(JSON.parse(addon.call(JSON.stringify(json))).r)
+      assert.throws(
+        () => addon.callDirect(handles.hasEntry, ['test']),
+        Error,
+        `Invalid function handle: ${handles.hasEntry}`
+      )
+    })
+  })
+
+  describe('should properly handle in-process proxies', () => {
+    const entry = {
+      member1: 'proxy',
+      member2: 7,
+      member3: 0.5,
+      member4: [1, 2, 3]
+    }
+    const call = (f, ...a) =>
+      JSON.parse(addon.call(JSON.stringify({ c: 'TestClass', f, a })))
+
+    it('should create an instance through a proxy', () => {
+      assert.equal(call('createOther', 'proxy1').r, 'proxy1')
+      const json = { c: 'proxy1', f: 'addEntry', a: ['a', entry] }
+      assert.isNull(JSON.parse(addon.call(JSON.stringify(json))).r)
+      json.a[0] = 'b'
+      assert.isNull(JSON.parse(addon.call(JSON.stringify(json))).r)
+    })
+
+    it('should call typed and with json fallback', () => {
+      assert.isTrue(call('hasEntryOf', 'proxy1', 'a', true).r)
+      assert.isTrue(call('hasEntryOf', 'proxy1', 'b', false).r)
+      assert.isFalse(call('hasEntryOf', 'proxy1', 'c', true).r)
+      assert.deepEqual(call('removeEntryOf', 'proxy1', 'a', true).r, entry)
+      assert.deepEqual(call('removeEntryOf', 'proxy1', 'b', false).r, entry)
+    })
+
+    it('should pass on errors', () => {
+      const error = 'Can not remove non-existing entry'
+      assert.equal(call('removeEntryOf', 'proxy1', 'a', true).e, error)
+      assert.equal(call('removeEntryOf', 'proxy1', 'a', false).e, error)
+      assert.equal(
+        call('hasEntryOf', 'proxy2', 'a', true).e,
+        'Could not find context: proxy2'
+      )
+    })
+
+    it('should lock the instance like any other call', async () => {
+      const json = { c: 'proxy1', f: 'addEntry', a: ['a', entry] }
+      for (const typed of [true, false]) {
+        assert.isNull(JSON.parse(addon.call(JSON.stringify(json))).r)
+        const sleeping = addon.callAsync(
+          JSON.stringify({ c: 'proxy1', f: 'sleepFor', a: [200] })
+        )
+        await new Promise(resolve => setTimeout(resolve, 50))
+        // Waits for the mutating call on the pool, which holds the instance
+        const start = Date.now()
+        assert.deepEqual(call('removeEntryOf', 'proxy1', 'a', typed).r, entry)
+        assert.isAtLeast(Date.now() - start, 100)
+        await sleeping
+      }
+    })
+
+    it('should delete the instance', () => {
+      assert.isTrue(call('__delete__', 'proxy1').r)
+    })
+  })
+
+  describe('should properly serve worker threads', () => {
+    const { Worker } = require('worker_threads')
+    const script = `
+      const { parentPort, workerData } = require('worker_threads')
+      const addon = require(workerData)
+      const counts = []
+      let envelopes = 0
+      addon.onCallback(x => { envelopes += [].concat(x).length })
+      const id = addon.registerCallback(n => counts.push(n), false)
+      addon.call(JSON.stringify({ c: 'TestClass', f: 'countTo', a: [10, id] }))
+      const json = { c: 'TestClass', f: 'countTo', a: [100, 'callback-worker'] }
+      addon.callAsync(JSON.stringify(json)).then(() => setImmediate(() => {
+        const instances = JSON.parse(addon.getInstances('TestClass'))
+        parentPort.postMessage({ counts, envelopes, instances })
+      }))
+    `
+
+    it('with their own callbacks, but the same instances', async () => {
+      const json = { c: 'TestClass', f: '__createShared__', a: ['worker1'] }
+      const ret = JSON.parse(addon.call(JSON.stringify(json)))
+      assert.strictEqual(ret.r, 'worker1')
+      callback = sinon.spy()
+      const worker = new Worker(script, {
+        eval: true,
+        workerData: require.resolve('../../build/Release/vrpc_test')
+      })
+      const message = new Promise(resolve => worker.once('message', resolve))
+      const exit = new Promise(resolve => worker.once('exit', resolve))
+      const { counts, envelopes, instances } = await message
+      assert.deepEqual(counts, Array.from({ length: 10 }, (_, i) => i))
+      assert.strictEqual(envelopes, 100)
+      assert.include(instances, 'worker1')
+      // exits on its own, once done
+      assert.strictEqual(await exit, 0)
+      assert(callback.notCalled)
+      json.f = '__delete__'
+      addon.call(JSON.stringify(json))
+    })
+
+    it('running in parallel', async () => {
+      const workers = Array.from(
+        { length: 4 },
+        () =>
+          new Worker(script, {
+            eval: true,
+            workerData: require.resolve('../../build/Release/vrpc_test')
+          })
+      )
+      const messages = workers.map(
+        x => new Promise(resolve => x.once('message', resolve))
+      )
+      const exits = workers.map(
+        x => new Promise(resolve => x.once('exit', resolve))
+      )
+      const results = await Promise.all(messages)
+      results.forEach(({ envelopes }) => assert.strictEqual(envelopes, 100))
+      assert.deepEqual(await Promise.all(exits), [0, 0, 0, 0])
+    })
+
+    it('releasing the producers blocked when terminated', async () => {
+      const poolSize = addon.getPoolSize()
+      addon.setPoolSize(1)
+      const worker = new Worker(
+        `
+        const { parentPort, workerData } = require('worker_threads')
+        const addon = require(workerData)
+        addon.onCallback(() => {})
+        addon.setCallbackPolicy('callback-terminated', 'blockProducer', 1)
+        const a = [100, 'callback-terminated']
+        addon.callAsync(JSON.stringify({ c: 'TestClass', f: 'countTo', a }))
+        parentPort.postMessage('blocking')
+        while (true);
+      `,
+        {
+          eval: true,
+          workerData: require.resolve('../../build/Release/vrpc_test')
+        }
+      )
+      await new Promise(resolve => worker.once('message', resolve))
+      await new Promise(resolve => setTimeout(resolve, 50))
+      await worker.terminate()
+      // Runs on the only thread of the pool, once the producer got released
+      const json = { c: 'TestClass', f: 'crazy', a: ['VRPC'] }
+      const ret = JSON.parse(await addon.callAsync(JSON.stringify(json)))
+      assert.strictEqual(ret.r, 'VRPC is crazy!')
+      addon.setPoolSize(poolSize)
     })
   })
 
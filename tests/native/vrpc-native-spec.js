@@ -42,6 +42,18 @@ describe('Embedding C++ to Node.js', () => {
       it('and overloads thereof', () => {
         assert.equal(TestClass.crazy('VRPC'), 'VRPC is crazy!')
       })
+      it('should pass typed arrays through', () => {
+        const scaled = TestClass.scale(new Float32Array([1, 2.5]), 2)
+        assert.ok(scaled instanceof Float32Array)
+        assert.deepEqual(Array.from(scaled), [2, 5])
+        const inverted = TestClass.invert(Buffer.from([0, 255]))
+        assert.ok(inverted instanceof Buffer)
+        assert.deepEqual(Array.from(inverted), [255, 0])
+      })
+      it('should resolve promises returned by native functions', async () => {
+        assert.equal(await TestClass.squareLater(3, 50), 9)
+        assert.equal(await TestClass.squareLater(4, 0), 16)
+      })
       context('TestClass instances', () => {
         let testClass
         let anotherTestClass
@@ -156,6 +168,199 @@ describe('Embedding C++ to Node.js', () => {
     })
   })
 
+  context('An instance of the VrpcNative class in async mode', () => {
+    const native = new VrpcNative(addon, { async: true })
+    let TestClass
+    let testClass
+
+    it('should provide asynchronous proxies', async () => {
+      TestClass = native.getClass('TestClass')
+      testClass = new TestClass()
+      assert.equal(await TestClass.crazy('VRPC'), 'VRPC is crazy!')
+      assert.equal(await testClass.hasEntry('test'), false)
+    })
+    it('should reject on native exceptions', async () => {
+      await assert.rejects(testClass.removeEntry('test'), {
+        message: 'Can not remove non-existing entry'
+      })
+    })
+    it('should keep the event loop responsive during slow calls', async () => {
+      let ticks = 0
+      const timer = setInterval(() => ticks++, 10)
+      const sleepTime = await new Promise(resolve => {
+        testClass.callMeBack(resolve)
+      })
+      clearInterval(timer)
+      assert.equal(sleepTime, 100)
+      assert.ok(ticks > 3)
+      assert.equal(native.delete(testClass), true)
+    })
+    it('should fan out batches of callbacks', async () => {
+      const counts = await Promise.all(
+        Array.from({ length: 16 }, () => new Promise(resolve => {
+          TestClass.countTo(1, resolve)
+        }))
+      )
+      assert.deepEqual(counts, Array(16).fill(0))
+    })
+    it('should apply delivery policies to callbacks', async () => {
+      const { coalesced } = native.getCallbackStats()
+      const counts = []
+      await TestClass.vrpcOn(
+        'countTo',
+        10000,
+        VrpcNative.withDelivery(x => counts.push(x), { delivery: 'latest' })
+      )
+      await new Promise(resolve => setImmediate(resolve))
+      assert.equal(counts[counts.length - 1], 9999)
+      assert.ok(counts.length < 10000)
+      assert.equal(
+        native.getCallbackStats().coalesced - coalesced,
+        10000 - counts.length
+      )
+    })
+    it('should resolve promises and futures of native functions', async () => {
+      assert.equal(await TestClass.squareLater(3, 50), 9)
+      assert.equal(await TestClass.squareLater(4, 0), 16)
+      assert.equal(await TestClass.echoLater('later'), 'later')
+      await assert.rejects(TestClass.failLater('failed later'), {
+        message: 'failed later'
+      })
+    })
+    it('should order calls per instance and run instances in parallel', async () => {
+      const poolSize = native.getPoolSize()
+      native.setPoolSize(4)
+      assert.equal(native.getPoolSize(), 4)
+      const instances = [new TestClass(), new TestClass()]
+      const start = Date.now()
+      await Promise.all(
+        instances.map(x => new Promise(resolve => x.callMeBack(resolve)))
+      )
+      assert.ok(Date.now() - start < 200)
+      const [first] = instances
+      const entry = { member1: 'x', member2: 1, member3: 0.5, member4: [] }
+      const [, removed, has] = await Promise.all([
+        first.addEntry('key', entry),
+        first.removeEntry('key'),
+        first.hasEntry('key')
+      ])
+      assert.equal(removed.member1, 'x')
+      assert.equal(has, false)
+      instances.forEach(x => assert.equal(native.delete(x), true))
+      native.setPoolSize(poolSize)
+    })
+    it('should cancel calls that time out', async () => {
+      const timed = new VrpcNative(addon, { async: true, timeout: 50 })
+      const TestClass = timed.getClass('TestClass')
+      await assert.rejects(TestClass.waitForCancel(2000), {
+        message: 'Function call "TestClass::waitForCancel()" timed out (> 50 ms)'
+      })
+      assert.equal(await TestClass.waitForCancel(10), false)
+    })
+  })
+
+  context('An instance of the VrpcNative class in batch mode', () => {
+    const batches = []
+    const batched = Object.assign(Object.create(addon), {
+      callBatch: (...args) => {
+        batches.push(args)
+        return addon.callBatch(...args)
+      }
+    })
+
+    it('should run the calls of a tick as one batch', async () => {
+      const native = new VrpcNative(batched, { batch: true })
+      const TestClass = native.getClass('TestClass')
+      const testClass = new TestClass()
+      const entry = { member1: 'x', member2: 1, member3: 0.5, member4: [] }
+      const [added, has, crazy] = await Promise.all([
+        testClass.addEntry('key', entry),
+        testClass.hasEntry('key'),
+        TestClass.crazy('VRPC')
+      ])
+      assert.equal(added, null)
+      assert.equal(has, true)
+      assert.equal(crazy, 'VRPC is crazy!')
+      assert.equal(batches.length, 1)
+      assert.equal(JSON.parse(batches[0][0]).length, 3)
+      assert.equal(batches[0][1], false)
+      await assert.rejects(testClass.removeEntry('none'), {
+        message: 'Can not remove non-existing entry'
+      })
+      assert.equal(await TestClass.squareLater(3, 10), 9)
+      assert.equal(native.delete(testClass), true)
+    })
+
+    it('should run batches in parallel if asked to', async () => {
+      batches.length = 0
+      const native = new VrpcNative(batched, { batch: 'parallel', binary: true })
+      const TestClass = native.getClass('TestClass')
+      const instances = [new TestClass(), new TestClass()]
+      await Promise.all(instances.map(x => x.sleepFor(10)))
+      assert.equal(batches.length, 1)
+      assert.ok(Buffer.isBuffer(batches[0][0]))
+      assert.equal(batches[0][1], true)
+      instances.forEach(x => assert.equal(native.delete(x), true))
+    })
+  })
+
+  context('An instance of the VrpcNative class without direct calls', () => {
+    const native = new VrpcNative(addon, { direct: false })
+
+    it('should provide working proxies', () => {
+      const TestClass = native.getClass('TestClass')
+      const testClass = new TestClass()
+      assert.equal(testClass.hasEntry('test'), false)
+      assert.equal(TestClass.crazy('VRPC'), 'VRPC is crazy!')
+      assert.throws(() => testClass.removeEntry('test'), {
+        message: 'Can not remove non-existing entry'
+      })
+      assert.equal(native.delete(testClass), true)
+    })
+    it('should encode typed arrays as arrays', () => {
+      const TestClass = native.getClass('TestClass')
+      assert.deepEqual(TestClass.scale(new Float32Array([1, 2.5]), 2), [2, 5])
+      assert.deepEqual(TestClass.invert(Buffer.from([0, 255])), [255, 0])
+    })
+  })
+
+  context('An instance of the VrpcNative class in binary mode', () => {
+    const native = new VrpcNative(addon, { binary: true })
+    const asyncNative = new VrpcNative(addon, { binary: true, async: true })
+    const entry = {
+      member1: 'binary entry',
+      member2: 42,
+      member3: 2.5,
+      member4: [0, 1, 2, 3]
+    }
+
+    it('should provide synchronous proxies', () => {
+      const TestClass = native.getClass('TestClass')
+      const testClass = new TestClass()
+      const spy = sinon.spy()
+      testClass.vrpcOn('notifyOnNew', spy)
+      testClass.addEntry('test', entry)
+      assert(spy.calledOnce)
+      assert.deepEqual(spy.args[0][0], entry)
+      assert.deepEqual(testClass.getRegistry(), { test: [entry] })
+      assert.equal(TestClass.crazy('VRPC'), 'VRPC is crazy!')
+      assert.throws(() => testClass.removeEntry('other'), {
+        message: 'Can not remove non-existing entry'
+      })
+      assert.equal(native.delete(testClass), true)
+    })
+    it('should provide asynchronous proxies', async () => {
+      const TestClass = asyncNative.getClass('TestClass')
+      const testClass = new TestClass({ test: [entry] })
+      assert.deepEqual(await testClass.getRegistry(), { test: [entry] })
+      assert.equal(await TestClass.crazy('VRPC'), 'VRPC is crazy!')
+      await assert.rejects(testClass.removeEntry('other'), {
+        message: 'Can not remove non-existing entry'
+      })
+      assert.equal(asyncNative.delete(testClass), true)
+    })
+  })
+
   context('The corresponding VrpcNative instance', () => {
     let testClass1
     let testClass2
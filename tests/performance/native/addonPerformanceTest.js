@@ -0,0 +1,125 @@
+'use strict'
+
+/* global describe, before, after, it */
+
+const { assert } = require('chai')
+const { performance } = require('perf_hooks')
+const addon = require('../../../build/Release/vrpc_test')
+const msgpack = require('../../../vrpc/msgpack')
+
+const N_KEYS = 2000
+const N_ENTRIES = 2
+const N_RUNS = 10
+
+function createEntry (i) {
+  return {
+    member1: `entry-${i}-`.padEnd(1024, 'x'),
+    member2: i,
+    member3: 0.5,
+    member4: Array.from({ length: 16 }, (_, k) => k)
+  }
+}
+
+function createRegistry () {
+  const registry = {}
+  for (let i = 0; i < N_KEYS; i++) {
+    registry[`key-${i}`] = Array.from({ length: N_ENTRIES }, () =>
+      createEntry(i)
+    )
+  }
+  return registry
+}
+
+function measure (name, fn) {
+  const durations = []
+  for (let i = 0; i < N_RUNS; i++) {
+    const start = performance.now()
+    fn(i)
+    durations.push(performance.now() - start)
+  }
+  const average = durations.reduce((a, b) => a + b) / durations.length
+  console.log(`Average time for ${name}: ${average.toFixed(3)} ms`)
+  return average
+}
+
+describe('The native addon handling large payloads', () => {
+  before(() => {
+    addon.onCallback(() => {})
+    this.registry = JSON.stringify(createRegistry())
+    console.log(
+      `Registry size: ${(this.registry.length / 1024 / 1024).toFixed(1)} MB`
+    )
+  })
+
+  after(() => {
+    for (let i = 0; i < N_RUNS; i++) {
+      addon.call(
+        JSON.stringify({ c: 'TestClass', f: '__delete__', a: [`perf-${i}`] })
+      )
+    }
+  })
+
+  it('should construct instances from a multi-MB registry', () => {
+    measure('construction', i => {
+      const ret = JSON.parse(
+        addon.call(
+          `{"c":"TestClass","f":"__createShared__","a":["perf-${i}",${this.registry}]}`
+        )
+      )
+      assert.strictEqual(ret.r, `perf-${i}`)
+    })
+  })
+
+  it('should return multi-MB registries', () => {
+    const request = i =>
+      JSON.stringify({ c: `perf-${i}`, f: 'getRegistry', a: [] })
+    measure('returning the registry', i => {
+      const ret = JSON.parse(addon.call(request(i)))
+      assert.lengthOf(Object.keys(ret.r), N_KEYS)
+    })
+    const encoder = new msgpack.Encoder()
+    measure('returning the registry (binary)', i => {
+      const ret = msgpack.decode(
+        addon.callBinary(
+          encoder.encode({ c: `perf-${i}`, f: 'getRegistry', a: [] })
+        )
+      )
+      assert.lengthOf(Object.keys(ret.r), N_KEYS)
+    })
+  })
+
+  it('should fire callbacks of large requests', () => {
+    const N_EVENTS = 1000
+    for (const size of [0, 1024, 64 * 1024, 1024 * 1024]) {
+      const request = JSON.stringify({
+        c: 'TestClass',
+        f: 'countTo',
+        a: [''.padEnd(size, 'x'), N_EVENTS, 'callback-perf']
+      })
+      const average = measure(`${N_EVENTS} callbacks (${size} bytes)`, () => {
+        const ret = JSON.parse(addon.call(request))
+        assert.strictEqual(ret.r, null)
+      })
+      console.log(
+        `Callback throughput: ${((N_EVENTS / average) * 1000).toFixed(0)} / s`
+      )
+    }
+  })
+
+  it('should add multi-MB entries', () => {
+    const entry = JSON.stringify({
+      member1: ''.padEnd(4 * 1024 * 1024, 'x'),
+      member2: 0,
+      member3: 0,
+      member4: []
+    })
+    measure('adding entries', i => {
+      const ret = JSON.parse(
+        addon.call(
+          `{"c":"perf-${i}","f":"addEntry","a":["large",${entry}]}`
+        )
+      )
+      assert.strictEqual(ret.r, null)
+    })
+  })
+})
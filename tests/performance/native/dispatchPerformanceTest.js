@@ -0,0 +1,68 @@
+'use strict'
+
+/* global describe, before, after, it */
+
+const { assert } = require('chai')
+const addon = require('../../../build/Release/vrpc_test')
+
+const N_CALLS = 1000000
+const N_RUNS = 5
+
+// Reports the fastest of N_RUNS runs, in nanoseconds per call
+function measure (name, fn) {
+  let best = Infinity
+  for (let i = 0; i < N_RUNS; i++) {
+    const start = process.hrtime.bigint()
+    for (let k = 0; k < N_CALLS; k++) fn()
+    best = Math.min(best, Number(process.hrtime.bigint() - start) / N_CALLS)
+  }
+  console.log(`Dispatching ${name}: ${best.toFixed(1)} ns / call`)
+  return best
+}
+
+describe('The native addon dispatching trivial calls', () => {
+  const noArgs = []
+  const noArgsJson = JSON.stringify(noArgs)
+  let handles
+
+  before(() => {
+    addon.call(
+      JSON.stringify({ c: 'TestClass', f: '__createShared__', a: ['dispatch'] })
+    )
+    handles = {
+      countEntries: addon.resolve('dispatch', 'countEntries'),
+      hasEntry: addon.resolve('dispatch', 'hasEntry-string'),
+      crazy: addon.resolve('TestClass', 'crazy')
+    }
+  })
+
+  after(() => {
+    addon.call(
+      JSON.stringify({ c: 'TestClass', f: '__delete__', a: ['dispatch'] })
+    )
+  })
+
+  it('should dispatch getters without encoding', () => {
+    const key = ['key']
+    assert.strictEqual(addon.callDirect(handles.countEntries, noArgs), 0)
+    measure('a const member getter', () =>
+      addon.callDirect(handles.countEntries, noArgs)
+    )
+    measure('a member function with an argument', () =>
+      addon.callDirect(handles.hasEntry, key)
+    )
+    measure('a static function', () =>
+      addon.callDirect(handles.crazy, noArgs)
+    )
+  })
+
+  it('should dispatch getters by handle', () => {
+    assert.strictEqual(
+      addon.callById(handles.countEntries, noArgsJson),
+      '{"r":0}'
+    )
+    measure('a const member getter (json)', () =>
+      addon.callById(handles.countEntries, noArgsJson)
+    )
+  })
+})
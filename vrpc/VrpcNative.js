@@ -39,6 +39,9 @@ SOFTWARE.
 
 const EventEmitter = require('events')
 const { nanoid } = require('nanoid')
+const msgpack = require('./msgpack')
+
+const DELIVERY = Symbol('delivery')
 
 /**
  * Client capable of creating proxy classes and objects to locally call
@@ -50,17 +53,68 @@ class VrpcNative {
    *
    * @constructor
    * @param {Object} adapter An adapter object, typically loaded as native addon
+   * @param {Object} [options]
+   * @param {Boolean} [options.async=false] If true, proxy functions execute on
+   * the addon's worker thread pool and return a Promise, instead of blocking
+   * the event loop until the native function returned
+   * @param {Boolean} [options.binary=false] If true, calls are MessagePack
+   * instead of JSON encoded when crossing to the native addon
+   * @param {Boolean} [options.direct=true] If true and supported by the addon,
+   * synchronous calls hand over arguments and return values as they are,
+   * without any encoding (ignored in binary mode). Typed arrays and Buffers
+   * are passed through untouched, numeric vectors are returned as typed arrays
+   * and binary data (vrpc::bytes) as Buffers, without copying.
+   * @param {Number} [options.poolSize] Number of threads executing asynchronous
+   * calls (see setPoolSize)
+   * @param {Number} [options.timeout] Maximum time in ms to wait for the
+   * answer of an asynchronous call (async mode only). Calls that did not start
+   * in time are dropped, running ones get cancelled (see vrpc::CancelToken).
+   * @param {Boolean|String} [options.batch=false] If set, proxy functions
+   * return a Promise and all calls issued within the same tick cross to the
+   * native addon as one batch (taking precedence over async mode). Batches
+   * run in order, or with 'parallel' the calls on different instances run
+   * concurrently on the addon's thread pool.
    */
-  constructor (adapter) {
+  constructor (
+    adapter,
+    {
+      async = false,
+      binary = false,
+      direct = true,
+      poolSize,
+      timeout,
+      batch = false
+    } = {}
+  ) {
     this._adapter = adapter
+    this._async = async
+    this._batch = !!batch
+    this._parallelBatch = batch === 'parallel'
+    // calls waiting for the next batch to be flushed
+    this._queue = []
+    this._timeout = timeout
+    this._callPrefix = nanoid(8)
+    this._callId = 0
+    this._binary = binary && typeof adapter.callBinary === 'function'
+    this._encoder = this._binary ? new msgpack.Encoder() : null
+    this._direct =
+      direct && !this._binary && typeof adapter.callDirect === 'function'
     this._eventEmitter = new EventEmitter()
+    this._deliveries = new Set()
+    // maps ids of recurring callbacks to the ones registered with the addon
+    this._callbackIds = new Map()
+    // results of promises that arrived before the call returned their id
+    this._settledPromises = new Map()
+    if (poolSize !== undefined) this.setPoolSize(poolSize)
 
     // register callback handler
     this._adapter.onCallback(data => {
-      // when a javascript VrpcAdapter was used we will receive an object, in
-      // all other cases data will be a string (crossing language boundaries)
-      const json = typeof data === 'string' ? JSON.parse(data) : data
-      this._eventEmitter.emit(json.i, json.a)
+      // callbacks fired from native threads arrive as batch (array)
+      if (Array.isArray(data)) {
+        for (const x of data) this._emitCallback(x)
+      } else {
+        this._emitCallback(data)
+      }
     })
   }
 
@@ -77,63 +131,54 @@ class VrpcNative {
     if (!this.getAvailableClasses().includes(className)) {
       throw new Error(`Native addon does not provide class: ${className}`)
     }
-    const eventEmitter = this._eventEmitter
     const adapter = this._adapter
+    const invoke = (json, handles) => this._invoke(json, handles)
+    const call = (json, handles) => this._call(json, handles)
+    const resolve = (context, signatures) => this._resolve(context, signatures)
+    const wrapCallback = (id, callback, once, label) =>
+      this._wrapCallback(id, callback, once, label)
+    const unwrapCallbacks = id => this._unwrapCallbacks(id)
 
     let invokeId = 0
     let proxyId = 0
     const classId = nanoid(4)
 
+    const memberSignatures = JSON.parse(adapter.getMemberFunctions(className))
     const memberFuncs = new Set(
-      JSON.parse(adapter.getMemberFunctions(className)).map(x => {
+      memberSignatures.map(x => {
         const pos = x.indexOf('-')
         return pos > 0 ? x.substring(0, pos) : x
       })
     )
 
+    const staticSignatures = JSON.parse(adapter.getStaticFunctions(className))
     const staticFuncs = new Set(
-      JSON.parse(adapter.getStaticFunctions(className)).map(x => {
+      staticSignatures.map(x => {
         const pos = x.indexOf('-')
         return pos > 0 ? x.substring(0, pos) : x
       })
     )
+    const staticHandles = resolve(className, staticSignatures)
 
     function wrapArguments (context, functionName, ...args) {
       const wrapped = []
       args.forEach((x, i) => {
         // Check whether provided argument is a function
+        const label = `${context}-${functionName}`
         if (VrpcNative._isFunction(x)) {
           if (functionName.startsWith('vrpcOn')) {
             const id = `__f__${context}-${functionName}`
-            wrapped.push(id)
-            eventEmitter.on(id, a => {
-              try {
-                x.apply(null, a)
-              } catch (err) {
-                console.error(
-                  `[VrpcNative ${context}-${functionName}]: Failed to execute callback, because: ${err.message}`
-                )
-              }
-            })
+            wrapped.push(wrapCallback(id, x, false, label))
           } else {
             const id = `__f__${context}-${functionName}-${i}-${invokeId++ %
               Number.MAX_SAFE_INTEGER}`
-            wrapped.push(id)
-            eventEmitter.once(id, a => {
-              try {
-                x.apply(null, a)
-              } catch (err) {
-                console.error(
-                  `[VrpcNative ${context}-${functionName}]: Failed to execute callback, because: ${err.message}`
-                )
-              }
-            })
+            wrapped.push(wrapCallback(id, x, true, label))
           }
         } else if (VrpcNative._isEmitter(x)) {
           const { emitter, event } = x
           const id = `__f__${context}-${functionName}-${i}-${event}`
-          wrapped.push(id)
-          eventEmitter.on(id, a => emitter.emit(event, ...a))
+          const emit = (...a) => emitter.emit(event, ...a)
+          wrapped.push(wrapCallback(id, emit, false, label))
         } else {
           wrapped.push(x)
         }
@@ -148,7 +193,7 @@ class VrpcNative {
         const instanceId = nanoid(8)
         const { r } = JSON.parse(
           adapter.call(
-            JSON.stringify({
+            VrpcNative._stringify({
               c: className,
               f: '__createIsolated__',
               a: [instanceId, ...args]
@@ -157,61 +202,37 @@ class VrpcNative {
         )
         this.vrpcInstanceId = r
         this.vrpcProxyId = `${classId}-${proxyId++}`
+        const handles = resolve(r, memberSignatures)
         memberFuncs.forEach(f => {
           this[f] = (...args) => {
-            const { r, e } = JSON.parse(
-              adapter.call(
-                JSON.stringify({
-                  f,
-                  c: this.vrpcInstanceId,
-                  a: wrapArguments(this.vrpcProxyId, f, ...args)
-                })
-              )
+            return invoke(
+              {
+                f,
+                c: this.vrpcInstanceId,
+                a: wrapArguments(this.vrpcProxyId, f, ...args)
+              },
+              handles
             )
-            if (e) throw new Error(e)
-            // Handle functions returning a promise
-            if (typeof r === 'string' && r.substr(0, 5) === '__p__') {
-              return new Promise((resolve, reject) => {
-                eventEmitter.once(r, data => {
-                  if (data.e) reject(new Error(data.e))
-                  else resolve(data.r)
-                })
-              })
-            }
-            return r
           }
         })
         if (!memberFuncs.has('vrpcOn') && !memberFuncs.has('vrpcOff')) {
           this.vrpcOn = (functionName, ...args) => {
             if (!memberFuncs.has(functionName)) throw new Error('Bad magic')
-            const { r, e } = JSON.parse(
-              adapter.call(
-                JSON.stringify({
-                  f: functionName,
-                  c: this.vrpcInstanceId,
-                  a: wrapArguments(
-                    this.vrpcProxyId,
-                    `vrpcOn:${functionName}`,
-                    ...args
-                  )
-                })
-              )
+            return invoke(
+              {
+                f: functionName,
+                c: this.vrpcInstanceId,
+                a: wrapArguments(
+                  this.vrpcProxyId,
+                  `vrpcOn:${functionName}`,
+                  ...args
+                )
+              },
+              handles
             )
-            if (e) throw new Error(e)
-            // Handle functions returning a promise
-            if (typeof r === 'string' && r.substr(0, 5) === '__p__') {
-              return new Promise((resolve, reject) => {
-                eventEmitter.once(r, data => {
-                  if (data.e) reject(new Error(data.e))
-                  else resolve(data.r)
-                })
-              })
-            }
-            return r
           }
           this.vrpcOff = functionName => {
-            const id = `__f__${this.vrpcProxyId}-vrpcOn:${functionName}`
-            eventEmitter.removeAllListeners(id)
+            unwrapCallbacks(`__f__${this.vrpcProxyId}-vrpcOn:${functionName}`)
           }
         }
       }
@@ -223,29 +244,21 @@ class VrpcNative {
     // inject static functions
     staticFuncs.forEach(f => {
       Klass[f] = (...args) => {
-        return JSON.parse(
-          adapter.call(
-            JSON.stringify({
-              f,
-              c: className,
-              a: wrapArguments(className, f, ...args)
-            })
-          )
-        ).r
+        const json = { f, c: className, a: wrapArguments(className, f, ...args) }
+        if (this._async || this._batch) return invoke(json, staticHandles)
+        return this._handleStaticReturn(call(json, staticHandles))
       }
     })
     if (!staticFuncs.has('vrpcOn')) {
       Klass.vrpcOn = (functionName, ...args) => {
         if (!staticFuncs.has(functionName)) throw new Error('Bad magic')
-        return JSON.parse(
-          adapter.call(
-            JSON.stringify({
-              f: functionName,
-              c: className,
-              a: wrapArguments(className, `vrpcOn:${functionName}`, ...args)
-            })
-          )
-        ).r
+        const json = {
+          f: functionName,
+          c: className,
+          a: wrapArguments(className, `vrpcOn:${functionName}`, ...args)
+        }
+        if (this._async || this._batch) return invoke(json, staticHandles)
+        return this._handleStaticReturn(call(json, staticHandles))
       }
     }
     return Klass
@@ -265,7 +278,7 @@ class VrpcNative {
       f: '__delete__',
       a: [proxy.vrpcInstanceId]
     }
-    return JSON.parse(this._adapter.call(JSON.stringify(json))).r
+    return JSON.parse(this._adapter.call(VrpcNative._stringify(json))).r
   }
 
   /**
@@ -279,51 +292,33 @@ class VrpcNative {
    */
   callStatic (className, functionName, ...args) {
     if (functionName === 'vrpcOff') {
-      const id = `__f__${className}-vrpcOn:${args[0]}`
-      this._eventEmitter.removeAllListeners(id)
+      this._unwrapCallbacks(`__f__${className}-vrpcOn:${args[0]}`)
     }
     const wrapped = []
     args.forEach((x, i) => {
       // Check whether provided argument is a function
+      const label = `${className}-${functionName}`
       if (VrpcNative._isFunction(x)) {
         if (functionName.startsWith('vrpcOn')) {
           const id = `__f__${className}-${functionName}:${args[0]}`
-          wrapped.push(id)
-          this._eventEmitter.on(id, a => {
-            try {
-              x.apply(null, a)
-            } catch (err) {
-              console.error(
-                `[VrpcNative ${className}-${functionName}]: Failed to execute callback, because: ${err.message}`
-              )
-            }
-          })
+          wrapped.push(this._wrapCallback(id, x, false, label))
         } else {
           const id = `__f__${className}-${functionName}-${i}-${invokeId++ %
             Number.MAX_SAFE_INTEGER}`
-          wrapped.push(id)
-          this._eventEmitter.once(id, a => {
-            try {
-              x.apply(null, a)
-            } catch (err) {
-              console.error(
-                `[VrpcNative ${className}-${functionName}]: Failed to execute callback, because: ${err.message}`
-              )
-            }
-          })
+          wrapped.push(this._wrapCallback(id, x, true, label))
         }
       } else if (VrpcNative._isEmitter(x)) {
         const { emitter, event } = x
         const id = `__f__${className}-${functionName}-${i}-${event}`
-        wrapped.push(id)
-        this._eventEmitter.on(id, a => emitter.emit(event, ...a))
+        const emit = (...a) => emitter.emit(event, ...a)
+        wrapped.push(this._wrapCallback(id, emit, false, label))
       } else {
         wrapped.push(x)
       }
     })
     return JSON.parse(
       this._adapter.call(
-        JSON.stringify({
+        VrpcNative._stringify({
           c: className,
           f: functionName === 'vrpcOn' ? args[0] : functionName,
           a: wrapped
@@ -341,8 +336,323 @@ class VrpcNative {
     return JSON.parse(this._adapter.getClasses())
   }
 
+  /**
+   * Attaches a delivery policy to a callback
+   *
+   * The policy decides how events are queued, which are fired from native
+   * threads faster than they are consumed. It overrides the policy the native
+   * function was bound with (see VRPC_CALLBACK_X).
+   *
+   * @param {Function} callback A callback to be handed over to a proxy function
+   * @param {Object} policy
+   * @param {String} policy.delivery Either 'all' (every event is delivered),
+   * 'latest' (only the latest of the pending events is delivered), 'dropOldest'
+   * (the oldest pending events are dropped) or 'blockProducer' (the native
+   * thread waits for pending events to be delivered, unless the main thread
+   * is blocked by a synchronous call)
+   * @param {Number} [policy.capacity=1] Maximum number of pending events
+   * ('dropOldest' and 'blockProducer' only)
+   * @returns {Function} The callback carrying the policy
+   */
+  static withDelivery (callback, { delivery, capacity = 1 }) {
+    const wrapped = (...args) => callback(...args)
+    wrapped[DELIVERY] = { delivery, capacity }
+    return wrapped
+  }
+
+  /**
+   * Provides the number of events dropped or coalesced by delivery policies
+   *
+   * @returns {Object} Counters `dropped` and `coalesced`
+   */
+  getCallbackStats () {
+    if (typeof this._adapter.getCallbackStats !== 'function') {
+      return { dropped: 0, coalesced: 0 }
+    }
+    return this._adapter.getCallbackStats()
+  }
+
+  /**
+   * Sets the number of threads executing asynchronous calls
+   *
+   * Calls on the same instance execute one after the other and in the order
+   * they were made, calls on different instances and static functions execute
+   * in parallel. The thread pool is shared by all worker threads of the
+   * process and defaults to the number of cores.
+   *
+   * @param {Number} size Number of threads (at least one)
+   */
+  setPoolSize (size) {
+    if (typeof this._adapter.setPoolSize !== 'function') return
+    this._adapter.setPoolSize(size)
+  }
+
+  /**
+   * Provides the number of threads executing asynchronous calls
+   *
+   * @returns {Number} Number of threads, zero if the addon has no thread pool
+   */
+  getPoolSize () {
+    if (typeof this._adapter.getPoolSize !== 'function') return 0
+    return this._adapter.getPoolSize()
+  }
+
   // private:
 
+  // Returns the id the native side calls the callback with
+  _wrapCallback (id, callback, once, label) {
+    const invoke = (...a) => {
+      try {
+        callback.apply(null, a)
+      } catch (err) {
+        console.error(
+          `[VrpcNative ${label}]: Failed to execute callback, because: ${err.message}`
+        )
+      }
+    }
+    if (typeof this._adapter.registerCallback !== 'function') {
+      this._setDelivery(id, callback)
+      if (once) {
+        this._eventEmitter.once(id, a => {
+          this._clearDelivery(id)
+          invoke(...a)
+        })
+      } else {
+        this._eventEmitter.on(id, a => invoke(...a))
+      }
+      return id
+    }
+    // Registered callbacks are invoked directly by the addon, once-only
+    // ones are released by the addon after their first invocation
+    const callbackId = this._adapter.registerCallback(
+      once
+        ? (...a) => {
+            this._clearDelivery(callbackId)
+            invoke(...a)
+          }
+        : invoke,
+      once
+    )
+    this._setDelivery(callbackId, callback)
+    if (!once) {
+      const callbackIds = this._callbackIds.get(id) || []
+      callbackIds.push(callbackId)
+      this._callbackIds.set(id, callbackIds)
+    }
+    return callbackId
+  }
+
+  _unwrapCallbacks (id) {
+    this._eventEmitter.removeAllListeners(id)
+    this._clearDelivery(id)
+    for (const callbackId of this._callbackIds.get(id) || []) {
+      this._clearDelivery(callbackId)
+      this._adapter.releaseCallback(callbackId)
+    }
+    this._callbackIds.delete(id)
+  }
+
+  _setDelivery (id, callback) {
+    const policy = callback[DELIVERY]
+    if (!policy || typeof this._adapter.setCallbackPolicy !== 'function') return
+    this._adapter.setCallbackPolicy(id, policy.delivery, policy.capacity)
+    this._deliveries.add(id)
+  }
+
+  _clearDelivery (id) {
+    if (this._deliveries.delete(id)) this._adapter.setCallbackPolicy(id)
+  }
+
+  _emitCallback (data) {
+    // when a javascript VrpcAdapter was used we will receive an object, in
+    // all other cases data will be a string (crossing language boundaries)
+    const json = typeof data === 'string' ? JSON.parse(data) : data
+    // results of promises carry "r" or "e" instead of arguments
+    if (VrpcNative._isPromiseId(json.i)) {
+      if (!this._eventEmitter.emit(json.i, json)) {
+        this._settledPromises.set(json.i, json)
+      }
+      return
+    }
+    this._eventEmitter.emit(json.i, json.a)
+  }
+
+  _resolve (context, signatures) {
+    // Resolving is optional, javascript adapters for example do not support it
+    const handles = new Map()
+    if (typeof this._adapter.resolve !== 'function') return handles
+    signatures.forEach(x => handles.set(x, this._adapter.resolve(context, x)))
+    return handles
+  }
+
+  _call (json, handles) {
+    const handle = handles && handles.get(json.f + VrpcNative._signature(json.a))
+    if (this._direct && handle !== undefined) {
+      try {
+        return { r: this._adapter.callDirect(handle, json.a) }
+      } catch (err) {
+        return { e: err.message }
+      }
+    }
+    if (this._binary) {
+      return msgpack.decode(
+        handle !== undefined
+          ? this._adapter.callById(handle, this._encoder.encode(json.a))
+          : this._adapter.callBinary(this._encoder.encode(json))
+      )
+    }
+    if (handle !== undefined) {
+      return JSON.parse(
+        this._adapter.callById(handle, VrpcNative._stringify(json.a))
+      )
+    }
+    return JSON.parse(this._adapter.call(VrpcNative._stringify(json)))
+  }
+
+  _invoke (json, handles) {
+    if (this._batch) return this._enqueue(json)
+    if (this._async) {
+      if (this._timeout) {
+        const n = this._callId++ % Number.MAX_SAFE_INTEGER
+        json.i = `${this._callPrefix}-${n}`
+        json.d = Date.now() + this._timeout
+      }
+      const request = this._binary
+        ? this._encoder.encode(json)
+        : VrpcNative._stringify(json)
+      const pending = this._adapter.callAsync
+        ? this._adapter.callAsync(request)
+        : Promise.resolve().then(() => this._adapter.call(request))
+      const answer = pending.then(ret =>
+        this._handleReturn(
+          typeof ret === 'string' ? JSON.parse(ret) : msgpack.decode(ret)
+        )
+      )
+      return this._timeout ? this._withTimeout(answer, json) : answer
+    }
+    return this._handleReturn(this._call(json, handles))
+  }
+
+  _withTimeout (answer, { c, f, i }) {
+    return new Promise((resolve, reject) => {
+      const timer = setTimeout(() => {
+        if (typeof this._adapter.cancel === 'function') this._adapter.cancel(i)
+        reject(
+          new Error(
+            `Function call "${c}::${f}()" timed out (> ${this._timeout} ms)`
+          )
+        )
+      }, this._timeout)
+      answer.then(
+        ret => {
+          clearTimeout(timer)
+          resolve(ret)
+        },
+        err => {
+          clearTimeout(timer)
+          reject(err)
+        }
+      )
+    })
+  }
+
+  _enqueue (json) {
+    return new Promise((resolve, reject) => {
+      if (this._queue.length === 0) queueMicrotask(() => this._flush())
+      this._queue.push({ json, resolve, reject })
+    })
+  }
+
+  _flush () {
+    const queue = this._queue
+    this._queue = []
+    let rets
+    try {
+      rets = this._callBatch(queue.map(x => x.json))
+    } catch (err) {
+      for (const { reject } of queue) reject(err)
+      return
+    }
+    queue.forEach(({ resolve, reject }, i) => {
+      try {
+        resolve(this._handleReturn(rets[i]))
+      } catch (err) {
+        reject(err)
+      }
+    })
+  }
+
+  _callBatch (requests) {
+    if (typeof this._adapter.callBatch !== 'function') {
+      return requests.map(json => this._call(json))
+    }
+    if (this._binary) {
+      return msgpack.decode(
+        this._adapter.callBatch(
+          this._encoder.encode(requests),
+          this._parallelBatch
+        )
+      )
+    }
+    return JSON.parse(
+      this._adapter.callBatch(
+        VrpcNative._stringify(requests),
+        this._parallelBatch
+      )
+    )
+  }
+
+  _handleReturn ({ r, e }) {
+    if (e) throw new Error(e)
+    // Handle functions returning a promise
+    if (VrpcNative._isPromiseId(r)) {
+      return new Promise((resolve, reject) => {
+        const settle = data => {
+          if (data.e) reject(new Error(data.e))
+          else resolve(data.r)
+        }
+        const data = this._settledPromises.get(r)
+        if (data) {
+          this._settledPromises.delete(r)
+          settle(data)
+        } else {
+          this._eventEmitter.once(r, settle)
+        }
+      })
+    }
+    return r
+  }
+
+  // Static functions return undefined on errors, but await promises
+  _handleStaticReturn (ret) {
+    return VrpcNative._isPromiseId(ret.r) ? this._handleReturn(ret) : ret.r
+  }
+
+  // Mirrors vrpc::get_signature of the C++ adapter
+  static _signature (args) {
+    let signature = ''
+    for (const x of args) {
+      signature += signature ? ':' : '-'
+      if (x === null || x === undefined) signature += 'null'
+      else if (Array.isArray(x) || ArrayBuffer.isView(x)) signature += 'array'
+      else signature += typeof x
+    }
+    return signature
+  }
+
+  // JSON.stringify turns typed arrays into objects (and Buffers into
+  // { type, data }), they are encoded as arrays of numbers instead
+  static _stringify (value) {
+    return JSON.stringify(value, function (key, v) {
+      const original = this[key]
+      return ArrayBuffer.isView(original) ? Array.from(original) : v
+    })
+  }
+
+  static _isPromiseId (v) {
+    return typeof v === 'string' && v.substr(0, 5) === '__p__'
+  }
+
   static _isFunction (v) {
     const getType = {}
     return v && getType.toString.call(v) === '[object Function]'
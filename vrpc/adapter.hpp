@@ -45,13 +45,25 @@ SOFTWARE.
 #define VRPC_VERSION_MINOR 0
 #define VRPC_VERSION_PATCH 0
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <cstdint>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <typeindex>
@@ -59,9 +71,27 @@ SOFTWARE.
 #include <unordered_map>
 #include <utility>
 #include <vector>
+// Coroutines (vrpc::Task) are supported when compiling as C++20
+#if defined(__cpp_impl_coroutine) && !defined(VRPC_WITH_COROUTINES)
+#if __cpp_impl_coroutine >= 201902L && __has_include(<coroutine>)
+#define VRPC_WITH_COROUTINES
+#endif
+#endif
+#ifdef VRPC_WITH_COROUTINES
+#include <coroutine>
+#include <optional>
+#endif
 #if defined(VRPC_WITH_DL) && !defined(_WIN32)
 #include <dlfcn.h>
 #endif
+#ifdef VRPC_WITH_V8
+#include <node_buffer.h>
+#include <v8.h>
+#endif
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #include <vrpc/json.hpp>
 
@@ -88,6 +118,76 @@ struct adl_serializer<std::function<R(Args...)>> {
 };
 }  // namespace vrpc
 
+namespace vrpc {
+
+/**
+ * Binary data, exchanged with javascript as Buffer
+ *
+ * Bytes either own their memory or share it with whoever provided it. Called
+ * directly from javascript, bytes arguments share the memory of the handed
+ * over Buffer (or typed array) and returned bytes are handed over to a Buffer,
+ * both without copying. Shared memory is kept alive as long as any bytes
+ * refer to it, it is not protected against modifications of its owner though.
+ */
+class bytes {
+ public:
+  typedef const std::uint8_t* const_iterator;
+
+  bytes() = default;
+
+  explicit bytes(std::vector<std::uint8_t> data) {
+    auto owner = std::make_shared<std::vector<std::uint8_t>>(std::move(data));
+    _data = owner->data();
+    _size = owner->size();
+    _owner = std::move(owner);
+  }
+
+  bytes(const std::uint8_t* data, std::size_t size)
+      : bytes(std::vector<std::uint8_t>(data, data + size)) {}
+
+  bytes(std::shared_ptr<const void> owner,
+        const std::uint8_t* data,
+        std::size_t size)
+      : _owner(std::move(owner)), _data(data), _size(size) {}
+
+  const std::uint8_t* data() const { return _data; }
+
+  std::size_t size() const { return _size; }
+
+  bool empty() const { return _size == 0; }
+
+  const_iterator begin() const { return _data; }
+
+  const_iterator end() const { return _data + _size; }
+
+  const std::uint8_t& operator[](std::size_t index) const {
+    return _data[index];
+  }
+
+  const std::shared_ptr<const void>& owner() const { return _owner; }
+
+ private:
+  std::shared_ptr<const void> _owner;
+  const std::uint8_t* _data = nullptr;
+  std::size_t _size = 0;
+};
+
+// Bytes are arrays of numbers in json, MessagePack binaries are accepted too
+template <>
+struct adl_serializer<bytes> {
+  static void to_json(json& j, const bytes& b) {
+    j = std::vector<std::uint8_t>(b.begin(), b.end());
+  }
+
+  static void from_json(const json& j, bytes& b) {
+    if (j.is_binary())
+      b = bytes(j.get_binary().data(), j.get_binary().size());
+    else
+      b = bytes(j.get<std::vector<std::uint8_t>>());
+  }
+};
+}  // namespace vrpc
+
 namespace vrpc {
 namespace detail {
 
@@ -221,38 +321,214 @@ auto variadic_bind(const Func& f)
   return detail::variadic_bind(detail::build_indices<sizeof...(Args)>{}, f);
 }
 
+/**
+ * Decides how the events of a callback are queued, if they are fired faster
+ * than they can be delivered
+ *
+ * Only applies to events crossing threads, events fired on the thread the
+ * callback handler lives on are delivered immediately.
+ */
+struct CallbackPolicy {
+  enum Delivery {
+    all,            // queues every event (default)
+    latest,         // keeps only the latest of the pending events
+    drop_oldest,    // queues up to capacity events, dropping the oldest
+    block_producer  // queues up to capacity events, blocking the producer
+  };
+
+  Delivery delivery;
+  std::size_t capacity;
+
+  CallbackPolicy(Delivery delivery = all, std::size_t capacity = 0)
+      : delivery(delivery), capacity(capacity) {}
+};
+
+// Delivery policies to be used with VRPC_CALLBACK_X
+struct deliver_all {
+  static CallbackPolicy policy() { return CallbackPolicy(); }
+};
+
+struct keep_latest {
+  static CallbackPolicy policy() { return CallbackPolicy::latest; }
+};
+
+template <std::size_t Capacity>
+struct drop_oldest {
+  static CallbackPolicy policy() {
+    return CallbackPolicy(CallbackPolicy::drop_oldest, Capacity);
+  }
+};
+
+// Blocks the firing thread, unless the main thread is within a synchronous
+// call (e.g. waiting for the instance locked by the firing call), which lets
+// the queue exceed its capacity instead of deadlocking
+template <std::size_t Capacity>
+struct block_producer {
+  static CallbackPolicy policy() {
+    return CallbackPolicy(CallbackPolicy::block_producer, Capacity);
+  }
+};
+
+/**
+ * Callback argument whose events are delivered according to a policy
+ *
+ * The policy is encoded as return type of the signature (e.g.
+ * callback<keep_latest(double)>), see VRPC_CALLBACK_X. Being a std::function,
+ * it binds to parameters of type const std::function<void(Args...)>&.
+ */
+template <typename Signature>
+class callback;
+
+template <typename Policy, typename... Args>
+class callback<Policy(Args...)> : public std::function<void(Args...)> {
+ public:
+  using std::function<void(Args...)>::function;
+};
+
+template <typename Policy, typename... Args>
+struct adl_serializer<callback<Policy(Args...)>>
+    : adl_serializer<std::function<void(Args...)>> {};
+
+#ifdef VRPC_WITH_V8
+struct V8Scope;
+#endif
+
+/**
+ * A fired callback, kept until it gets delivered
+ *
+ * Events either render to a json envelope, which holds the callback id ("i"),
+ * the arguments ("a") and the sender ("s") of the request the callback was
+ * handed over with (if any), or convert their arguments to V8 values.
+ */
+class CallbackEvent {
+ public:
+  virtual ~CallbackEvent() = default;
+
+  virtual const std::string& callback_id() const = 0;
+
+  virtual const CallbackPolicy& policy() const = 0;
+
+  virtual std::string envelope() const = 0;
+
+#ifdef VRPC_WITH_V8
+  virtual void arguments(const V8Scope& scope,
+                         std::vector<v8::Local<v8::Value>>& argv) const = 0;
+#endif
+};
+
 typedef std::function<void(const json&)> CallbackHandler;
+typedef std::function<void(std::unique_ptr<CallbackEvent>)>
+    EventCallbackHandler;
 
 struct Callback {
   static void register_callback_handler(const CallbackHandler& handler) {
-    detail::init<CallbackHandler>() = handler;
+    detail::init<EventCallbackHandler>() =
+        [handler](std::unique_ptr<CallbackEvent> event) {
+          handler(json::parse(event->envelope()));
+        };
+  }
+
+  static void register_callback_handler(const EventCallbackHandler& handler) {
+    detail::init<EventCallbackHandler>() = handler;
+  }
+};
+
+namespace detail {
+// Handler of the callbacks created on this thread, the registered one if empty
+inline std::shared_ptr<const EventCallbackHandler>& scoped_callback_handler() {
+  static thread_local std::shared_ptr<const EventCallbackHandler> handler;
+  return handler;
+}
+}  // namespace detail
+
+/**
+ * Routes the events of callbacks created during its lifetime (on the same
+ * thread) to the given handler instead of the registered one
+ *
+ * Lets several event loops (e.g. node's worker threads) share the factory,
+ * while each one receives the events of its own callbacks only.
+ */
+class CallbackScope {
+ public:
+  explicit CallbackScope(std::shared_ptr<const EventCallbackHandler> handler)
+      : _previous(std::move(detail::scoped_callback_handler())) {
+    detail::scoped_callback_handler() = std::move(handler);
   }
+
+  ~CallbackScope() {
+    detail::scoped_callback_handler() = std::move(_previous);
+  }
+
+  CallbackScope(const CallbackScope&) = delete;
+  CallbackScope& operator=(const CallbackScope&) = delete;
+
+ private:
+  std::shared_ptr<const EventCallbackHandler> _previous;
 };
 
 namespace detail {
 
+// Appends the arguments as json array (defined along with the writers)
+template <typename... Args>
+void write_arguments(std::string& out, const Args&... args);
+
+// What all events of a callback share
+struct CallbackBase {
+  std::string _callback_id;
+  // Start of every envelope, only the arguments are rendered per event
+  std::string _prefix;
+  CallbackPolicy _policy;
+  // Captured on construction, see CallbackScope
+  std::shared_ptr<const EventCallbackHandler> _handler;
+
+  explicit CallbackBase(std::string callback_id, const json* sender = nullptr)
+      : _callback_id(std::move(callback_id)),
+        _handler(scoped_callback_handler()) {
+    _prefix = "{\"i\":" + json(_callback_id).dump();
+    if (sender != nullptr) {
+      _prefix += ",\"s\":";
+      _prefix += sender->dump();
+    }
+    _prefix += ",\"a\":";
+  }
+};
+
+// Holds copies of the arguments (defined along with the writers)
+template <typename... Args>
+class CallbackEventT;
+
+inline const json* find_sender(const json& request) {
+  const auto sender = request.find("s");
+  return sender != request.end() ? &*sender : nullptr;
+}
+
 template <typename T>
 struct CallbackT;
 
 template <typename R, typename... Args>
 struct CallbackT<std::function<R(Args...)>>
     : public std::enable_shared_from_this<CallbackT<std::function<R(Args...)>>>,
+      public CallbackBase,
       public vrpc::Callback {
-  json _json;
-  std::string _callback_id;
+  CallbackT(const json& request, int index)
+      : CallbackBase(request["a"][index].get<std::string>(),
+                     find_sender(request)) {
+    _VRPC_DEBUG << "Constructed with: " << _prefix << std::endl;
+  }
 
-  CallbackT(const json& json, int index)
-      : _json(json), _callback_id(json["a"][index].get<std::string>()) {
-    _VRPC_DEBUG << "Constructed with: " << _json << " and " << _callback_id
-                << std::endl;
+  explicit CallbackT(std::string callback_id)
+      : CallbackBase(std::move(callback_id)) {
+    _VRPC_DEBUG << "Constructed with: " << _prefix << std::endl;
   }
 
   void wrapper(Args... args) {
-    _json["a"] = pack(args...);
-    _json["i"] = _callback_id;
-    _VRPC_DEBUG << "Triggering callback: " << _callback_id
-                << " with payload: " << _json["a"] << std::endl;
-    detail::init<CallbackHandler>()(_json);
+    _VRPC_DEBUG << "Triggering callback: " << _callback_id << std::endl;
+    std::unique_ptr<CallbackEvent> event(new CallbackEventT<Args...>(
+        this->shared_from_this(), std::forward<Args>(args)...));
+    if (_handler)
+      (*_handler)(std::move(event));
+    else
+      detail::init<EventCallbackHandler>()(std::move(event));
   }
 
   auto bind_wrapper() {
@@ -264,6 +540,16 @@ struct CallbackT<std::function<R(Args...)>>
   }
 };
 
+template <typename Policy, typename... Args>
+struct CallbackT<callback<Policy(Args...)>>
+    : public CallbackT<std::function<void(Args...)>> {
+  template <typename... Ts>
+  explicit CallbackT(Ts&&... ts)
+      : CallbackT<std::function<void(Args...)>>(std::forward<Ts>(ts)...) {
+    this->_policy = Policy::policy();
+  }
+};
+
 template <typename... Args>
 struct is_std_function : std::false_type {};
 
@@ -273,43 +559,223 @@ struct is_std_function<std::function<void(Args...)>> : std::true_type {};
 template <typename... Args>
 struct is_std_function<const std::function<void(Args...)>&> : std::true_type {};
 
+template <typename Policy, typename... Args>
+struct is_std_function<callback<Policy(Args...)>> : std::true_type {};
+
+template <typename Policy, typename... Args>
+struct is_std_function<const callback<Policy(Args...)>&> : std::true_type {};
+
+template <typename T, typename = void>
+struct has_move_from_json : std::false_type {};
+
+template <typename T>
+struct has_move_from_json<T,
+                          decltype(move_from_json(std::declval<json&>(),
+                                                  std::declval<T&>()))>
+    : std::true_type {};
+
+/**
+ * Extracts a value from json, stealing the storage of strings, arrays and
+ * objects instead of copying it
+ *
+ * The json is left in a valid but unspecified state. Types without a moving
+ * conversion (see VRPC_DEFINE_TYPE) and mismatching json types fall back to
+ * json::get(), so conversions and errors stay the same.
+ */
+template <typename T, typename = void>
+struct move_out {
+  static T get(json& j) { return get(j, has_move_from_json<T>()); }
+
+ private:
+  static T get(json& j, std::true_type) {
+    if (!j.is_object()) return j.get<T>();
+    T t;
+    move_from_json(j, t);
+    return t;
+  }
+
+  static T get(json& j, std::false_type) { return j.get<T>(); }
+};
+
+template <>
+struct move_out<json> {
+  static json get(json& j) { return std::move(j); }
+};
+
+template <>
+struct move_out<std::string> {
+  static std::string get(json& j) {
+    if (!j.is_string()) return j.get<std::string>();
+    return std::move(j.get_ref<std::string&>());
+  }
+};
+
+template <typename T, typename Allocator>
+struct move_out<std::vector<T, Allocator>> {
+  static std::vector<T, Allocator> get(json& j) {
+    if (j.is_binary()) return get_binary(j, std::is_arithmetic<T>());
+    if (!j.is_array()) return j.get<std::vector<T, Allocator>>();
+    std::vector<T, Allocator> v;
+    v.reserve(j.size());
+    for (auto& item : j) v.push_back(move_out<T>::get(item));
+    return v;
+  }
+
+ private:
+  // Binaries (e.g. javascript Buffers) hold one number per byte
+  static std::vector<T, Allocator> get_binary(json& j, std::true_type) {
+    const json::binary_t& b = j.get_binary();
+    return std::vector<T, Allocator>(b.begin(), b.end());
+  }
+
+  static std::vector<T, Allocator> get_binary(json& j, std::false_type) {
+    return j.get<std::vector<T, Allocator>>();
+  }
+};
+
+template <>
+struct move_out<bytes> {
+  static bytes get(json& j) {
+    if (!j.is_binary()) return j.get<bytes>();
+    return bytes(std::move(static_cast<std::vector<std::uint8_t>&>(
+        j.get_binary())));
+  }
+};
+
+template <typename Map>
+struct move_out_map {
+  static Map get(json& j) {
+    if (!j.is_object()) return j.get<Map>();
+    Map m;
+    for (auto it = j.begin(); it != j.end(); ++it) {
+      m.emplace(it.key(), move_out<typename Map::mapped_type>::get(it.value()));
+    }
+    return m;
+  }
+};
+
+template <typename T, typename Hash, typename KeyEqual, typename Allocator>
+struct move_out<std::unordered_map<std::string, T, Hash, KeyEqual, Allocator>>
+    : move_out_map<
+          std::unordered_map<std::string, T, Hash, KeyEqual, Allocator>> {};
+
+template <typename T, typename Compare, typename Allocator>
+struct move_out<std::map<std::string, T, Compare, Allocator>>
+    : move_out_map<std::map<std::string, T, Compare, Allocator>> {};
+
+/**
+ * Extracts a value from json like move_out, but leaves the json untouched
+ * (e.g. arguments shared by several calls)
+ */
+template <typename T, typename = void>
+struct copy_out {
+  static T get(const json& j) { return j.get<T>(); }
+};
+
+template <typename T, typename Allocator>
+struct copy_out<std::vector<T, Allocator>> {
+  static std::vector<T, Allocator> get(const json& j) {
+    if (j.is_binary()) return get_binary(j, std::is_arithmetic<T>());
+    if (!j.is_array()) return j.get<std::vector<T, Allocator>>();
+    std::vector<T, Allocator> v;
+    v.reserve(j.size());
+    for (const auto& item : j) v.push_back(copy_out<T>::get(item));
+    return v;
+  }
+
+ private:
+  static std::vector<T, Allocator> get_binary(const json& j, std::true_type) {
+    const json::binary_t& b = j.get_binary();
+    return std::vector<T, Allocator>(b.begin(), b.end());
+  }
+
+  static std::vector<T, Allocator> get_binary(const json& j, std::false_type) {
+    return j.get<std::vector<T, Allocator>>();
+  }
+};
+
+template <>
+struct copy_out<bytes> {
+  static bytes get(const json& j) {
+    if (!j.is_binary()) return j.get<bytes>();
+    const json::binary_t& b = j.get_binary();
+    return bytes(std::vector<std::uint8_t>(b.begin(), b.end()));
+  }
+};
+
+template <typename Map>
+struct copy_out_map {
+  static Map get(const json& j) {
+    if (!j.is_object()) return j.get<Map>();
+    Map m;
+    for (auto it = j.begin(); it != j.end(); ++it) {
+      m.emplace(it.key(), copy_out<typename Map::mapped_type>::get(it.value()));
+    }
+    return m;
+  }
+};
+
+template <typename T, typename Hash, typename KeyEqual, typename Allocator>
+struct copy_out<std::unordered_map<std::string, T, Hash, KeyEqual, Allocator>>
+    : copy_out_map<
+          std::unordered_map<std::string, T, Hash, KeyEqual, Allocator>> {};
+
+template <typename T, typename Compare, typename Allocator>
+struct copy_out<std::map<std::string, T, Compare, Allocator>>
+    : copy_out_map<std::map<std::string, T, Compare, Allocator>> {};
+
+// Argument I of the request, moved out unless the request is const
+template <typename T>
+T take_argument(json& j, int i) {
+  return move_out<T>::get(j["a"][i]);
+}
+
+template <typename T>
+T take_argument(const json& j, int i) {
+  return copy_out<T>::get(j.at("a").at(i));
+}
+
 template <int I, typename... Args>
 struct unpack_impl;
 
 /* This specialization will remove reference and CV qualifier and bring
- * back the recursion to the standard path using json::get().
- * Really, it should use json::get_ref() in combination with
- * std::tie(), however currently json does not support custom types in refs.
+ * back the recursion to the standard path. Arguments are moved out of the
+ * request, which is not needed any longer once the function got called,
+ * unless the request is const (J being const json).
  */
 template <int I, typename A, typename... Args>
 struct unpack_impl<I, A, Args...> {
-  template <typename T = A,
+  template <typename J,
+            typename T = A,
             typename std::enable_if<std::is_reference<T>::value &&
                                         !is_std_function<T>::value,
                                     int>::type = 0>
-  static auto unpack(json& j) -> decltype(std::tuple_cat(
+  static auto unpack(J& j) -> decltype(std::tuple_cat(
       std::make_tuple(std::declval<no_ref_no_const<T>>()),
       unpack_impl<I + 1, Args...>::unpack(j))) {
     typedef typename std::remove_const<
         typename std::remove_reference<T>::type>::type T_no_ref_no_const;
-    return std::tuple_cat(std::make_tuple(j["a"][I].get<T_no_ref_no_const>()),
-                          unpack_impl<I + 1, Args...>::unpack(j));
+    return std::tuple_cat(
+        std::make_tuple(take_argument<T_no_ref_no_const>(j, I)),
+        unpack_impl<I + 1, Args...>::unpack(j));
   }
 
-  template <typename T = A,
+  template <typename J,
+            typename T = A,
             typename std::enable_if<!std::is_reference<T>::value &&
                                         !is_std_function<T>::value,
                                     int>::type = 0>
-  static auto unpack(json& j)
+  static auto unpack(J& j)
       -> decltype(std::tuple_cat(std::make_tuple(std::declval<T>()),
                                  unpack_impl<I + 1, Args...>::unpack(j))) {
-    return std::tuple_cat(std::make_tuple(j["a"][I].get<T>()),
+    return std::tuple_cat(std::make_tuple(take_argument<T>(j, I)),
                           unpack_impl<I + 1, Args...>::unpack(j));
   }
 
-  template <typename T = A,
+  template <typename J,
+            typename T = A,
             typename std::enable_if<is_std_function<T>::value, int>::type = 0>
-  static auto unpack(json& j) {
+  static auto unpack(J& j) {
     // TODO hand over the index as template parameter
     auto ptr = std::make_shared<CallbackT<no_ref_no_const<T>>>(j, I);
     return std::tuple_cat(std::make_tuple(ptr->bind_wrapper()),
@@ -319,25 +785,28 @@ struct unpack_impl<I, A, Args...> {
 
 template <int I, typename A>
 struct unpack_impl<I, A> {
-  template <typename T = A,
+  template <typename J,
+            typename T = A,
             typename std::enable_if<std::is_reference<T>::value &&
                                         !is_std_function<T>::value,
                                     int>::type = 0>
-  static std::tuple<no_ref_no_const<T>> unpack(json& j) {
-    return std::make_tuple(j["a"][I].get<no_ref_no_const<T>>());
+  static std::tuple<no_ref_no_const<T>> unpack(J& j) {
+    return std::make_tuple(take_argument<no_ref_no_const<T>>(j, I));
   }
 
-  template <typename T = A,
+  template <typename J,
+            typename T = A,
             typename std::enable_if<!std::is_reference<T>::value &&
                                         !is_std_function<T>::value,
                                     int>::type = 0>
-  static std::tuple<T> unpack(json& j) {
-    return std::make_tuple(j["a"][I].get<T>());
+  static std::tuple<T> unpack(J& j) {
+    return std::make_tuple(take_argument<T>(j, I));
   }
 
-  template <typename T = A,
+  template <typename J,
+            typename T = A,
             typename std::enable_if<is_std_function<T>::value, int>::type = 0>
-  static auto unpack(json& j) {
+  static auto unpack(J& j) {
     auto ptr = std::make_shared<CallbackT<no_ref_no_const<T>>>(j, I);
     return std::make_tuple(ptr->bind_wrapper());
   }
@@ -345,7 +814,10 @@ struct unpack_impl<I, A> {
 
 template <int I>
 struct unpack_impl<I> {
-  static std::tuple<> unpack(json&) { return {}; }
+  template <typename J>
+  static std::tuple<> unpack(J&) {
+    return {};
+  }
 };
 }  // namespace detail
 
@@ -359,448 +831,3526 @@ auto unpack(json& j) -> decltype(detail::unpack_impl<0, Args...>::unpack(j)) {
   return detail::unpack_impl<0, Args...>::unpack(j);
 }
 
+// Same, but copies the arguments, leaving the request untouched
+template <typename... Args>
+auto unpack(const json& j)
+    -> decltype(detail::unpack_impl<0, Args...>::unpack(j)) {
+  return detail::unpack_impl<0, Args...>::unpack(j);
+}
+
+#ifdef VRPC_WITH_V8
+/**
+ * Everything needed to read or create V8 values
+ */
+struct V8Scope {
+  v8::Isolate* isolate;
+  v8::Local<v8::Context> context;
+  // Numeric vectors and bytes become plain arrays (as in json) if false
+  bool typed_arrays = true;
+};
+
+/**
+ * Converts between V8 values and C++ types, without using json
+ *
+ * Similar to adl_serializer, the default implementation forwards to the free
+ * functions to_v8 and from_v8 found by argument dependent lookup (as generated
+ * by VRPC_DEFINE_TYPE). Types lacking those are converted through json.
+ * Specialize this template to support further types.
+ */
+template <typename T, typename = void>
+struct v8_converter;
+
 namespace detail {
 
-template <std::size_t I = 0, typename... Args>
-inline typename std::enable_if<I == sizeof...(Args), void>::type get_signature(
-    const std::string& signature,
-    const std::tuple<Args...>&) {
-  // end recursion
+inline std::string v8_type_name(v8::Local<v8::Value> value) {
+  if (value->IsNullOrUndefined()) return "null";
+  if (value->IsBoolean()) return "boolean";
+  if (value->IsNumber()) return "number";
+  if (value->IsString()) return "string";
+  if (value->IsArray()) return "array";
+  return "object";
+}
+
+inline void v8_expect(bool condition,
+                      const char* type,
+                      v8::Local<v8::Value> value) {
+  if (!condition) {
+    throw std::invalid_argument(std::string("type must be ") + type +
+                                ", but is " + v8_type_name(value));
+  }
 }
 
-template <std::size_t I = 0, typename... Args>
-    inline typename std::enable_if <
-    I<sizeof...(Args), void>::type get_signature(std::string& signature,
-                                                 const std::tuple<Args...>& t) {
-  json j = {{"t", std::get<I>(t)}};
-  if (!signature.empty()) signature += ":";
-  signature += j["t"].type_name();
-  return get_signature<I + 1, Args...>(signature, t);
+template <typename T>
+inline v8::Local<T> v8_checked(v8::MaybeLocal<T> maybe) {
+  v8::Local<T> local;
+  if (!maybe.ToLocal(&local)) {
+    throw std::runtime_error("Failed accessing javascript value");
+  }
+  return local;
 }
-}  // namespace detail
 
-template <typename... Args>
-inline std::string get_signature() {
-  std::string signature;
-  detail::get_signature(
-      signature, std::tuple<typename std::remove_reference<Args>::type...>());
-  return signature.empty() ? signature : "-" + signature;
+inline v8::Local<v8::String> v8_key(const V8Scope& scope, const char* key) {
+  return v8::String::NewFromUtf8(scope.isolate, key,
+                                 v8::NewStringType::kInternalized)
+      .ToLocalChecked();
 }
 
-inline std::string get_signature(const json& json) {
-  std::string signature;
-  for (const auto& it : json) {
-    if (!signature.empty()) signature += ":";
-    signature += it.type_name();
+inline v8::Local<v8::Object> v8_object(v8::Local<v8::Value> value) {
+  v8_expect(value->IsObject() && !value->IsArray(), "object", value);
+  return value.As<v8::Object>();
+}
+
+inline v8::Local<v8::Value> v8_member(const V8Scope& scope,
+                                      v8::Local<v8::Object> object,
+                                      const char* key) {
+  v8::Local<v8::String> name = v8_key(scope, key);
+  if (!object->Has(scope.context, name).FromMaybe(false)) {
+    throw std::out_of_range(std::string("key '") + key + "' not found");
   }
-  return signature.empty() ? signature : "-" + signature;
+  return v8_checked(object->Get(scope.context, name));
 }
 
-namespace detail {
+template <typename T, typename = void>
+struct has_v8_functions : std::false_type {};
 
 template <typename T>
-struct is_shared_ptr : std::false_type {};
+struct has_v8_functions<
+    T,
+    decltype(void(from_v8(std::declval<const V8Scope&>(),
+                          std::declval<v8::Local<v8::Value>>(),
+                          std::declval<T&>())),
+             void(to_v8(std::declval<const V8Scope&>(),
+                        std::declval<const T&>())))> : std::true_type {};
 
 template <typename T>
-struct is_shared_ptr<std::shared_ptr<T>> : std::true_type {};
-}  // namespace detail
+inline void adl_from_v8(const V8Scope& scope,
+                        v8::Local<v8::Value> value,
+                        T& t,
+                        std::true_type) {
+  from_v8(scope, value, t);
+}
 
-// Value class
-class Value {
- public:
-  Value() noexcept : content(0) {}
+template <typename T>
+inline void adl_from_v8(const V8Scope& scope,
+                        v8::Local<v8::Value> value,
+                        T& t,
+                        std::false_type) {
+  if (value->IsUndefined()) {
+    json(nullptr).get_to(t);
+    return;
+  }
+  v8::String::Utf8Value utf8(
+      scope.isolate, v8_checked(v8::JSON::Stringify(scope.context, value)));
+  json::parse(*utf8, *utf8 + utf8.length()).get_to(t);
+}
 
-  template <typename T>
-  Value(const T& value)
-      : content(new holder<
-                typename std::remove_cv<typename std::decay<T>::type>::type>(
-            value)) {}
+template <typename T>
+inline v8::Local<v8::Value> adl_to_v8(const V8Scope& scope,
+                                      const T& t,
+                                      std::true_type) {
+  return to_v8(scope, t);
+}
 
-  Value(const char* const& value) : Value(std::string(value)) {}
+template <typename T>
+inline v8::Local<v8::Value> adl_to_v8(const V8Scope& scope,
+                                      const T& t,
+                                      std::false_type) {
+  const std::string str = json(t).dump();
+  return v8_checked(v8::JSON::Parse(
+      scope.context, v8_checked(v8::String::NewFromUtf8(
+                         scope.isolate, str.data(), v8::NewStringType::kNormal,
+                         static_cast<int>(str.size())))));
+}
+}  // namespace detail
 
-  /// Copy constructor
-  Value(const Value& other)
-      : content(other.content ? other.content->clone() : 0) {}
+template <typename T, typename>
+struct v8_converter {
+  static void from_v8(const V8Scope& scope, v8::Local<v8::Value> value, T& t) {
+    detail::adl_from_v8(scope, value, t, detail::has_v8_functions<T>());
+  }
 
-  /// Move constructor
-  Value(Value&& other) : content(other.content) { other.content = 0; }
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, const T& t) {
+    return detail::adl_to_v8(scope, t, detail::has_v8_functions<T>());
+  }
+};
 
-  template <typename T>
-  Value(T&& value,
-        typename std::enable_if<!std::is_same<Value&, T>::value>::type* = 0,
-        typename std::enable_if<!std::is_const<T>::value>::type* = 0,
-        typename std::enable_if<!detail::is_shared_ptr<T>::value>::type* = 0)
-      : content(new holder<
-                typename std::remove_cv<typename std::decay<T>::type>::type>(
-            std::forward<T>(value))) {}
+template <>
+struct v8_converter<bool> {
+  static void from_v8(const V8Scope&, v8::Local<v8::Value> value, bool& t) {
+    detail::v8_expect(value->IsBoolean(), "boolean", value);
+    t = value.As<v8::Boolean>()->Value();
+  }
 
-  ~Value() noexcept { delete content; }
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, bool t) {
+    return v8::Boolean::New(scope.isolate, t);
+  }
+};
 
- public:  // functions
-  Value& swap(Value& rhs) noexcept {
-    std::swap(content, rhs.content);
-    return *this;
+template <typename T>
+struct v8_converter<
+    T,
+    typename std::enable_if<std::is_arithmetic<T>::value &&
+                            !std::is_same<T, bool>::value>::type> {
+  static void from_v8(const V8Scope&, v8::Local<v8::Value> value, T& t) {
+    detail::v8_expect(value->IsNumber(), "number", value);
+    const double number = value.As<v8::Number>()->Value();
+    // Casting values T can not hold is undefined (json rejects NaN as null)
+    check(number, value, std::is_integral<T>());
+    t = static_cast<T>(number);
   }
 
-  Value& operator=(const Value& rhs) {
-    Value(rhs).swap(*this);
-    return *this;
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, T t) {
+    return v8::Number::New(scope.isolate, static_cast<double>(t));
   }
 
-  Value& operator=(Value&& rhs) noexcept {
-    rhs.swap(*this);
-    Value().swap(rhs);
-    return *this;
+ private:
+  static void check(double number,
+                    v8::Local<v8::Value> value,
+                    std::true_type) {
+    // Bounds are powers of two, hence exact as double
+    const double upper = std::ldexp(1.0, std::numeric_limits<T>::digits);
+    const double lower = static_cast<double>(std::numeric_limits<T>::min());
+    detail::v8_expect(
+        number >= lower && number < upper && std::trunc(number) == number,
+        "integer in range", value);
   }
 
-  template <typename T>
-  Value& operator=(T&& rhs) {
-    Value(static_cast<T&&>(rhs)).swap(*this);
-    return *this;
+  static void check(double number,
+                    v8::Local<v8::Value> value,
+                    std::false_type) {
+    const double max = static_cast<double>(std::numeric_limits<T>::max());
+    detail::v8_expect(std::isfinite(number) && std::fabs(number) <= max,
+                      "finite number in range", value);
   }
+};
 
-  Value& operator=(const char* const& rhs) {
-    Value(std::string(rhs)).swap(*this);
-    return *this;
+template <>
+struct v8_converter<std::string> {
+  static void from_v8(const V8Scope& scope,
+                      v8::Local<v8::Value> value,
+                      std::string& t) {
+    detail::v8_expect(value->IsString(), "string", value);
+    v8::String::Utf8Value utf8(scope.isolate, value);
+    t.assign(*utf8, utf8.length());
   }
 
-  // NOTE: Windows compiler is broken here
-  // template <typename T>
-  // operator const T&() const {
-  //   return const_cast<Value*> (this)->template get<T>();
-  // }
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope,
+                                    const std::string& t) {
+    return detail::v8_checked(v8::String::NewFromUtf8(
+        scope.isolate, t.data(), v8::NewStringType::kNormal,
+        static_cast<int>(t.size())));
+  }
+};
 
-  // template <typename T>
-  // operator T() const {
-  //   return const_cast<Value*> (this)->template get<T>();
-  // }
+namespace detail {
 
-  template <typename T>
-  T& operator=(T& rhs) {
-    Value(rhs).swap(*this);
-    return *this;
-  }
+template <bool Arithmetic, bool Float, std::size_t Size, bool Signed>
+struct v8_typed_array_of {};
 
-  bool empty() const noexcept { return !content; }
+#define VRPC_V8_TYPED_ARRAY(Float, Size, Signed, Type)                        \
+  template <>                                                                 \
+  struct v8_typed_array_of<true, Float, Size, Signed> {                       \
+    typedef v8::Type type;                                                    \
+    static bool is(v8::Local<v8::Value> value) { return value->Is##Type(); }  \
+  };
 
-  void clear() noexcept { Value().swap(*this); }
+VRPC_V8_TYPED_ARRAY(false, 1, true, Int8Array)
+VRPC_V8_TYPED_ARRAY(false, 1, false, Uint8Array)
+VRPC_V8_TYPED_ARRAY(false, 2, true, Int16Array)
+VRPC_V8_TYPED_ARRAY(false, 2, false, Uint16Array)
+VRPC_V8_TYPED_ARRAY(false, 4, true, Int32Array)
+VRPC_V8_TYPED_ARRAY(false, 4, false, Uint32Array)
+VRPC_V8_TYPED_ARRAY(true, 4, true, Float32Array)
+VRPC_V8_TYPED_ARRAY(true, 8, true, Float64Array)
+#undef VRPC_V8_TYPED_ARRAY
 
-  std::type_index type() const noexcept {
-    static std::type_index void_type(typeid(void));
-    return content ? content->type() : void_type;
+/**
+ * The typed array sharing the memory layout of T, if any
+ *
+ * 64 bit integers are left out, as their typed arrays hold BigInts.
+ */
+template <typename T>
+using v8_typed_array =
+    v8_typed_array_of<std::is_arithmetic<T>::value &&
+                          !std::is_same<T, bool>::value,
+                      std::is_floating_point<T>::value,
+                      sizeof(T),
+                      std::is_signed<T>::value>;
+
+template <typename T, typename = void>
+struct has_v8_typed_array : std::false_type {};
+
+template <typename T>
+struct has_v8_typed_array<T, void_t<typename v8_typed_array<T>::type>>
+    : std::true_type {};
+}  // namespace detail
+
+/**
+ * Vectors of numbers are exchanged as typed arrays (if one matches), taking
+ * over the memory of returned vectors. Arrays and other typed arrays are
+ * accepted as arguments too.
+ */
+template <typename T, typename Allocator>
+struct v8_converter<std::vector<T, Allocator>> {
+  typedef std::vector<T, Allocator> Vector;
+  typedef detail::has_v8_typed_array<T> is_typed;
+
+  static void from_v8(const V8Scope& scope,
+                      v8::Local<v8::Value> value,
+                      Vector& t) {
+    if (value->IsTypedArray()) {
+      from_typed_array(scope, value.As<v8::TypedArray>(), t, is_typed());
+      return;
+    }
+    detail::v8_expect(value->IsArray(), "array", value);
+    v8::Local<v8::Array> array = value.As<v8::Array>();
+    from_elements(scope, array, array->Length(), t);
   }
 
-  template <typename T>
-  inline const T& get() const {
-    // TODO Check type correctness here
-    // TODO implement by specialization and not by overload
-    return _get<T>(typename detail::is_shared_ptr<T>::type());
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, const Vector& t) {
+    if (!scope.typed_arrays) return to_v8(scope, t, std::false_type());
+    return to_v8(scope, t, is_typed());
   }
 
- private:  // functions
-  template <typename T>
-  inline const T& _get(const std::true_type&) const {
-    return static_cast<holder<
-        typename std::remove_cv<typename T::element_type>::type>*>(content)
-        ->held;
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, Vector&& t) {
+    if (!scope.typed_arrays)
+      return to_v8(scope, std::move(t), std::false_type());
+    return to_v8(scope, std::move(t), is_typed());
   }
 
-  template <typename T>
-  inline const T& _get(const std::false_type&) const {
-    return *(
-        static_cast<holder<typename std::remove_cv<T>::type>*>(content)->held);
+ private:
+  static void from_elements(const V8Scope& scope,
+                            v8::Local<v8::Object> object,
+                            std::uint32_t length,
+                            Vector& t) {
+    t.clear();
+    t.reserve(length);
+    for (std::uint32_t i = 0; i < length; ++i) {
+      T item;
+      v8_converter<T>::from_v8(
+          scope, detail::v8_checked(object->Get(scope.context, i)), item);
+      t.push_back(std::move(item));
+    }
   }
 
- private:  // types
-  class placeholder {
-   public:  // structors
-    virtual ~placeholder() {}
+  static void from_typed_array(const V8Scope& scope,
+                               v8::Local<v8::TypedArray> array,
+                               Vector& t,
+                               std::true_type) {
+    if (!detail::v8_typed_array<T>::is(array)) {
+      from_elements(scope, array, static_cast<std::uint32_t>(array->Length()),
+                    t);
+      return;
+    }
+    t.resize(array->Length());
+    array->CopyContents(t.data(), t.size() * sizeof(T));
+  }
 
-   public:  // queries
-    virtual std::type_index type() const noexcept = 0;
+  static void from_typed_array(const V8Scope& scope,
+                               v8::Local<v8::TypedArray> array,
+                               Vector& t,
+                               std::false_type) {
+    from_elements(scope, array, static_cast<std::uint32_t>(array->Length()),
+                  t);
+  }
 
-    virtual placeholder* clone() const = 0;
-  };
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope,
+                                    const Vector& t,
+                                    std::false_type) {
+    std::vector<v8::Local<v8::Value>> items;
+    items.reserve(t.size());
+    for (const auto& item : t) {
+      items.push_back(v8_converter<T>::to_v8(scope, item));
+    }
+    return v8::Array::New(scope.isolate, items.data(), items.size());
+  }
 
-  template <typename T>
-  class holder : public placeholder {
-   public:  // structors
-    holder(const T& value) : held(new T(value)) {}
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope,
+                                    const Vector& t,
+                                    std::true_type) {
+    return to_v8(scope, Vector(t), std::true_type());
+  }
 
-    holder(T&& value) : held(new T(static_cast<T&&>(value))) {}
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope,
+                                    Vector&& t,
+                                    std::false_type) {
+    return to_v8(scope, t, std::false_type());
+  }
 
-   public:  // queries
-    virtual std::type_index type() const noexcept {
-      return std::type_index(typeid(T));
-    }
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope,
+                                    Vector&& t,
+                                    std::true_type) {
+    typedef typename detail::v8_typed_array<T>::type TypedArray;
+    const std::size_t length = t.size();
+    if (length == 0)
+      return TypedArray::New(v8::ArrayBuffer::New(scope.isolate, 0), 0, 0);
+    // The array buffer takes over the memory of the vector
+    auto holder = new Vector(std::move(t));
+    std::shared_ptr<v8::BackingStore> store = v8::ArrayBuffer::NewBackingStore(
+        holder->data(), length * sizeof(T),
+        [](void*, std::size_t, void* hint) {
+          delete static_cast<Vector*>(hint);
+        },
+        holder);
+    return TypedArray::New(v8::ArrayBuffer::New(scope.isolate, store), 0,
+                           length);
+  }
+};
 
-    virtual placeholder* clone() const {
-      // This copies a std::shared_ptr!
-      return new holder(*held);
+/**
+ * Bytes are exchanged as Buffers, sharing their memory in both directions
+ */
+template <>
+struct v8_converter<bytes> {
+  static void from_v8(const V8Scope& scope,
+                      v8::Local<v8::Value> value,
+                      bytes& t) {
+    if (value->IsArrayBufferView()) {
+      v8::Local<v8::ArrayBufferView> view = value.As<v8::ArrayBufferView>();
+      std::shared_ptr<v8::BackingStore> store =
+          view->Buffer()->GetBackingStore();
+      const auto data = static_cast<const std::uint8_t*>(store->Data());
+      t = bytes(std::move(store), data + view->ByteOffset(),
+                view->ByteLength());
+      return;
     }
+    if (value->IsArrayBuffer()) {
+      std::shared_ptr<v8::BackingStore> store =
+          value.As<v8::ArrayBuffer>()->GetBackingStore();
+      const auto data = static_cast<const std::uint8_t*>(store->Data());
+      const std::size_t size = store->ByteLength();
+      t = bytes(std::move(store), data, size);
+      return;
+    }
+    std::vector<std::uint8_t> v;
+    v8_converter<std::vector<std::uint8_t>>::from_v8(scope, value, v);
+    t = bytes(std::move(v));
+  }
 
-    holder& operator=(const holder&) = delete;
-
-   public:  // representation
-    std::shared_ptr<T> held;
-  };
-
-  template <typename T>
-  class holder<std::shared_ptr<T>> : public placeholder {
-   public:
-    holder(const std::shared_ptr<T>& value) : held(value) {}
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, const bytes& t) {
+    if (!scope.typed_arrays) {
+      return v8_converter<std::vector<std::uint8_t>>::to_v8(
+          scope, std::vector<std::uint8_t>(t.begin(), t.end()));
+    }
+    if (t.empty())
+      return detail::v8_checked(node::Buffer::New(scope.isolate, 0));
+    // The buffer keeps the memory alive through a reference of its own
+    auto holder = new std::shared_ptr<const void>(t.owner());
+    return detail::v8_checked(node::Buffer::New(
+        scope.isolate,
+        reinterpret_cast<char*>(const_cast<std::uint8_t*>(t.data())),
+        t.size(),
+        [](char*, void* hint) {
+          delete static_cast<std::shared_ptr<const void>*>(hint);
+        },
+        holder));
+  }
+};
 
-   public:  // queries
-    virtual std::type_index type() const noexcept {
-      return std::type_index(typeid(T));
+template <typename T, typename Hash, typename KeyEqual, typename Allocator>
+struct v8_converter<
+    std::unordered_map<std::string, T, Hash, KeyEqual, Allocator>> {
+  typedef std::unordered_map<std::string, T, Hash, KeyEqual, Allocator> Map;
+
+  static void from_v8(const V8Scope& scope,
+                      v8::Local<v8::Value> value,
+                      Map& t) {
+    v8::Local<v8::Object> object = detail::v8_object(value);
+    v8::Local<v8::Array> keys =
+        detail::v8_checked(object->GetOwnPropertyNames(scope.context));
+    const std::uint32_t length = keys->Length();
+    t.clear();
+    t.reserve(length);
+    for (std::uint32_t i = 0; i < length; ++i) {
+      v8::Local<v8::Value> key =
+          detail::v8_checked(keys->Get(scope.context, i));
+      T item;
+      v8_converter<T>::from_v8(
+          scope, detail::v8_checked(object->Get(scope.context, key)), item);
+      v8::String::Utf8Value utf8(scope.isolate, key);
+      t.emplace(std::string(*utf8, utf8.length()), std::move(item));
     }
+  }
 
-    virtual placeholder* clone() const {
-      // This copies a std::shared_ptr!
-      return new holder(held);
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, const Map& t) {
+    v8::Local<v8::Object> object = v8::Object::New(scope.isolate);
+    for (const auto& kv : t) {
+      object
+          ->Set(scope.context,
+                v8_converter<std::string>::to_v8(scope, kv.first),
+                v8_converter<T>::to_v8(scope, kv.second))
+          .FromJust();
     }
+    return object;
+  }
+};
 
-    holder& operator=(const holder&) = delete;
+namespace detail {
 
-   public:  // representation
-    std::shared_ptr<T> held;
-  };
+template <typename T, typename Enable = void>
+struct v8_arg {
+  static no_ref_no_const<T> get(const V8Scope& scope,
+                                v8::Local<v8::Array> args,
+                                std::uint32_t index) {
+    no_ref_no_const<T> t;
+    v8_converter<no_ref_no_const<T>>::from_v8(
+        scope, v8_checked(args->Get(scope.context, index)), t);
+    return t;
+  }
+};
 
-  placeholder* content;
+template <typename T>
+struct v8_arg<T, typename std::enable_if<is_std_function<T>::value>::type> {
+  static auto get(const V8Scope& scope,
+                  v8::Local<v8::Array> args,
+                  std::uint32_t index) {
+    std::string callback_id;
+    v8_converter<std::string>::from_v8(
+        scope, v8_checked(args->Get(scope.context, index)), callback_id);
+    auto ptr =
+        std::make_shared<CallbackT<no_ref_no_const<T>>>(std::move(callback_id));
+    return ptr->bind_wrapper();
+  }
 };
 
-inline bool operator==(const Value& lhs, const char& rhs) {
-  return lhs.get<char>() == rhs;
+template <typename... Args, std::size_t... Is>
+inline auto unpack_v8(const V8Scope& scope,
+                      v8::Local<v8::Array> args,
+                      std::index_sequence<Is...>) {
+  // Braced initialization converts the arguments from left to right
+  return std::tuple<decltype(v8_arg<Args>::get(scope, args, Is))...>{
+      v8_arg<Args>::get(scope, args, static_cast<std::uint32_t>(Is))...};
 }
+}  // namespace detail
+
+/**
+ * Unpack parameters into a tuple, converting them directly from V8 values
+ * @param scope isolate and context the values belong to
+ * @param args array of javascript function arguments
+ * @return std::tuple<Args...>
+ */
+template <typename... Args>
+auto unpack(const V8Scope& scope, v8::Local<v8::Array> args) {
+  return detail::unpack_v8<Args...>(scope, args,
+                                    std::index_sequence_for<Args...>());
+}
+#endif
+
+/**
+ * Streams values as json text into a (re-usable) string
+ *
+ * Writers are the output side of value_writer, they write scalars directly and
+ * structure containers through begin/end pairs. The element and key functions
+ * get the position of the entry within its container handed over.
+ */
+class JsonWriter {
+  std::string& _out;
 
-class Function {
  public:
-  Function() {}
+  typedef std::string buffer_type;
 
-  virtual ~Function() {}
+  explicit JsonWriter(std::string& out) : _out(out) {}
 
-  template <typename T>
-  void bind_instance(const std::shared_ptr<T>& instance) {
-    this->do_bind_instance(Value(instance));
-  }
+  std::size_t mark() const { return _out.size(); }
 
-  void call_function(json& json) { this->do_call_function(json); }
+  void rewind(std::size_t mark) { _out.resize(mark); }
 
-  std::shared_ptr<Function> clone() { return this->do_clone(); }
+  void null() { _out.append("null", 4); }
 
- protected:
-  virtual void do_bind_instance(const Value& instance) = 0;
-  virtual void do_call_function(json& json) = 0;
-  virtual std::shared_ptr<Function> do_clone() = 0;
-};
+  void boolean(bool b) {
+    if (b)
+      _out.append("true", 4);
+    else
+      _out.append("false", 5);
+  }
 
-template <typename Klass, typename Lambda, typename Ret, typename... Args>
-class MemberFunction : public Function {
-  Lambda _lambda;
-  std::shared_ptr<Klass> _ptr;
+  void number(std::uint64_t n) {
+    char buffer[20];
+    char* end = buffer + sizeof(buffer);
+    char* begin = end;
+    do {
+      *--begin = static_cast<char>('0' + n % 10);
+      n /= 10;
+    } while (n != 0);
+    _out.append(begin, end);
+  }
 
- public:
-  MemberFunction(const Lambda& lambda) : _lambda(lambda) {}
+  void number(std::int64_t n) {
+    if (n >= 0) {
+      number(static_cast<std::uint64_t>(n));
+      return;
+    }
+    _out.push_back('-');
+    // Negate in unsigned arithmetic, which is safe for the minimum as well
+    number(0 - static_cast<std::uint64_t>(n));
+  }
 
-  virtual ~MemberFunction() = default;
+  void number(double d) {
+    // Same as json, which serializes NaN and infinity as null
+    if (!std::isfinite(d)) {
+      null();
+      return;
+    }
+    char buffer[64];
+    char* end = detail::to_chars(buffer, buffer + sizeof(buffer), d);
+    _out.append(buffer, end);
+  }
 
-  virtual std::shared_ptr<Function> do_clone() {
-    auto ptr = std::make_shared<MemberFunction>(_lambda);
-    return std::static_pointer_cast<Function>(ptr);
+  void string(const char* data, std::size_t size) {
+    static const char* hex = "0123456789abcdef";
+    _out.push_back('"');
+    const char* run = data;
+    const char* end = data + size;
+    for (const char* c = data; c != end; ++c) {
+      const unsigned char u = static_cast<unsigned char>(*c);
+      if (u >= 0x80) {
+        c += utf8_length(data, c, end) - 1;
+        continue;
+      }
+      if (u >= 0x20 && u != '"' && u != '\\')
+        continue;
+      _out.append(run, c);
+      run = c + 1;
+      switch (u) {
+        case '"':
+          _out.append("\\\"", 2);
+          break;
+        case '\\':
+          _out.append("\\\\", 2);
+          break;
+        case '\b':
+          _out.append("\\b", 2);
+          break;
+        case '\f':
+          _out.append("\\f", 2);
+          break;
+        case '\n':
+          _out.append("\\n", 2);
+          break;
+        case '\r':
+          _out.append("\\r", 2);
+          break;
+        case '\t':
+          _out.append("\\t", 2);
+          break;
+        default:
+          _out.append("\\u00", 4);
+          _out.push_back(hex[u >> 4]);
+          _out.push_back(hex[u & 15]);
+      }
+    }
+    _out.append(run, end);
+    _out.push_back('"');
   }
 
-  virtual void do_call_function(json& json) {
-    try {
-      json["r"] = vrpc::call(_lambda(_ptr), vrpc::unpack<Args...>(json));
-    } catch (const std::exception& e) {
-      json["e"] = std::string(e.what());
+  // Json lacks binaries, they are written as arrays of numbers
+  void binary(const std::uint8_t* data, std::size_t size) {
+    begin_array(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      element(i);
+      number(static_cast<std::uint64_t>(data[i]));
     }
+    end_array();
   }
 
-  virtual void do_bind_instance(const Value& instance) {
-    _ptr = instance.get<std::shared_ptr<Klass>>();
+  void begin_array(std::size_t) { _out.push_back('['); }
+
+  void element(std::size_t index) {
+    if (index != 0)
+      _out.push_back(',');
   }
-};
 
-template <typename Klass, typename Lambda, typename... Args>
-class MemberFunction<Klass, Lambda, void, Args...> : public Function {
-  Lambda _lambda;
-  std::shared_ptr<Klass> _ptr;
+  void end_array() { _out.push_back(']'); }
 
- public:
-  MemberFunction(const Lambda& lambda) : _lambda(lambda) {}
+  void begin_object(std::size_t) { _out.push_back('{'); }
 
-  virtual ~MemberFunction() = default;
+  void key(std::size_t index, const char* data, std::size_t size) {
+    element(index);
+    string(data, size);
+    _out.push_back(':');
+  }
 
-  virtual std::shared_ptr<Function> do_clone() {
-    auto ptr = std::make_shared<MemberFunction>(_lambda);
-    return std::static_pointer_cast<Function>(ptr);
+  void end_object() { _out.push_back('}'); }
+
+
+  void value(const json& j) {
+    detail::serializer<json> s(detail::output_adapter<char>(_out), ' ');
+    s.dump(j, false, false, 0);
   }
 
-  virtual void do_call_function(json& json) {
-    try {
-      vrpc::call(_lambda(_ptr), vrpc::unpack<Args...>(json));
-      json["r"] = nullptr;
-    } catch (const std::exception& e) {
-      json["e"] = std::string(e.what());
+  // Appends what another writer already wrote
+  void raw(const buffer_type& data) { _out.append(data); }
+
+  /**
+   * Opens the response to a request, which echoes all entries of the request
+   * but its arguments, followed by the given key (result or error)
+   */
+  void begin_response(const json& request, const char* key) {
+    begin_object(0);
+    std::size_t index = 0;
+    if (request.is_object()) {
+      for (auto it = request.begin(); it != request.end(); ++it) {
+        const std::string& k = it.key();
+        if (k == "a" || k == "r" || k == "e")
+          continue;
+        this->key(index++, k.data(), k.size());
+        value(it.value());
+      }
+    }
+    this->key(index, key, std::strlen(key));
+  }
+
+  void end_response() { end_object(); }
+
+ private:
+  /**
+   * Length of the UTF-8 sequence starting at c, which must not be ASCII
+   *
+   * Throws for invalid (overlong, surrogates, beyond U+10FFFF) and truncated
+   * sequences, with the same errors json's dump() raises.
+   */
+  static std::size_t utf8_length(const char* data,
+                                 const char* c,
+                                 const char* end) {
+    const unsigned char u = static_cast<unsigned char>(*c);
+    // Range of the second byte, all further ones are 0x80 - 0xBF
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    std::size_t length = 0;
+    if (u >= 0xC2 && u <= 0xDF) {
+      length = 2;
+    } else if (u >= 0xE0 && u <= 0xEF) {
+      length = 3;
+      if (u == 0xE0) low = 0xA0;
+      if (u == 0xED) high = 0x9F;
+    } else if (u >= 0xF0 && u <= 0xF4) {
+      length = 4;
+      if (u == 0xF0) low = 0x90;
+      if (u == 0xF4) high = 0x8F;
+    } else {
+      invalid_utf8(data, c);
     }
+    for (std::size_t i = 1; i < length; ++i) {
+      if (c + i == end) {
+        throw detail::type_error::create(
+            316, "incomplete UTF-8 string; last byte: 0x" + hex_byte(end[-1]),
+            json());
+      }
+      const unsigned char b = static_cast<unsigned char>(c[i]);
+      if (b < (i == 1 ? low : 0x80) || b > (i == 1 ? high : 0xBF))
+        invalid_utf8(data, c + i);
+    }
+    return length;
+  }
+
+  [[noreturn]] static void invalid_utf8(const char* data, const char* c) {
+    throw detail::type_error::create(
+        316,
+        "invalid UTF-8 byte at index " + std::to_string(c - data) + ": 0x" +
+            hex_byte(*c),
+        json());
   }
 
-  virtual void do_bind_instance(const Value& instance) {
-    _ptr = instance.get<std::shared_ptr<Klass>>();
+  static std::string hex_byte(char c) {
+    static const char* hex = "0123456789ABCDEF";
+    const unsigned char u = static_cast<unsigned char>(c);
+    return {hex[u >> 4], hex[u & 15]};
   }
 };
 
-template <typename Lambda, typename Ret, typename... Args>
-class StaticFunction : public Function {
-  Lambda _lambda;
+/**
+ * Streams values as MessagePack into a (re-usable) byte vector
+ *
+ * Same interface as JsonWriter.
+ */
+class MsgpackWriter {
+  std::vector<std::uint8_t>& _out;
 
  public:
-  StaticFunction(const Lambda& lambda) : _lambda(lambda) {}
+  typedef std::vector<std::uint8_t> buffer_type;
 
-  virtual ~StaticFunction() = default;
+  explicit MsgpackWriter(std::vector<std::uint8_t>& out) : _out(out) {}
+
+  std::size_t mark() const { return _out.size(); }
+
+  void rewind(std::size_t mark) { _out.resize(mark); }
+
+  void null() { _out.push_back(0xc0); }
 
-  virtual std::shared_ptr<Function> do_clone() {
-    auto ptr = std::make_shared<StaticFunction>(_lambda);
-    return std::static_pointer_cast<Function>(ptr);
+  void boolean(bool b) { _out.push_back(b ? 0xc3 : 0xc2); }
+
+  void number(std::uint64_t n) {
+    if (n < 0x80) {
+      _out.push_back(static_cast<std::uint8_t>(n));
+    } else if (n <= 0xff) {
+      _out.push_back(0xcc);
+      _out.push_back(static_cast<std::uint8_t>(n));
+    } else if (n <= 0xffff) {
+      _out.push_back(0xcd);
+      big_endian(n, 2);
+    } else if (n <= 0xffffffff) {
+      _out.push_back(0xce);
+      big_endian(n, 4);
+    } else {
+      _out.push_back(0xcf);
+      big_endian(n, 8);
+    }
   }
 
-  virtual void do_call_function(json& json) {
-    try {
-      json["r"] = vrpc::call(_lambda(), vrpc::unpack<Args...>(json));
-    } catch (const std::exception& e) {
-      json["e"] = std::string(e.what());
+  void number(std::int64_t n) {
+    if (n >= 0) {
+      number(static_cast<std::uint64_t>(n));
+      return;
+    }
+    const std::uint64_t u = static_cast<std::uint64_t>(n);
+    if (n >= -32) {
+      _out.push_back(static_cast<std::uint8_t>(u));
+    } else if (n >= -0x80) {
+      _out.push_back(0xd0);
+      big_endian(u, 1);
+    } else if (n >= -0x8000) {
+      _out.push_back(0xd1);
+      big_endian(u, 2);
+    } else if (n >= -0x80000000LL) {
+      _out.push_back(0xd2);
+      big_endian(u, 4);
+    } else {
+      _out.push_back(0xd3);
+      big_endian(u, 8);
     }
   }
 
-  virtual void do_bind_instance(const Value&) {
-    // Nothing to bind, static function
+  void number(double d) {
+    std::uint64_t u;
+    std::memcpy(&u, &d, sizeof(u));
+    _out.push_back(0xcb);
+    big_endian(u, 8);
   }
-};
 
-template <typename Lambda, typename... Args>
-class StaticFunction<Lambda, void, Args...> : public Function {
-  Lambda _lambda;
+  void string(const char* data, std::size_t size) {
+    if (size < 32) {
+      _out.push_back(static_cast<std::uint8_t>(0xa0 | size));
+    } else if (size <= 0xff) {
+      _out.push_back(0xd9);
+      big_endian(size, 1);
+    } else if (size <= 0xffff) {
+      _out.push_back(0xda);
+      big_endian(size, 2);
+    } else {
+      _out.push_back(0xdb);
+      big_endian(size, 4);
+    }
+    _out.insert(_out.end(), data, data + size);
+  }
 
- public:
-  StaticFunction(const Lambda& lambda) : _lambda(lambda) {}
+  void binary(const std::uint8_t* data, std::size_t size) {
+    if (size <= 0xff) {
+      _out.push_back(0xc4);
+      big_endian(size, 1);
+    } else if (size <= 0xffff) {
+      _out.push_back(0xc5);
+      big_endian(size, 2);
+    } else {
+      _out.push_back(0xc6);
+      big_endian(size, 4);
+    }
+    _out.insert(_out.end(), data, data + size);
+  }
 
-  virtual ~StaticFunction() = default;
+  void begin_array(std::size_t size) { header(size, 0x90, 0xdc, 0xdd); }
 
-  virtual std::shared_ptr<Function> do_clone() {
-    auto ptr = std::make_shared<StaticFunction>(_lambda);
-    return std::static_pointer_cast<Function>(ptr);
-  }
+  void element(std::size_t) {}
 
-  virtual void do_call_function(json& json) {
-    try {
-      vrpc::call(_lambda(), vrpc::unpack<Args...>(json));
-      json["r"] = nullptr;
-    } catch (const std::exception& e) {
-      json["e"] = std::string(e.what());
-    }
+  void end_array() {}
+
+  void begin_object(std::size_t size) { header(size, 0x80, 0xde, 0xdf); }
+
+  void key(std::size_t, const char* data, std::size_t size) {
+    string(data, size);
   }
 
-  virtual void do_bind_instance(const Value&) {
-    // Nothing to bind, static function
+  void end_object() {}
+
+  void value(const json& j) {
+    json::to_msgpack(j, detail::output_adapter<std::uint8_t>(_out));
   }
-};
 
-template <typename Lambda, typename... Args>
-class ConstructorFunction : public Function {
-  Lambda _lambda;
+  void raw(const buffer_type& data) {
+    _out.insert(_out.end(), data.begin(), data.end());
+  }
 
- public:
-  ConstructorFunction(const Lambda& lambda) : _lambda(lambda) {}
+  /**
+   * Opens the response to a request, which echoes all entries of the request
+   * but its arguments, followed by the given key (result or error)
+   */
+  void begin_response(const json& request, const char* key) {
+    std::size_t size = 1;
+    if (request.is_object()) {
+      size += request.size() - request.count("a") - request.count("r") -
+              request.count("e");
+    }
+    begin_object(size);
+    if (request.is_object()) {
+      for (auto it = request.begin(); it != request.end(); ++it) {
+        const std::string& k = it.key();
+        if (k == "a" || k == "r" || k == "e")
+          continue;
+        string(k.data(), k.size());
+        value(it.value());
+      }
+    }
+    string(key, std::strlen(key));
+  }
 
-  virtual ~ConstructorFunction() = default;
+  void end_response() {}
 
-  virtual std::shared_ptr<Function> do_clone() {
-    auto ptr = std::make_shared<ConstructorFunction>(_lambda);
-    return std::static_pointer_cast<Function>(ptr);
+ private:
+  void big_endian(std::uint64_t n, std::size_t bytes) {
+    for (std::size_t i = bytes; i-- > 0;)
+      _out.push_back(static_cast<std::uint8_t>(n >> (8 * i)));
   }
 
-  virtual void do_call_function(json& json) {
-    try {
-      json["r"] = vrpc::call(_lambda, vrpc::unpack<Args...>(json));
-    } catch (const std::exception& e) {
-      json["e"] = std::string(e.what());
+  // Writes the header of an array or map, small ones fit the type byte
+  void header(std::size_t size,
+              std::uint8_t fix,
+              std::uint8_t code16,
+              std::uint8_t code32) {
+    if (size < 16) {
+      _out.push_back(static_cast<std::uint8_t>(fix | size));
+    } else if (size <= 0xffff) {
+      _out.push_back(code16);
+      big_endian(size, 2);
+    } else {
+      _out.push_back(code32);
+      big_endian(size, 4);
     }
   }
+};
+
+namespace detail {
+template <typename Writer, typename T, typename = void>
+struct has_write_value : std::false_type {};
+
+template <typename Writer, typename T>
+struct has_write_value<Writer,
+                       T,
+                       decltype(write_value(std::declval<Writer&>(),
+                                            std::declval<const T&>()))>
+    : std::true_type {};
+}  // namespace detail
 
-  virtual void do_bind_instance(const Value&) {
-    // Nothing to bind
+/**
+ * Streams C++ values into a writer (JsonWriter or MsgpackWriter), without
+ * building json in between
+ *
+ * Similar to adl_serializer, the default implementation forwards to the free
+ * function write_value found by argument dependent lookup (as generated by
+ * VRPC_DEFINE_TYPE). Types lacking it are written through json. Specialize
+ * this template to support further types.
+ */
+template <typename T, typename = void>
+struct value_writer {
+  template <typename Writer>
+  static void write(Writer& writer, const T& t) {
+    write(writer, t, detail::has_write_value<Writer, T>());
   }
-};
 
-struct required {};
+ private:
+  template <typename Writer>
+  static void write(Writer& writer, const T& t, std::true_type) {
+    write_value(writer, t);
+  }
+
+  template <typename Writer>
+  static void write(Writer& writer, const T& t, std::false_type) {
+    writer.value(json(t));
+  }
+};
+
+template <>
+struct value_writer<json> {
+  template <typename Writer>
+  static void write(Writer& writer, const json& t) {
+    writer.value(t);
+  }
+};
+
+template <>
+struct value_writer<bool> {
+  template <typename Writer>
+  static void write(Writer& writer, bool t) {
+    writer.boolean(t);
+  }
+};
+
+template <typename T>
+struct value_writer<
+    T,
+    typename std::enable_if<std::is_arithmetic<T>::value &&
+                            !std::is_same<T, bool>::value>::type> {
+  template <typename Writer>
+  static void write(Writer& writer, T t) {
+    typedef typename std::conditional<
+        std::is_floating_point<T>::value, double,
+        typename std::conditional<std::is_signed<T>::value, std::int64_t,
+                                  std::uint64_t>::type>::type Number;
+    writer.number(static_cast<Number>(t));
+  }
+};
+
+template <>
+struct value_writer<std::string> {
+  template <typename Writer>
+  static void write(Writer& writer, const std::string& t) {
+    writer.string(t.data(), t.size());
+  }
+};
+
+template <>
+struct value_writer<bytes> {
+  template <typename Writer>
+  static void write(Writer& writer, const bytes& t) {
+    writer.binary(t.data(), t.size());
+  }
+};
+
+template <typename T, typename Allocator>
+struct value_writer<std::vector<T, Allocator>> {
+  template <typename Writer>
+  static void write(Writer& writer, const std::vector<T, Allocator>& t) {
+    writer.begin_array(t.size());
+    std::size_t index = 0;
+    for (const auto& e : t) {
+      writer.element(index++);
+      value_writer<T>::write(writer, e);
+    }
+    writer.end_array();
+  }
+};
+
+namespace detail {
+template <typename Map>
+struct map_value_writer {
+  template <typename Writer>
+  static void write(Writer& writer, const Map& t) {
+    writer.begin_object(t.size());
+    std::size_t index = 0;
+    for (const auto& kv : t) {
+      writer.key(index++, kv.first.data(), kv.first.size());
+      value_writer<typename Map::mapped_type>::write(writer, kv.second);
+    }
+    writer.end_object();
+  }
+};
+}  // namespace detail
+
+template <typename T, typename Hash, typename KeyEqual, typename Allocator>
+struct value_writer<
+    std::unordered_map<std::string, T, Hash, KeyEqual, Allocator>>
+    : detail::map_value_writer<
+          std::unordered_map<std::string, T, Hash, KeyEqual, Allocator>> {};
+
+template <typename T, typename Compare, typename Allocator>
+struct value_writer<std::map<std::string, T, Compare, Allocator>>
+    : detail::map_value_writer<std::map<std::string, T, Compare, Allocator>> {
+};
+
+namespace detail {
+/**
+ * Writes a complete error response to the request
+ */
+template <typename Writer>
+void write_error(Writer& writer, const json& request, const std::string& e) {
+  writer.begin_response(request, "e");
+  writer.string(e.data(), e.size());
+  writer.end_response();
+}
+
+template <typename... Args>
+inline void write_arguments(std::string& out, const Args&... args) {
+  JsonWriter writer(out);
+  writer.begin_array(sizeof...(Args));
+  std::size_t index = 0;
+  // Braced initialization writes the arguments from left to right
+  const int expand[] = {
+      0, (writer.element(index++),
+          value_writer<no_ref_no_const<Args>>::write(writer, args), 0)...};
+  (void)expand;
+  writer.end_array();
+}
+
+template <typename... Args>
+class CallbackEventT : public CallbackEvent {
+  std::shared_ptr<const CallbackBase> _callback;
+  std::tuple<no_ref_no_const<Args>...> _args;
+
+ public:
+  template <typename... Ts>
+  explicit CallbackEventT(std::shared_ptr<const CallbackBase> callback,
+                          Ts&&... args)
+      : _callback(std::move(callback)), _args(std::forward<Ts>(args)...) {}
+
+  const std::string& callback_id() const override {
+    return _callback->_callback_id;
+  }
+
+  const CallbackPolicy& policy() const override { return _callback->_policy; }
+
+  std::string envelope() const override {
+    std::string envelope(_callback->_prefix);
+    write(envelope, std::index_sequence_for<Args...>());
+    envelope.push_back('}');
+    return envelope;
+  }
+
+#ifdef VRPC_WITH_V8
+  void arguments(const V8Scope& scope,
+                 std::vector<v8::Local<v8::Value>>& argv) const override {
+    arguments(scope, argv, std::index_sequence_for<Args...>());
+  }
+#endif
+
+ private:
+  template <std::size_t... Is>
+  void write(std::string& out, std::index_sequence<Is...>) const {
+    write_arguments(out, std::get<Is>(_args)...);
+  }
+
+#ifdef VRPC_WITH_V8
+  template <std::size_t... Is>
+  void arguments(const V8Scope& scope,
+                 std::vector<v8::Local<v8::Value>>& argv,
+                 std::index_sequence<Is...>) const {
+    // Braced initialization converts the arguments from left to right
+    argv = {v8_converter<no_ref_no_const<Args>>::to_v8(scope,
+                                                       std::get<Is>(_args))...};
+  }
+#endif
+};
+}  // namespace detail
+
+/**
+ * Result of an operation completing later, returned by registered functions
+ * instead of blocking until the result is known
+ *
+ * Copies share their state, the function hands out one and settles another
+ * one from any thread once done. Callers get an id ("__p__...") as return
+ * value right away, the result ("r") or error ("e") follows as callback event
+ * with that id. Functions may return std::future or std::shared_future as
+ * well, which are polled by a single background thread instead (deferred
+ * ones run on the thread pool).
+ */
+template <typename T>
+class Promise {
+ public:
+  typedef typename std::
+      conditional<std::is_void<T>::value, std::nullptr_t, T>::type value_type;
+  // Gets the value or, if empty, the error
+  typedef std::function<void(std::shared_ptr<const value_type>,
+                             const std::string&)>
+      Continuation;
+
+  Promise() : _state(std::make_shared<State>()) {}
+
+  template <typename U = T,
+            typename std::enable_if<!std::is_void<U>::value, int>::type = 0>
+  void resolve(U value) {
+    settle(std::make_shared<const value_type>(std::move(value)), "");
+  }
+
+  template <typename U = T,
+            typename std::enable_if<std::is_void<U>::value, int>::type = 0>
+  void resolve() {
+    settle(std::make_shared<const value_type>(nullptr), "");
+  }
+
+  void reject(const std::string& error) { settle(nullptr, error); }
+
+  // Rejects with the message of the exception
+  void reject(std::exception_ptr error) {
+    try {
+      std::rethrow_exception(error);
+    } catch (const std::exception& e) {
+      reject(std::string(e.what()));
+    } catch (...) {
+      reject(std::string("Unknown exception"));
+    }
+  }
+
+  bool settled() const {
+    std::lock_guard<std::mutex> lock(_state->mutex);
+    return _state->settled;
+  }
+
+  /**
+   * Runs the continuation once settled, right away if settled already
+   *
+   * Used by the adapter to deliver the result, a promise has a single
+   * continuation only and refuses another one.
+   */
+  void then(Continuation continuation) {
+    std::unique_lock<std::mutex> lock(_state->mutex);
+    if (_state->continued)
+      throw std::logic_error("Promise already has a continuation");
+    _state->continued = true;
+    if (!_state->settled) {
+      _state->continuation = std::move(continuation);
+      return;
+    }
+    lock.unlock();
+    continuation(_state->value, _state->error);
+  }
+
+ private:
+  struct State {
+    std::mutex mutex;
+    bool settled = false;
+    bool continued = false;
+    std::shared_ptr<const value_type> value;
+    std::string error;
+    Continuation continuation;
+  };
+
+  void settle(std::shared_ptr<const value_type> value,
+              const std::string& error) {
+    std::unique_lock<std::mutex> lock(_state->mutex);
+    if (_state->settled)
+      throw std::logic_error("Promise already settled");
+    _state->settled = true;
+    _state->value = std::move(value);
+    _state->error = error;
+    Continuation continuation = std::move(_state->continuation);
+    lock.unlock();
+    // Settled state does not change anymore, hence is read without lock
+    if (continuation)
+      continuation(_state->value, _state->error);
+  }
+
+  std::shared_ptr<State> _state;
+};
+
+namespace detail {
+
+// Delivers the result of a promise, see Promise
+template <typename T>
+class PromiseEventT : public CallbackEvent {
+  std::string _promise_id;
+  // Envelope up to the result
+  std::string _prefix;
+  std::shared_ptr<const T> _value;
+  std::string _error;
+
+ public:
+  PromiseEventT(std::string promise_id,
+                std::string prefix,
+                std::shared_ptr<const T> value,
+                std::string error)
+      : _promise_id(std::move(promise_id)),
+        _prefix(std::move(prefix)),
+        _value(std::move(value)),
+        _error(std::move(error)) {}
+
+  const std::string& callback_id() const override { return _promise_id; }
+
+  const CallbackPolicy& policy() const override {
+    static const CallbackPolicy policy;
+    return policy;
+  }
+
+  std::string envelope() const override {
+    std::string envelope(_prefix);
+    JsonWriter writer(envelope);
+    if (_value) {
+      envelope.append("\"r\":", 4);
+      value_writer<T>::write(writer, *_value);
+    } else {
+      envelope.append("\"e\":", 4);
+      writer.string(_error.data(), _error.size());
+    }
+    envelope.push_back('}');
+    return envelope;
+  }
+
+#ifdef VRPC_WITH_V8
+  // A single object, holding either the result ("r") or the error ("e")
+  void arguments(const V8Scope& scope,
+                 std::vector<v8::Local<v8::Value>>& argv) const override {
+    v8::Local<v8::Object> object = v8::Object::New(scope.isolate);
+    object
+        ->Set(scope.context, v8_key(scope, _value ? "r" : "e"),
+              _value ? v8_converter<T>::to_v8(scope, *_value)
+                     : v8_converter<std::string>::to_v8(scope, _error))
+        .FromJust();
+    argv = {object};
+  }
+#endif
+};
+
+inline std::uint64_t next_promise_id() {
+  static std::atomic<std::uint64_t> next{0};
+  return next++;
+}
+
+/**
+ * Delivers the result of the promise through the callback handler of the
+ * calling thread, once settled
+ *
+ * @param request The request the promise is returned to, if any
+ * @return The id the result is delivered with
+ */
+template <typename T>
+std::string defer(const json* request, Promise<T> promise) {
+  typedef typename Promise<T>::value_type Value;
+  std::string id("__p__");
+  const json* sender = nullptr;
+  if (request != nullptr) {
+    const auto f = request->find("f");
+    if (f != request->end() && f->is_string())
+      id += f->template get_ref<const std::string&>() + "-";
+    sender = find_sender(*request);
+  }
+  id += std::to_string(next_promise_id());
+  std::string prefix = "{\"i\":" + json(id).dump();
+  if (sender != nullptr) {
+    prefix += ",\"s\":";
+    prefix += sender->dump();
+  }
+  prefix.push_back(',');
+  std::shared_ptr<const EventCallbackHandler> handler =
+      scoped_callback_handler();
+  promise.then([id, prefix, handler](std::shared_ptr<const Value> value,
+                                     const std::string& error) {
+    std::unique_ptr<CallbackEvent> event(
+        new PromiseEventT<Value>(id, prefix, std::move(value), error));
+    if (handler)
+      (*handler)(std::move(event));
+    else
+      detail::init<EventCallbackHandler>()(std::move(event));
+  });
+  return id;
+}
+
+/**
+ * Polls futures on a background thread, as they can not notify on their own
+ *
+ * Polling backs off while none of the futures gets ready, newly watched
+ * futures are polled right away. Deferred futures (e.g. of std::async with
+ * std::launch::deferred) are not watched, see watch_future.
+ */
+class FutureWatcher {
+ public:
+  // Returns true once done with the future
+  typedef std::function<bool()> Poll;
+
+  FutureWatcher() { std::thread([this] { run(); }).detach(); }
+
+  void watch(Poll poll) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _polls.push_back(std::move(poll));
+    _wake.notify_one();
+  }
+
+ private:
+  static bool done(Poll& poll) {
+    try {
+      return poll();
+    } catch (const std::exception& e) {
+      _VRPC_DEBUG << "Delivering future failed: " << e.what() << std::endl;
+      return true;
+    }
+  }
+
+  void run() {
+    const std::chrono::microseconds min_backoff(50);
+    const std::chrono::microseconds max_backoff(1000);
+    std::chrono::microseconds backoff(min_backoff);
+    std::vector<Poll> polls;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto watched = [this] { return !_polls.empty(); };
+        if (polls.empty())
+          _wake.wait(lock, watched);
+        else
+          _wake.wait_for(lock, backoff, watched);
+        if (!_polls.empty())
+          backoff = min_backoff;
+        for (auto& x : _polls) polls.push_back(std::move(x));
+        _polls.clear();
+      }
+      const auto pending = std::remove_if(polls.begin(), polls.end(), done);
+      if (pending == polls.end()) {
+        backoff = std::min(backoff * 2, max_backoff);
+      } else {
+        polls.erase(pending, polls.end());
+        backoff = min_backoff;
+      }
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::vector<Poll> _polls;
+};
+
+// Never destroyed, as its thread may outlive static objects at exit
+inline FutureWatcher& future_watcher() {
+  static FutureWatcher* watcher = new FutureWatcher();
+  return *watcher;
+}
+
+// Runs the task on the thread pool, defined along with it
+inline void post_to_thread_pool(std::function<void()> task);
+
+template <typename T, typename Future>
+void settle_with(Promise<T>& promise, Future& future, std::false_type) {
+  std::unique_ptr<T> value;
+  try {
+    value.reset(new T(future.get()));
+  } catch (...) {
+    promise.reject(std::current_exception());
+    return;
+  }
+  promise.resolve(std::move(*value));
+}
+
+template <typename T, typename Future>
+void settle_with(Promise<T>& promise, Future& future, std::true_type) {
+  try {
+    future.get();
+  } catch (...) {
+    promise.reject(std::current_exception());
+    return;
+  }
+  promise.resolve();
+}
+
+template <typename T, typename Future>
+Promise<T> watch_future(Future future) {
+  Promise<T> promise;
+  auto shared = std::make_shared<Future>(std::move(future));
+  // Deferred futures run within get(), which must not hold up the others
+  if (shared->wait_for(std::chrono::seconds(0)) ==
+      std::future_status::deferred) {
+    post_to_thread_pool([promise, shared]() mutable {
+      settle_with(promise, *shared, std::is_void<T>());
+    });
+    return promise;
+  }
+  future_watcher().watch([promise, shared]() mutable {
+    if (shared->wait_for(std::chrono::seconds(0)) ==
+        std::future_status::timeout)
+      return false;
+    settle_with(promise, *shared, std::is_void<T>());
+    return true;
+  });
+  return promise;
+}
+
+// Turns a return value completing later into a Promise
+template <typename T>
+struct promise_of;
+
+template <typename T>
+struct promise_of<Promise<T>> {
+  static Promise<T> get(Promise<T> promise) { return promise; }
+};
+
+template <typename T>
+struct promise_of<std::future<T>> {
+  static Promise<T> get(std::future<T> future) {
+    return watch_future<T>(std::move(future));
+  }
+};
+
+template <typename T>
+struct promise_of<std::shared_future<T>> {
+  static Promise<T> get(std::shared_future<T> future) {
+    return watch_future<T>(std::move(future));
+  }
+};
+
+/**
+ * Converts the return value of a function into the response (json, writer or
+ * V8 value)
+ */
+template <typename T>
+struct return_value {
+  template <typename V>
+  static void set(json& request, V&& value) {
+    request["r"] = std::forward<V>(value);
+  }
+
+  template <typename Writer, typename V>
+  static void write(Writer& writer, const json&, const V& value) {
+    value_writer<T>::write(writer, value);
+  }
+
+#ifdef VRPC_WITH_V8
+  template <typename V>
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, const V& value) {
+    return v8_converter<T>::to_v8(scope, value);
+  }
+#endif
+};
+
+// Promises and futures are not waited for, see Promise
+template <typename T>
+struct deferred_return_value {
+  static void set(json& request, T value) {
+    request["r"] = defer(&request, promise_of<T>::get(std::move(value)));
+  }
+
+  template <typename Writer>
+  static void write(Writer& writer, const json& request, T value) {
+    value_writer<std::string>::write(
+        writer, defer(&request, promise_of<T>::get(std::move(value))));
+  }
+
+#ifdef VRPC_WITH_V8
+  static v8::Local<v8::Value> to_v8(const V8Scope& scope, T value) {
+    return v8_converter<std::string>::to_v8(
+        scope, defer(nullptr, promise_of<T>::get(std::move(value))));
+  }
+#endif
+};
+
+template <typename T>
+struct return_value<Promise<T>> : deferred_return_value<Promise<T>> {};
+
+template <typename T>
+struct return_value<std::future<T>> : deferred_return_value<std::future<T>> {
+};
+
+template <typename T>
+struct return_value<std::shared_future<T>>
+    : deferred_return_value<std::shared_future<T>> {};
+}  // namespace detail
+}  // namespace vrpc
+
+#ifdef VRPC_WITH_V8
+#define VRPC_V8_TO(v1)                                                        \
+  vrpc_v8_o                                                                   \
+      ->Set(vrpc_v8_s.context, vrpc::detail::v8_key(vrpc_v8_s, #v1),          \
+            vrpc::v8_converter<decltype(vrpc_v8_t.v1)>::to_v8(                \
+                vrpc_v8_s, vrpc_v8_t.v1))                                     \
+      .FromJust();
+#define VRPC_V8_FROM(v1)                                                      \
+  vrpc::v8_converter<decltype(vrpc_v8_t.v1)>::from_v8(                        \
+      vrpc_v8_s, vrpc::detail::v8_member(vrpc_v8_s, vrpc_v8_o, #v1),          \
+      vrpc_v8_t.v1);
+
+#define VRPC_DEFINE_V8_TYPE_NON_INTRUSIVE(Type, ...)                          \
+  inline v8::Local<v8::Value> to_v8(const vrpc::V8Scope& vrpc_v8_s,           \
+                                    const Type& vrpc_v8_t) {                  \
+    v8::Local<v8::Object> vrpc_v8_o = v8::Object::New(vrpc_v8_s.isolate);     \
+    VRPC_JSON_EXPAND(VRPC_JSON_PASTE(VRPC_V8_TO, __VA_ARGS__))                \
+    return vrpc_v8_o;                                                         \
+  }                                                                           \
+  inline void from_v8(const vrpc::V8Scope& vrpc_v8_s,                         \
+                      v8::Local<v8::Value> vrpc_v8_v, Type& vrpc_v8_t) {      \
+    v8::Local<v8::Object> vrpc_v8_o = vrpc::detail::v8_object(vrpc_v8_v);     \
+    VRPC_JSON_EXPAND(VRPC_JSON_PASTE(VRPC_V8_FROM, __VA_ARGS__))              \
+  }
+#endif
+
+#define VRPC_JSON_MOVE_FROM(v1)                                               \
+  vrpc_json_t.v1 = vrpc::detail::move_out<decltype(vrpc_json_t.v1)>::get(     \
+      vrpc_json_j.at(#v1));
+
+#define VRPC_DEFINE_MOVE_TYPE_NON_INTRUSIVE(Type, ...)                        \
+  inline void move_from_json(vrpc::json& vrpc_json_j, Type& vrpc_json_t) {    \
+    VRPC_JSON_EXPAND(VRPC_JSON_PASTE(VRPC_JSON_MOVE_FROM, __VA_ARGS__))       \
+  }
+
+#define VRPC_WRITER_COUNT(v1) +1
+
+#define VRPC_WRITER_TO(v1)                                                    \
+  vrpc_writer.key(vrpc_writer_i++, #v1, sizeof(#v1) - 1);                     \
+  vrpc::value_writer<decltype(vrpc_writer_t.v1)>::write(vrpc_writer,          \
+                                                        vrpc_writer_t.v1);
+
+#define VRPC_DEFINE_WRITER_TYPE_NON_INTRUSIVE(Type, ...)                      \
+  template <typename Writer>                                                  \
+  inline void write_value(Writer& vrpc_writer, const Type& vrpc_writer_t) {   \
+    std::size_t vrpc_writer_i = 0;                                            \
+    vrpc_writer.begin_object(                                                 \
+        0 VRPC_JSON_EXPAND(VRPC_JSON_PASTE(VRPC_WRITER_COUNT, __VA_ARGS__))); \
+    VRPC_JSON_EXPAND(VRPC_JSON_PASTE(VRPC_WRITER_TO, __VA_ARGS__))            \
+    vrpc_writer.end_object();                                                 \
+  }
+
+// Custom types can additionally be moved out of json, streamed into writers
+// (and converted from and to V8 values directly)
+#undef VRPC_DEFINE_TYPE
+#ifdef VRPC_WITH_V8
+#define VRPC_DEFINE_TYPE(Type, ...)                                           \
+  VRPC_DEFINE_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__)                           \
+  VRPC_DEFINE_MOVE_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__)                      \
+  VRPC_DEFINE_WRITER_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__)                    \
+  VRPC_DEFINE_V8_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__)
+#else
+#define VRPC_DEFINE_TYPE(Type, ...)                                           \
+  VRPC_DEFINE_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__)                           \
+  VRPC_DEFINE_MOVE_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__)                      \
+  VRPC_DEFINE_WRITER_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__)
+#endif
+
+namespace vrpc {
+
+/**
+ * Kinds of json values, as far as function signatures tell them apart
+ *
+ * Numbers are not told apart any further and binaries count as arrays.
+ */
+enum class json_kind : std::uint8_t {
+  null = 1,
+  boolean,
+  number,
+  string,
+  array,
+  object
+};
+
+namespace detail {
+template <typename T>
+struct is_function_object : std::false_type {};
+
+template <typename Sig>
+struct is_function_object<std::function<Sig>> : std::true_type {};
+
+template <typename Sig>
+struct is_function_object<callback<Sig>> : std::true_type {};
+
+template <typename T>
+struct is_tuple : std::false_type {};
+
+template <typename... Ts>
+struct is_tuple<std::tuple<Ts...>> : std::true_type {};
+
+template <typename T1, typename T2>
+struct is_tuple<std::pair<T1, T2>> : std::true_type {};
+
+template <typename T, typename = void>
+struct is_container : std::false_type {};
+
+template <typename T>
+struct is_container<T,
+                    void_t<typename T::value_type, typename T::const_iterator>>
+    : std::true_type {};
+
+// Maps with string keys become objects, all others arrays of pairs
+template <typename T, typename = void>
+struct is_object_map : std::false_type {};
+
+template <typename T>
+struct is_object_map<T, void_t<typename T::key_type, typename T::mapped_type>>
+    : std::is_convertible<typename T::key_type, std::string> {};
+
+template <typename T>
+struct is_string
+    : std::integral_constant<bool,
+                             std::is_same<T, std::string>::value ||
+                                 std::is_same<T, const char*>::value ||
+                                 std::is_same<T, char*>::value> {};
+
+#ifdef __cpp_lib_string_view
+template <>
+struct is_string<std::string_view> : std::true_type {};
+#endif
+
+// Kind of the types converting to json in a fixed way, zero for all others
+template <typename T>
+constexpr json_kind known_json_kind() {
+  return std::is_same<T, json>::value || std::is_same<T, std::nullptr_t>::value
+             ? json_kind::null
+         : std::is_same<T, bool>::value ? json_kind::boolean
+         : std::is_arithmetic<T>::value ? json_kind::number
+         : is_string<T>::value || is_function_object<T>::value
+             ? json_kind::string
+         : std::is_same<T, bytes>::value ? json_kind::array
+                                         : static_cast<json_kind>(0);
+}
+
+// Best guess for types that can not be default constructed and converted
+template <typename T>
+constexpr json_kind default_json_kind() {
+  return known_json_kind<T>() != static_cast<json_kind>(0)
+             ? known_json_kind<T>()
+         : std::is_enum<T>::value  ? json_kind::number
+         : is_object_map<T>::value ? json_kind::object
+         : is_tuple<T>::value || is_container<T>::value ? json_kind::array
+                                                        : json_kind::object;
+}
+}  // namespace detail
+
+/**
+ * Json kind of arguments of type T, as found in the signatures of functions
+ *
+ * Fixed at compile time for arithmetic, string, callback and bytes types (the
+ * latter two being passed as string id and array). All other types, enums
+ * included, are of the kind their json conversion yields for a default
+ * constructed value, which is evaluated once on registration. Specialize
+ * this template, deriving from std::integral_constant<json_kind, ...>, for
+ * types that can not be default constructed.
+ */
+template <typename T, typename = void>
+struct kind_of {};
+
+template <typename T>
+struct kind_of<T,
+               typename std::enable_if<detail::known_json_kind<T>() !=
+                                       static_cast<json_kind>(0)>::type>
+    : std::integral_constant<json_kind, detail::known_json_kind<T>()> {};
+
+inline json_kind kind_of_value(const json& j) {
+  switch (j.type()) {
+    case json::value_t::boolean:
+      return json_kind::boolean;
+    case json::value_t::number_integer:
+    case json::value_t::number_unsigned:
+    case json::value_t::number_float:
+      return json_kind::number;
+    case json::value_t::string:
+      return json_kind::string;
+    case json::value_t::array:
+    case json::value_t::binary:
+      return json_kind::array;
+    case json::value_t::object:
+      return json_kind::object;
+    default:
+      return json_kind::null;
+  }
+}
+
+namespace detail {
+template <typename T, typename = void>
+struct has_kind : std::false_type {};
+
+template <typename T>
+struct has_kind<T, void_t<decltype(kind_of<T>::value)>> : std::true_type {};
+
+template <typename T, typename = void>
+struct is_default_convertible : std::false_type {};
+
+template <typename T>
+struct is_default_convertible<T, void_t<decltype(json(T()))>>
+    : std::true_type {};
+
+template <typename T>
+json_kind converted_kind(std::true_type) {
+  try {
+    return kind_of_value(json(T()));
+  } catch (const std::exception&) {
+    return default_json_kind<T>();
+  }
+}
+
+template <typename T>
+json_kind converted_kind(std::false_type) {
+  return default_json_kind<T>();
+}
+
+template <typename T>
+json_kind arg_kind(std::true_type) {
+  return kind_of<T>::value;
+}
+
+template <typename T>
+json_kind arg_kind(std::false_type) {
+  return converted_kind<T>(is_default_convertible<T>());
+}
+
+template <typename T>
+json_kind arg_kind() {
+  return arg_kind<T>(has_kind<T>());
+}
+
+constexpr const char* json_kind_names[] = {"",       "null",  "boolean",
+                                           "number", "string", "array",
+                                           "object"};
+
+// Signature codes pack the kinds of the arguments, the first one lowest
+constexpr std::size_t kind_bits = 3;
+constexpr std::size_t max_signature_args = 64 / kind_bits;
+// Code of argument lists too long for a code (no kind is all ones), those
+// are matched by their signature string instead
+constexpr std::uint64_t no_signature_code = ~std::uint64_t(0);
+
+inline const char* kind_name(json_kind kind) {
+  return json_kind_names[static_cast<std::size_t>(kind)];
+}
+
+inline std::uint64_t signature_code(const json_kind* kinds,
+                                    std::size_t count) {
+  if (count > max_signature_args)
+    return no_signature_code;
+  std::uint64_t code = 0;
+  for (std::size_t i = 0; i < count; ++i)
+    code |= static_cast<std::uint64_t>(kinds[i]) << (kind_bits * i);
+  return code;
+}
+
+inline std::string signature_string(const json_kind* kinds,
+                                    std::size_t count) {
+  std::string signature;
+  for (std::size_t i = 0; i < count; ++i) {
+    signature += i == 0 ? "-" : ":";
+    signature += kind_name(kinds[i]);
+  }
+  return signature;
+}
+
+/**
+ * Signature of a function taking Args, as string (e.g. "-string:number",
+ * empty without arguments) and as code, both computed once on first use
+ */
+template <typename... Args>
+struct signature {
+  static const std::string& string() {
+    static const std::string s =
+        signature_string(kinds().data(), sizeof...(Args));
+    return s;
+  }
+
+  static std::uint64_t code() {
+    static const std::uint64_t c =
+        signature_code(kinds().data(), sizeof...(Args));
+    return c;
+  }
+
+ private:
+  typedef std::array<json_kind, sizeof...(Args)> Kinds;
+
+  static const Kinds& kinds() {
+    static const Kinds k{{arg_kind<no_ref_no_const<Args>>()...}};
+    return k;
+  }
+};
+}  // namespace detail
+
+template <typename... Args>
+inline std::string get_signature() {
+  return detail::signature<Args...>::string();
+}
+
+// Signature code of the arguments of a request, to be compared with the
+// ones of the registered functions
+inline std::uint64_t get_signature_code(const json& args) {
+  std::uint64_t code = 0;
+  std::size_t shift = 0;
+  for (const auto& x : args) {
+    if (shift == detail::kind_bits * detail::max_signature_args)
+      return detail::no_signature_code;
+    code |= static_cast<std::uint64_t>(kind_of_value(x)) << shift;
+    shift += detail::kind_bits;
+  }
+  return code;
+}
+
+// Signature of the arguments of a request as string, used in messages
+inline std::string get_signature(const json& args) {
+  std::string signature;
+  for (const auto& x : args) {
+    signature += signature.empty() ? "-" : ":";
+    signature += detail::kind_name(kind_of_value(x));
+  }
+  return signature;
+}
+
+namespace detail {
+
+template <typename T>
+struct is_shared_ptr : std::false_type {};
+
+template <typename T>
+struct is_shared_ptr<std::shared_ptr<T>> : std::true_type {};
+
+template <typename Func>
+struct is_const_member_function : std::false_type {};
+
+template <typename Klass, typename Ret, typename... Args>
+struct is_const_member_function<Ret (Klass::*)(Args...) const>
+    : std::true_type {};
+
+// Reduces a pointer to a (member) function to its plain signature Ret(Args...)
+template <typename Func>
+struct function_signature;
+
+template <typename Ret, typename... Args>
+struct function_signature<Ret (*)(Args...)> {
+  typedef Ret type(Args...);
+};
+
+template <typename Klass, typename Ret, typename... Args>
+struct function_signature<Ret (Klass::*)(Args...)> {
+  typedef Ret type(Args...);
+};
+
+template <typename Klass, typename Ret, typename... Args>
+struct function_signature<Ret (Klass::*)(Args...) const> {
+  typedef Ret type(Args...);
+};
+
+#ifdef __cpp_noexcept_function_type
+// Since C++17 noexcept is part of the type
+template <typename Klass, typename Ret, typename... Args>
+struct is_const_member_function<Ret (Klass::*)(Args...) const noexcept>
+    : std::true_type {};
+
+template <typename Ret, typename... Args>
+struct function_signature<Ret (*)(Args...) noexcept> {
+  typedef Ret type(Args...);
+};
+
+template <typename Klass, typename Ret, typename... Args>
+struct function_signature<Ret (Klass::*)(Args...) noexcept> {
+  typedef Ret type(Args...);
+};
+
+template <typename Klass, typename Ret, typename... Args>
+struct function_signature<Ret (Klass::*)(Args...) const noexcept> {
+  typedef Ret type(Args...);
+};
+#endif
+}  // namespace detail
+
+// Value class
+class Value {
+ public:
+  Value() noexcept : content(0) {}
+
+  template <typename T>
+  Value(const T& value)
+      : content(new holder<
+                typename std::remove_cv<typename std::decay<T>::type>::type>(
+            value)) {}
+
+  Value(const char* const& value) : Value(std::string(value)) {}
+
+  /// Copy constructor
+  Value(const Value& other)
+      : content(other.content ? other.content->clone() : 0) {}
+
+  /// Move constructor
+  Value(Value&& other) : content(other.content) { other.content = 0; }
+
+  template <typename T>
+  Value(T&& value,
+        typename std::enable_if<!std::is_same<Value&, T>::value>::type* = 0,
+        typename std::enable_if<!std::is_const<T>::value>::type* = 0,
+        typename std::enable_if<!detail::is_shared_ptr<T>::value>::type* = 0)
+      : content(new holder<
+                typename std::remove_cv<typename std::decay<T>::type>::type>(
+            std::forward<T>(value))) {}
+
+  ~Value() noexcept { delete content; }
+
+ public:  // functions
+  Value& swap(Value& rhs) noexcept {
+    std::swap(content, rhs.content);
+    return *this;
+  }
+
+  Value& operator=(const Value& rhs) {
+    Value(rhs).swap(*this);
+    return *this;
+  }
+
+  Value& operator=(Value&& rhs) noexcept {
+    rhs.swap(*this);
+    Value().swap(rhs);
+    return *this;
+  }
+
+  template <typename T>
+  Value& operator=(T&& rhs) {
+    Value(static_cast<T&&>(rhs)).swap(*this);
+    return *this;
+  }
+
+  Value& operator=(const char* const& rhs) {
+    Value(std::string(rhs)).swap(*this);
+    return *this;
+  }
+
+  // NOTE: Windows compiler is broken here
+  // template <typename T>
+  // operator const T&() const {
+  //   return const_cast<Value*> (this)->template get<T>();
+  // }
+
+  // template <typename T>
+  // operator T() const {
+  //   return const_cast<Value*> (this)->template get<T>();
+  // }
+
+  template <typename T>
+  T& operator=(T& rhs) {
+    Value(rhs).swap(*this);
+    return *this;
+  }
+
+  bool empty() const noexcept { return !content; }
+
+  void clear() noexcept { Value().swap(*this); }
+
+  std::type_index type() const noexcept {
+    static std::type_index void_type(typeid(void));
+    return content ? content->type() : void_type;
+  }
+
+  template <typename T>
+  inline const T& get() const {
+    // TODO Check type correctness here
+    // TODO implement by specialization and not by overload
+    return _get<T>(typename detail::is_shared_ptr<T>::type());
+  }
+
+ private:  // functions
+  template <typename T>
+  inline const T& _get(const std::true_type&) const {
+    return static_cast<holder<
+        typename std::remove_cv<typename T::element_type>::type>*>(content)
+        ->held;
+  }
+
+  template <typename T>
+  inline const T& _get(const std::false_type&) const {
+    return *(
+        static_cast<holder<typename std::remove_cv<T>::type>*>(content)->held);
+  }
+
+ private:  // types
+  class placeholder {
+   public:  // structors
+    virtual ~placeholder() {}
+
+   public:  // queries
+    virtual std::type_index type() const noexcept = 0;
+
+    virtual placeholder* clone() const = 0;
+  };
+
+  template <typename T>
+  class holder : public placeholder {
+   public:  // structors
+    holder(const T& value) : held(new T(value)) {}
+
+    holder(T&& value) : held(new T(static_cast<T&&>(value))) {}
+
+   public:  // queries
+    virtual std::type_index type() const noexcept {
+      return std::type_index(typeid(T));
+    }
+
+    virtual placeholder* clone() const {
+      // This copies a std::shared_ptr!
+      return new holder(*held);
+    }
+
+    holder& operator=(const holder&) = delete;
+
+   public:  // representation
+    std::shared_ptr<T> held;
+  };
+
+  template <typename T>
+  class holder<std::shared_ptr<T>> : public placeholder {
+   public:
+    holder(const std::shared_ptr<T>& value) : held(value) {}
+
+   public:  // queries
+    virtual std::type_index type() const noexcept {
+      return std::type_index(typeid(T));
+    }
+
+    virtual placeholder* clone() const {
+      // This copies a std::shared_ptr!
+      return new holder(held);
+    }
+
+    holder& operator=(const holder&) = delete;
+
+   public:  // representation
+    std::shared_ptr<T> held;
+  };
+
+  placeholder* content;
+};
+
+inline bool operator==(const Value& lhs, const char& rhs) {
+  return lhs.get<char>() == rhs;
+}
+
+class Function {
+  friend class LocalFactory;
+
+ public:
+  Function() {}
+
+  virtual ~Function() {}
+
+  // Whether the function leaves the instance unchanged (const member)
+  bool is_const() const { return _is_const; }
+
+  void call_function(json& json) { this->do_call_function(Value(), json); }
+
+  void call_function(const Value& instance, json& json) {
+    this->do_call_function(instance, json);
+  }
+
+  /**
+   * Calls the function with arguments read from the request, which is left
+   * untouched (e.g. to be shared by several calls), the return value or the
+   * error go to the response
+   */
+  void call_function(const Value& instance,
+                     const json& request,
+                     json& response) {
+    this->do_call_function(instance, request, response);
+  }
+
+  /**
+   * Calls the function and streams the response to the request, carrying
+   * either the return value or the error, into the writer
+   */
+  template <typename Writer>
+  void call_function(const Value& instance, json& json, Writer& writer) {
+    this->do_call_function(instance, json, writer);
+  }
+
+#ifdef VRPC_WITH_V8
+  /**
+   * Calls the function converting arguments and return value directly from
+   * and to V8, exceptions are not caught
+   */
+  v8::Local<v8::Value> call_function(const Value& instance,
+                                     const V8Scope& scope,
+                                     v8::Local<v8::Array> args) {
+    return this->do_call_function(instance, scope, args);
+  }
+#endif
+
+ protected:
+  virtual void do_call_function(const Value& instance, json& json) = 0;
+
+  virtual void do_call_function(const Value& instance,
+                                const json& request,
+                                json& response) = 0;
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                JsonWriter& writer) = 0;
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                MsgpackWriter& writer) = 0;
+
+  /**
+   * Writes the response envelope around the value written by produce, which
+   * is replaced by an error response if an exception is thrown
+   */
+  template <typename Writer, typename Producer>
+  static void write_response(const json& request,
+                             Writer& writer,
+                             const Producer& produce) {
+    const std::size_t mark = writer.mark();
+    try {
+      writer.begin_response(request, "r");
+      produce();
+      writer.end_response();
+    } catch (const std::exception& e) {
+      writer.rewind(mark);
+      detail::write_error(writer, request, e.what());
+    }
+  }
+
+#ifdef VRPC_WITH_V8
+  virtual v8::Local<v8::Value> do_call_function(const Value& instance,
+                                                const V8Scope& scope,
+                                                v8::Local<v8::Array> args) = 0;
+#endif
+
+ private:
+  bool _is_const = false;
+};
+
+/**
+ * Function with a known signature, which can be invoked without json
+ *
+ * Args are the parameter types the function was registered with.
+ */
+template <typename Ret, typename... Args>
+class TypedFunction : public Function {
+ public:
+  virtual Ret invoke(const Value& instance, Args... args) = 0;
+};
+
+namespace detail {
+
+// Calls the member function f on self with the arguments unpacked from args,
+// f being a compile time constant nothing is bound or stored per call
+template <typename Klass,
+          typename Func,
+          Func f,
+          typename Tuple,
+          std::size_t... Is>
+auto apply_member(Klass* self, Tuple&& args, indices<Is...>)
+    -> decltype((self->*f)(std::get<Is>(std::forward<Tuple>(args))...)) {
+  return (self->*f)(std::get<Is>(std::forward<Tuple>(args))...);
+}
+
+// Same for static functions
+template <typename Func, Func f, typename Tuple, std::size_t... Is>
+auto apply_function(Tuple&& args, indices<Is...>)
+    -> decltype(f(std::get<Is>(std::forward<Tuple>(args))...)) {
+  return f(std::get<Is>(std::forward<Tuple>(args))...);
+}
+}  // namespace detail
+
+template <typename Klass, typename Func, Func f, typename Ret, typename... Args>
+class MemberFunction : public TypedFunction<Ret, Args...> {
+ public:
+  virtual ~MemberFunction() = default;
+
+  virtual Ret invoke(const Value& instance, Args... args) {
+    return (self(instance)->*f)(std::forward<Args>(args)...);
+  }
+
+  virtual void do_call_function(const Value& instance, json& json) {
+    try {
+      detail::return_value<detail::no_ref_no_const<Ret>>::set(
+          json, apply(instance, vrpc::unpack<Args...>(json)));
+    } catch (const std::exception& e) {
+      json["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                const json& request,
+                                json& response) {
+    try {
+      detail::return_value<detail::no_ref_no_const<Ret>>::set(
+          response, apply(instance, vrpc::unpack<Args...>(request)));
+    } catch (const std::exception& e) {
+      response["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                JsonWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                MsgpackWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+#ifdef VRPC_WITH_V8
+  virtual v8::Local<v8::Value> do_call_function(const Value& instance,
+                                                const V8Scope& scope,
+                                                v8::Local<v8::Array> args) {
+    return detail::return_value<detail::no_ref_no_const<Ret>>::to_v8(
+        scope, apply(instance, vrpc::unpack<Args...>(scope, args)));
+  }
+#endif
+
+ private:
+  static Klass* self(const Value& instance) {
+    return instance.get<std::shared_ptr<Klass>>().get();
+  }
+
+  template <typename Tuple>
+  static Ret apply(const Value& instance, Tuple&& args) {
+    return detail::apply_member<Klass, Func, f>(
+        self(instance), std::forward<Tuple>(args),
+        detail::build_indices<sizeof...(Args)>{});
+  }
+
+  template <typename Writer>
+  void stream(const Value& instance, json& json, Writer& writer) {
+    Function::write_response(json, writer, [&]() {
+      detail::return_value<detail::no_ref_no_const<Ret>>::write(
+          writer, json, apply(instance, vrpc::unpack<Args...>(json)));
+    });
+  }
+};
+
+template <typename Klass, typename Func, Func f, typename... Args>
+class MemberFunction<Klass, Func, f, void, Args...>
+    : public TypedFunction<void, Args...> {
+ public:
+  virtual ~MemberFunction() = default;
+
+  virtual void invoke(const Value& instance, Args... args) {
+    (self(instance)->*f)(std::forward<Args>(args)...);
+  }
+
+  virtual void do_call_function(const Value& instance, json& json) {
+    try {
+      apply(instance, vrpc::unpack<Args...>(json));
+      json["r"] = nullptr;
+    } catch (const std::exception& e) {
+      json["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                const json& request,
+                                json& response) {
+    try {
+      apply(instance, vrpc::unpack<Args...>(request));
+      response["r"] = nullptr;
+    } catch (const std::exception& e) {
+      response["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                JsonWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                MsgpackWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+#ifdef VRPC_WITH_V8
+  virtual v8::Local<v8::Value> do_call_function(const Value& instance,
+                                                const V8Scope& scope,
+                                                v8::Local<v8::Array> args) {
+    apply(instance, vrpc::unpack<Args...>(scope, args));
+    return v8::Null(scope.isolate);
+  }
+#endif
+
+ private:
+  static Klass* self(const Value& instance) {
+    return instance.get<std::shared_ptr<Klass>>().get();
+  }
+
+  template <typename Tuple>
+  static void apply(const Value& instance, Tuple&& args) {
+    detail::apply_member<Klass, Func, f>(
+        self(instance), std::forward<Tuple>(args),
+        detail::build_indices<sizeof...(Args)>{});
+  }
+
+  template <typename Writer>
+  void stream(const Value& instance, json& json, Writer& writer) {
+    Function::write_response(json, writer, [&]() {
+      apply(instance, vrpc::unpack<Args...>(json));
+      writer.null();
+    });
+  }
+};
+
+template <typename Func, Func f, typename Ret, typename... Args>
+class StaticFunction : public TypedFunction<Ret, Args...> {
+ public:
+  virtual ~StaticFunction() = default;
+
+  virtual Ret invoke(const Value&, Args... args) {
+    return f(std::forward<Args>(args)...);
+  }
+
+  virtual void do_call_function(const Value&, json& json) {
+    try {
+      detail::return_value<detail::no_ref_no_const<Ret>>::set(
+          json, apply(vrpc::unpack<Args...>(json)));
+    } catch (const std::exception& e) {
+      json["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value&,
+                                const json& request,
+                                json& response) {
+    try {
+      detail::return_value<detail::no_ref_no_const<Ret>>::set(
+          response, apply(vrpc::unpack<Args...>(request)));
+    } catch (const std::exception& e) {
+      response["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                JsonWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                MsgpackWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+#ifdef VRPC_WITH_V8
+  virtual v8::Local<v8::Value> do_call_function(const Value&,
+                                                const V8Scope& scope,
+                                                v8::Local<v8::Array> args) {
+    return detail::return_value<detail::no_ref_no_const<Ret>>::to_v8(
+        scope, apply(vrpc::unpack<Args...>(scope, args)));
+  }
+#endif
+
+ private:
+  template <typename Tuple>
+  static Ret apply(Tuple&& args) {
+    return detail::apply_function<Func, f>(
+        std::forward<Tuple>(args), detail::build_indices<sizeof...(Args)>{});
+  }
+
+  template <typename Writer>
+  void stream(const Value&, json& json, Writer& writer) {
+    Function::write_response(json, writer, [&]() {
+      detail::return_value<detail::no_ref_no_const<Ret>>::write(
+          writer, json, apply(vrpc::unpack<Args...>(json)));
+    });
+  }
+};
+
+template <typename Func, Func f, typename... Args>
+class StaticFunction<Func, f, void, Args...>
+    : public TypedFunction<void, Args...> {
+ public:
+  virtual ~StaticFunction() = default;
+
+  virtual void invoke(const Value&, Args... args) {
+    f(std::forward<Args>(args)...);
+  }
+
+  virtual void do_call_function(const Value&, json& json) {
+    try {
+      apply(vrpc::unpack<Args...>(json));
+      json["r"] = nullptr;
+    } catch (const std::exception& e) {
+      json["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value&,
+                                const json& request,
+                                json& response) {
+    try {
+      apply(vrpc::unpack<Args...>(request));
+      response["r"] = nullptr;
+    } catch (const std::exception& e) {
+      response["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                JsonWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                MsgpackWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+#ifdef VRPC_WITH_V8
+  virtual v8::Local<v8::Value> do_call_function(const Value&,
+                                                const V8Scope& scope,
+                                                v8::Local<v8::Array> args) {
+    apply(vrpc::unpack<Args...>(scope, args));
+    return v8::Null(scope.isolate);
+  }
+#endif
+
+ private:
+  template <typename Tuple>
+  static void apply(Tuple&& args) {
+    detail::apply_function<Func, f>(std::forward<Tuple>(args),
+                                    detail::build_indices<sizeof...(Args)>{});
+  }
+
+  template <typename Writer>
+  void stream(const Value&, json& json, Writer& writer) {
+    Function::write_response(json, writer, [&]() {
+      apply(vrpc::unpack<Args...>(json));
+      writer.null();
+    });
+  }
+};
+
+template <typename Lambda, typename... Args>
+class ConstructorFunction
+    : public TypedFunction<
+          decltype(std::declval<Lambda&>()(std::declval<Args>()...)),
+          Args...> {
+  Lambda _lambda;
+
+ public:
+  typedef decltype(std::declval<Lambda&>()(std::declval<Args>()...)) Ret;
+
+  ConstructorFunction(const Lambda& lambda) : _lambda(lambda) {}
+
+  virtual ~ConstructorFunction() = default;
+
+  virtual Ret invoke(const Value&, Args... args) {
+    return _lambda(std::forward<Args>(args)...);
+  }
+
+  virtual void do_call_function(const Value&, json& json) {
+    try {
+      json["r"] = vrpc::call(_lambda, vrpc::unpack<Args...>(json));
+    } catch (const std::exception& e) {
+      json["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value&,
+                                const json& request,
+                                json& response) {
+    try {
+      response["r"] = vrpc::call(_lambda, vrpc::unpack<Args...>(request));
+    } catch (const std::exception& e) {
+      response["e"] = std::string(e.what());
+    }
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                JsonWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+  virtual void do_call_function(const Value& instance,
+                                json& json,
+                                MsgpackWriter& writer) {
+    this->stream(instance, json, writer);
+  }
+
+#ifdef VRPC_WITH_V8
+  virtual v8::Local<v8::Value> do_call_function(const Value&,
+                                                const V8Scope& scope,
+                                                v8::Local<v8::Array> args) {
+    auto ret = vrpc::call(_lambda, vrpc::unpack<Args...>(scope, args));
+    return v8_converter<decltype(ret)>::to_v8(scope, ret);
+  }
+#endif
+
+ private:
+  template <typename Writer>
+  void stream(const Value&, json& json, Writer& writer) {
+    Function::write_response(json, writer, [&]() {
+      auto ret = vrpc::call(_lambda, vrpc::unpack<Args...>(json));
+      value_writer<decltype(ret)>::write(writer, ret);
+    });
+  }
+};
+
+struct required {};
+
+namespace detail {
+struct param {
+  json j;
+  template <typename DefaultType>
+  param(const std::string& name,
+        const DefaultType& default_value,
+        const std::string& description) {
+    // json tmp{{"t", type()}};
+    // j["type"] = tmp["t"].type_name();
+    j["name"] = name;
+    j["optional"] = true;
+    j["default"] = default_value;
+    j["description"] = description;
+  }
+  param(const std::string& name,
+        const required& default_value,
+        const std::string& description) {
+    // json tmp{{"t", type()}};
+    // j["type"] = tmp["t"].type_name();
+    j["name"] = name;
+    j["optional"] = false;
+    j["default"] = nullptr;
+    j["description"] = description;
+  }
+};
+
+template <typename ValueType>
+struct ret {
+  json j;
+  ret(const std::string& description) {
+    j["type"] = json(ValueType()).type_name();
+    j["description"] = description;
+  }
+};
+template <>
+struct ret<void> {
+  json j;
+  ret(const std::string& description) {
+    j["type"] = "void";
+    j["description"] = description;
+  }
+};
+}  // namespace detail
+
+/**
+ * Work-stealing thread pool
+ *
+ * Each worker owns a task queue, takes tasks from its front and steals from
+ * the back of the other queues once its own ran dry. Tasks posted by a worker
+ * go to its own queue, all others are distributed round-robin.
+ */
+class ThreadPool {
+ public:
+  typedef std::function<void()> Task;
+  static constexpr std::size_t max_size = 256;
+
+  explicit ThreadPool(std::size_t size) : _state(std::make_shared<State>()) {
+    resize(size);
+  }
+
+  // Workers finish the queued tasks on their own
+  ~ThreadPool() { resize(0); }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  std::size_t size() const { return _state->size; }
+
+  /**
+   * Changes the number of workers
+   *
+   * Removed workers leave once done with their current task, their queued
+   * tasks are taken over by the remaining ones.
+   */
+  void resize(std::size_t size) {
+    State& s = *_state;
+    if (size > max_size)
+      size = max_size;
+    std::lock_guard<std::mutex> lock(s.mutex);
+    for (std::size_t i = s.size; i < size; ++i) {
+      // A worker still leaving the slot notices the new generation
+      std::thread(&ThreadPool::work, _state, i, ++s.generations[i]).detach();
+    }
+    for (std::size_t i = size; i < s.size; ++i) ++s.generations[i];
+    s.size = size;
+    if (size > s.slots)
+      s.slots = size;
+    s.wake.notify_all();
+  }
+
+  void post(Task task) {
+    State& s = *_state;
+    const Worker& worker = current();
+    const std::size_t index = worker.state == &s
+                                  ? worker.index
+                                  : s.next++ % std::max<std::size_t>(s.size, 1);
+    {
+      Queue& q = s.queues[index];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      q.tasks.push_back(std::move(task));
+    }
+    ++s.pending;
+    // Idle workers registered before checking for pending tasks
+    if (s.idle > 0) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      s.wake.notify_one();
+    }
+  }
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  struct State {
+    std::array<Queue, max_size> queues;
+    std::atomic<std::size_t> size{0};
+    // Number of queues ever used, all of them are scanned for tasks to steal
+    std::atomic<std::size_t> slots{0};
+    std::atomic<std::size_t> next{0};
+    std::atomic<std::size_t> pending{0};
+    std::atomic<std::size_t> idle{0};
+    std::mutex mutex;
+    std::condition_variable wake;
+    // A worker leaves once the generation of its slot changed
+    std::array<std::uint64_t, max_size> generations{};
+
+    bool take(std::size_t index, Task& task) {
+      const std::size_t n = slots;
+      for (std::size_t k = 0; k < n && pending > 0; ++k) {
+        Queue& q = queues[(index + k) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+          continue;
+        if (k == 0) {
+          task = std::move(q.tasks.front());
+          q.tasks.pop_front();
+        } else {
+          task = std::move(q.tasks.back());
+          q.tasks.pop_back();
+        }
+        --pending;
+        return true;
+      }
+      return false;
+    }
+  };
+
+  struct Worker {
+    const State* state;
+    std::size_t index;
+  };
+
+  static Worker& current() {
+    static thread_local Worker worker{nullptr, 0};
+    return worker;
+  }
+
+  static void work(std::shared_ptr<State> state,
+                   std::size_t index,
+                   std::uint64_t generation) {
+    State& s = *state;
+    current() = Worker{&s, index};
+    for (;;) {
+      Task task;
+      if (s.take(index, task)) {
+        try {
+          task();
+        } catch (const std::exception& e) {
+          _VRPC_DEBUG << "Task failed: " << e.what() << std::endl;
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(s.mutex);
+      ++s.idle;
+      s.wake.wait(lock, [&] {
+        return s.pending > 0 || s.generations[index] != generation;
+      });
+      --s.idle;
+      // Without any workers left, the queued tasks are finished first
+      if (s.generations[index] != generation && (s.size > 0 || s.pending == 0))
+        break;
+    }
+    current() = Worker{nullptr, 0};
+  }
+
+  std::shared_ptr<State> _state;
+};
+
+/**
+ * Ordered queue of tasks, executed on a thread pool
+ *
+ * Tasks start in the order they were posted. Consecutive shared tasks run in
+ * parallel, any other task runs alone, while tasks of different strands run
+ * in parallel.
+ */
+class Strand : public std::enable_shared_from_this<Strand> {
+ public:
+  typedef ThreadPool::Task Task;
+
+  void post(ThreadPool& pool, Task task, bool shared = false) {
+    std::lock_guard<std::mutex> lock(_queue_mutex);
+    _tasks.push_back(Entry{std::move(task), shared});
+    dispatch(pool);
+  }
+
+ private:
+  static constexpr std::size_t _max_batch = 16;
+
+  struct Entry {
+    Task task;
+    bool shared;
+  };
+
+  // Whether the next task may start alongside the running ones
+  bool ready() const {
+    if (_tasks.empty())
+      return false;
+    return _tasks.front().shared ? !_exclusive : _running == 0;
+  }
+
+  Task take() {
+    Entry& entry = _tasks.front();
+    Task task = std::move(entry.task);
+    _exclusive = !entry.shared;
+    ++_running;
+    _tasks.pop_front();
+    return task;
+  }
+
+  // Starts each task that may run now on a worker of its own
+  void dispatch(ThreadPool& pool) {
+    while (ready()) {
+      std::shared_ptr<Strand> self = shared_from_this();
+      Task task = take();
+      pool.post([self, &pool, task] { self->run(pool, task); });
+    }
+  }
+
+  void run(ThreadPool& pool, Task task) {
+    // Continues with the next task, yielding after a few so that strands
+    // take turns on a busy pool
+    for (std::size_t i = 1;; ++i) {
+      try {
+        task();
+      } catch (const std::exception& e) {
+        _VRPC_DEBUG << "Task failed: " << e.what() << std::endl;
+      }
+      std::lock_guard<std::mutex> lock(_queue_mutex);
+      --_running;
+      _exclusive = false;
+      if (i == _max_batch || !ready()) {
+        dispatch(pool);
+        return;
+      }
+      task = take();
+      dispatch(pool);
+    }
+  }
+
+  std::mutex _queue_mutex;
+  std::deque<Entry> _tasks;
+  std::size_t _running = 0;
+  bool _exclusive = false;
+};
 
 namespace detail {
-struct param {
-  json j;
-  template <typename DefaultType>
-  param(const std::string& name,
-        const DefaultType& default_value,
-        const std::string& description) {
-    // json tmp{{"t", type()}};
-    // j["type"] = tmp["t"].type_name();
-    j["name"] = name;
-    j["optional"] = true;
-    j["default"] = default_value;
-    j["description"] = description;
+// Runs asynchronous calls, never destroyed as its workers may outlive static
+// objects at exit
+inline ThreadPool& thread_pool() {
+  static ThreadPool* pool = new ThreadPool(
+      std::max<std::size_t>(std::thread::hardware_concurrency(), 1));
+  return *pool;
+}
+
+inline void post_to_thread_pool(std::function<void()> task) {
+  thread_pool().post(std::move(task));
+}
+
+/**
+ * Reader/writer lock that can be locked again by the threads holding it
+ *
+ * Functions may call back into their instance, e.g. through a synchronous
+ * callback. The exclusive owner may lock both ways again, a thread holding
+ * only shared locks waits for all other readers when locking exclusively.
+ * Waiting writers hold back new readers. Two readers upgrading at once would
+ * wait for each other forever, the second one gets an exception instead.
+ */
+class SharedRecursiveMutex {
+ public:
+  void lock() {
+    const std::thread::id id = std::this_thread::get_id();
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_writer == id) {
+      ++_depth;
+      return;
+    }
+    const std::size_t own = held_shared();
+    if (own > 0) {
+      if (_upgrading)
+        throw std::runtime_error(
+            "Can not lock exclusively while another reader upgrades");
+      _upgrading = true;
+    }
+    ++_waiting;
+    _released.wait(lock, [&] { return _depth == 0 && _readers == own; });
+    --_waiting;
+    if (own > 0)
+      _upgrading = false;
+    _writer = id;
+    _depth = 1;
   }
-  param(const std::string& name,
-        const required& default_value,
-        const std::string& description) {
-    // json tmp{{"t", type()}};
-    // j["type"] = tmp["t"].type_name();
-    j["name"] = name;
-    j["optional"] = false;
-    j["default"] = nullptr;
-    j["description"] = description;
+
+  void unlock() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_depth > 0)
+      return;
+    _writer = std::thread::id();
+    _released.notify_all();
+  }
+
+  void lock_shared() {
+    std::size_t& held = held_shared();
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_writer != std::this_thread::get_id() && held == 0) {
+      _released.wait(lock, [&] { return _depth == 0 && _waiting == 0; });
+    }
+    ++_readers;
+    ++held;
+  }
+
+  void unlock_shared() {
+    --held_shared();
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_readers == 0 || _waiting > 0)
+      _released.notify_all();
+  }
+
+ private:
+  // Number of shared locks the calling thread holds on this mutex
+  std::size_t& held_shared() {
+    static thread_local std::vector<
+        std::pair<const SharedRecursiveMutex*, std::size_t>>
+        held;
+    for (auto& entry : held) {
+      if (entry.first == this)
+        return entry.second;
+    }
+    // Entries of mutexes no longer locked are reused
+    for (auto& entry : held) {
+      if (entry.second == 0) {
+        entry.first = this;
+        return entry.second;
+      }
+    }
+    held.emplace_back(this, 0);
+    return held.back().second;
   }
+
+  std::mutex _mutex;
+  std::condition_variable _released;
+  std::thread::id _writer;
+  std::size_t _depth = 0;
+  std::size_t _readers = 0;
+  std::size_t _waiting = 0;
+  bool _upgrading = false;  // a reader waits for the others to unlock
 };
 
-template <typename ValueType>
-struct ret {
-  json j;
-  ret(const std::string& description) {
-    j["type"] = json(ValueType()).type_name();
-    j["description"] = description;
+// Finds the context ("c") and function ("f") of a request without parsing
+// all of it
+class TargetFinder {
+ public:
+  typedef json::number_integer_t number_integer_t;
+  typedef json::number_unsigned_t number_unsigned_t;
+  typedef json::number_float_t number_float_t;
+  typedef json::string_t string_t;
+  typedef json::binary_t binary_t;
+
+  std::string context;
+  std::string function;
+
+  bool null() { return value(); }
+  bool boolean(bool) { return value(); }
+  bool number_integer(number_integer_t) { return value(); }
+  bool number_unsigned(number_unsigned_t) { return value(); }
+  bool number_float(number_float_t, const string_t&) { return value(); }
+  bool binary(binary_t&) { return value(); }
+
+  bool string(string_t& val) {
+    if (_depth == 1 && _target) {
+      *_target = std::move(val);
+      _target = nullptr;
+      return ++_found < 2;  // done once both are known
+    }
+    return true;
+  }
+
+  bool start_object(std::size_t) { return open(); }
+  bool start_array(std::size_t) { return open(); }
+  bool end_object() { return close(); }
+  bool end_array() { return close(); }
+
+  bool key(string_t& val) {
+    if (_depth == 1) {
+      _target = val == "c" ? &context : val == "f" ? &function : nullptr;
+    }
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string&, const std::exception&) {
+    return false;
+  }
+
+ private:
+  // Stops at a context or function that is not a string
+  bool value() { return !(_depth == 1 && _target); }
+
+  bool open() {
+    if (!value())
+      return false;
+    ++_depth;
+    return true;
+  }
+
+  bool close() {
+    --_depth;
+    return true;
+  }
+
+  std::size_t _depth = 0;
+  std::size_t _found = 0;
+  std::string* _target = nullptr;
+};
+}  // namespace detail
+
+#ifdef VRPC_WITH_COROUTINES
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+template <typename T>
+struct deferred_value : std::false_type {};
+
+template <typename T>
+struct deferred_value<Promise<T>> : std::true_type {
+  typedef T type;
+};
+
+template <typename T>
+struct deferred_value<std::future<T>> : std::true_type {
+  typedef T type;
+};
+
+template <typename T>
+struct deferred_value<std::shared_future<T>> : std::true_type {
+  typedef T type;
+};
+
+// Suspends until the promise settled, resuming on the thread pool
+template <typename T>
+class PromiseAwaiter {
+  typedef typename Promise<T>::value_type Value;
+
+ public:
+  explicit PromiseAwaiter(Promise<T> promise) : _promise(std::move(promise)) {}
+
+  bool await_ready() const { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    // The task may resume before then returns, hence nothing of the awaiter
+    // is touched afterwards
+    _promise.then([this, handle](std::shared_ptr<const Value> value,
+                                 const std::string& error) {
+      _value = std::move(value);
+      _error = error;
+      thread_pool().post([handle] { handle.resume(); });
+    });
+  }
+
+  T await_resume() {
+    if (!_value)
+      throw std::runtime_error(_error);
+    if constexpr (!std::is_void<T>::value)
+      return *_value;
+  }
+
+ private:
+  Promise<T> _promise;
+  std::shared_ptr<const Value> _value;
+  std::string _error;
+};
+
+struct PoolAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> handle) const {
+    thread_pool().post([handle] { handle.resume(); });
+  }
+
+  void await_resume() const noexcept {}
+};
+
+// What the promises of all tasks share
+struct TaskPromiseBase {
+  // Coroutine awaiting the task, if any
+  std::coroutine_handle<> continuation;
+  // Called once done, if nothing awaits the task
+  std::function<void()> on_done;
+  std::exception_ptr error;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<P> handle) noexcept {
+      TaskPromiseBase& promise = handle.promise();
+      if (promise.continuation)
+        return promise.continuation;
+      // Taken out first, as it destroys the coroutine
+      std::function<void()> on_done = std::move(promise.on_done);
+      if (on_done)
+        on_done();
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  // Tasks start once awaited or returned to the adapter
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { error = std::current_exception(); }
+
+  // Promises and futures are awaited without blocking a thread
+  template <typename A>
+  decltype(auto) await_transform(A&& awaitable) {
+    typedef typename std::decay<A>::type D;
+    if constexpr (deferred_value<D>::value) {
+      return PromiseAwaiter<typename deferred_value<D>::type>(
+          promise_of<D>::get(D(std::forward<A>(awaitable))));
+    } else {
+      return A(std::forward<A>(awaitable));
+    }
+  }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+
+  template <typename U>
+  void return_value(U&& u) {
+    value.emplace(std::forward<U>(u));
+  }
+
+  T result() {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(*value);
   }
 };
+
 template <>
-struct ret<void> {
-  json j;
-  ret(const std::string& description) {
-    j["type"] = "void";
-    j["description"] = description;
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object();
+
+  void return_void() {}
+
+  void result() {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+}  // namespace detail
+
+/**
+ * Coroutine completing later, returned by registered functions like a Promise
+ *
+ * A task starts when returned to the adapter (or awaited by another task)
+ * and runs on the calling thread until it first suspends. Awaiting a Promise,
+ * std::future or std::shared_future suspends without blocking a thread, the
+ * task then resumes on the thread pool running asynchronous calls.
+ *
+ * Arguments are gone after the first suspension, hence parameters are taken
+ * by value rather than by reference. Code after a suspension runs without the
+ * instance being locked, tasks of member functions have to keep their
+ * instance alive themselves.
+ */
+template <typename T>
+class Task {
+ public:
+  typedef detail::TaskPromise<T> promise_type;
+
+  Task(Task&& other) noexcept
+      : _handle(std::exchange(other._handle, nullptr)) {}
+
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      if (_handle)
+        _handle.destroy();
+      _handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+  }
+
+  ~Task() {
+    if (_handle)
+      _handle.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<> awaiting) noexcept {
+    _handle.promise().continuation = awaiting;
+    return _handle;
+  }
+
+  T await_resume() { return _handle.promise().result(); }
+
+  // Hands over the coroutine, which is not destroyed by the task anymore
+  std::coroutine_handle<promise_type> release() {
+    return std::exchange(_handle, nullptr);
+  }
+
+ private:
+  friend promise_type;
+
+  explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+  std::coroutine_handle<promise_type> _handle;
+};
+
+// Moves the awaiting task onto the thread pool, e.g. to leave the caller's
+// thread before doing blocking work
+inline detail::PoolAwaiter resume_on_pool() {
+  return detail::PoolAwaiter();
+}
+
+namespace detail {
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>(
+      std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+template <typename T>
+struct promise_of<Task<T>> {
+  // Starts the task, which settles the promise once done
+  static Promise<T> get(Task<T> task) {
+    Promise<T> promise;
+    std::coroutine_handle<TaskPromise<T>> handle = task.release();
+    handle.promise().on_done = [promise, handle]() mutable {
+      settle(promise, handle.promise());
+      handle.destroy();
+    };
+    handle.resume();
+    return promise;
+  }
+
+ private:
+  static void settle(Promise<T>& promise, TaskPromise<T>& task) {
+    if constexpr (std::is_void<T>::value) {
+      try {
+        task.result();
+      } catch (...) {
+        promise.reject(std::current_exception());
+        return;
+      }
+      promise.resolve();
+    } else {
+      std::optional<T> value;
+      try {
+        value.emplace(task.result());
+      } catch (...) {
+        promise.reject(std::current_exception());
+        return;
+      }
+      promise.resolve(std::move(*value));
+    }
   }
 };
+
+template <typename T>
+struct return_value<Task<T>> : deferred_return_value<Task<T>> {};
 }  // namespace detail
+#endif
+
+// Thrown by CancelToken::throw_if_cancelled
+class CallCancelled : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+/**
+ * Tells a running function whether its call got cancelled
+ *
+ * Calls are cancelled by the id ("i") of their request, see
+ * LocalFactory::cancel and the "__cancel__" function of each class, or expire
+ * once the optional deadline ("d", milliseconds since the epoch) of their
+ * request passed. Calls that did not start yet are dropped then, running
+ * functions poll the token of their call to stop early.
+ */
+class CancelToken {
+ public:
+  typedef std::chrono::system_clock Clock;
+
+  // A token that is never cancelled
+  CancelToken() = default;
+
+  bool cancelled() const { return reason() != nullptr; }
+
+  // Why the call got cancelled, null if it did not
+  const char* reason() const {
+    if (!_state)
+      return nullptr;
+    if (_state->cancelled)
+      return "Call cancelled";
+    if (_state->has_deadline && Clock::now() >= _state->deadline)
+      return "Call deadline exceeded";
+    return nullptr;
+  }
+
+  void throw_if_cancelled() const {
+    const char* why = reason();
+    if (why != nullptr)
+      throw CallCancelled(why);
+  }
+
+  bool has_deadline() const { return _state && _state->has_deadline; }
+
+  Clock::time_point deadline() const {
+    return has_deadline() ? _state->deadline : Clock::time_point::max();
+  }
+
+  /**
+   * Token of the call running on this thread, one that is never cancelled
+   * outside of calls
+   *
+   * Coroutine tasks see the token of their call until they first suspend.
+   */
+  static const CancelToken& current() { return current_token(); }
+
+ private:
+  friend class LocalFactory;
+
+  struct State {
+    std::atomic<bool> cancelled{false};
+    bool has_deadline = false;
+    Clock::time_point deadline;
+  };
+
+  explicit CancelToken(std::shared_ptr<State> state)
+      : _state(std::move(state)) {}
+
+  static CancelToken& current_token() {
+    static thread_local CancelToken token;
+    return token;
+  }
+
+  void cancel() const {
+    if (_state)
+      _state->cancelled = true;
+  }
+
+  std::shared_ptr<State> _state;
+};
+
+class LocalFactory {
+  friend LocalFactory& detail::init<LocalFactory>();
+  friend class Proxy;
+  friend class MqttClient;
+
+  // Functions of a context by name including signature (e.g. "foo-string"),
+  // calls find them by name and signature code instead
+  struct FunctionTable {
+    struct Overload {
+      std::uint64_t code;
+      Function* function;
+    };
+    std::unordered_map<std::string, std::shared_ptr<Function>> functions;
+    // Maps: function name (without signature) => overloads
+    std::unordered_map<std::string, std::vector<Overload>> overloads;
+
+    Function* find(const std::string& function) const {
+      const auto it = functions.find(function);
+      return it != functions.end() ? it->second.get() : nullptr;
+    }
+
+    // For holders outliving this table, e.g. handles
+    std::shared_ptr<Function> find_shared(const std::string& function) const {
+      const auto it = functions.find(function);
+      return it != functions.end() ? it->second : nullptr;
+    }
+
+    Function* find(const std::string& name, std::uint64_t code) const {
+      if (code == detail::no_signature_code)
+        return nullptr;
+      const auto it = overloads.find(name);
+      if (it == overloads.end())
+        return nullptr;
+      for (const Overload& overload : it->second) {
+        if (overload.code == code)
+          return overload.function;
+      }
+      return nullptr;
+    }
+
+    // Code as found in the request, args for those too long for a code
+    Function* find(const std::string& name,
+                   std::uint64_t code,
+                   const json& args) const {
+      return code != detail::no_signature_code
+                 ? find(name, code)
+                 : find(name + vrpc::get_signature(args));
+    }
+
+    void add(const std::string& function,
+             std::uint64_t code,
+             const std::shared_ptr<Function>& ptr) {
+      std::shared_ptr<Function>& slot = functions[function];
+      const Function* replaced = slot.get();
+      slot = ptr;
+      auto& list = overloads[function.substr(0, function.find('-'))];
+      for (Overload& overload : list) {
+        if (replaced && overload.function == replaced) {
+          overload = {code, ptr.get()};
+          return;
+        }
+      }
+      list.push_back({code, ptr.get()});
+    }
+  };
+  typedef std::unordered_map<std::string, std::shared_ptr<const FunctionTable>>
+      FunctionRegistry;
+  typedef std::unordered_map<std::string, std::string> SharedInstances;
+  typedef std::unordered_map<std::string, std::set<std::string>>
+      ClassInstances;
+  typedef std::unordered_map<std::string, json> MetaData;
+  typedef std::unordered_map<std::string,
+                             std::unordered_map<std::string, std::uint64_t>>
+      HandleIndex;
+
+  // Immutable once published, registrations publish a modified copy
+  struct Registry {
+    // Maps: class_name => function_name => functionCallback (member functions)
+    FunctionRegistry class_functions;
+    // Maps: class_name => function_name => functionCallback (static functions)
+    FunctionRegistry functions;
+    // Optional schema information
+    MetaData meta_data;
+  };
+
+  // Member functions are shared by all instances of a class and get the
+  // instance handed over on each call
+  struct Instance {
+    Value instance;
+    std::shared_ptr<const FunctionTable> functions;
+    // Orders the asynchronous calls on the instance
+    std::shared_ptr<Strand> strand = std::make_shared<Strand>();
+    // Shared by calls of const member functions, owned by any other call
+    mutable detail::SharedRecursiveMutex mutex;
+  };
+
+  // Locks the instance for the duration of a call to function
+  class InstanceLock {
+   public:
+    InstanceLock(const Instance& instance, const Function& function)
+        : _mutex(instance.mutex), _shared(function.is_const()) {
+      if (_shared)
+        _mutex.lock_shared();
+      else
+        _mutex.lock();
+    }
+
+    ~InstanceLock() {
+      if (_shared)
+        _mutex.unlock_shared();
+      else
+        _mutex.unlock();
+    }
+
+    InstanceLock(const InstanceLock&) = delete;
+    InstanceLock& operator=(const InstanceLock&) = delete;
+
+   private:
+    detail::SharedRecursiveMutex& _mutex;
+    const bool _shared;
+  };
+
+  /**
+   * Makes the cancel token of the request's call current on this thread,
+   * while the call runs
+   *
+   * Only requests carrying an id ("i") or deadline ("d") get a token.
+   */
+  class CallScope {
+   public:
+    explicit CallScope(const json& request) {
+      const auto id = request.find("i");
+      const auto deadline = request.find("d");
+      const bool has_id = id != request.end() && id->is_string();
+      const bool has_deadline =
+          deadline != request.end() && deadline->is_number();
+      if (!has_id && !has_deadline)
+        return;
+      auto state = std::make_shared<CancelToken::State>();
+      if (has_deadline) {
+        state->has_deadline = true;
+        state->deadline =
+            CancelToken::Clock::time_point(std::chrono::duration_cast<
+                                           CancelToken::Clock::duration>(
+                std::chrono::duration<double, std::milli>(
+                    deadline->get<double>())));
+      }
+      _token = CancelToken(std::move(state));
+      if (has_id) {
+        _id = id->get<std::string>();
+        detail::init<LocalFactory>().add_call(_id, _token);
+      }
+      _previous = std::move(CancelToken::current_token());
+      CancelToken::current_token() = _token;
+      _active = true;
+    }
+
+    ~CallScope() {
+      if (!_active)
+        return;
+      CancelToken::current_token() = std::move(_previous);
+      if (!_id.empty())
+        detail::init<LocalFactory>().remove_call(_id, _token);
+    }
 
-class LocalFactory {
-  friend LocalFactory& detail::init<LocalFactory>();
-  friend class Proxy;
-  friend class MqttClient;
+    CallScope(const CallScope&) = delete;
+    CallScope& operator=(const CallScope&) = delete;
 
-  typedef std::unordered_map<std::string, Value> StringAnyMap;
-  typedef std::unordered_map<std::string, std::shared_ptr<Function>>
-      StringFunctionMap;
-  typedef std::unordered_map<std::string, StringFunctionMap> FunctionRegistry;
-  typedef std::unordered_map<std::string, std::string> SharedInstances;
-  typedef std::unordered_map<std::string, json> MetaData;
+    // Why the call must not start, null if it may
+    const char* refusal() const { return _token.reason(); }
+
+   private:
+    bool _active = false;
+    std::string _id;
+    CancelToken _token;
+    CancelToken _previous;
+  };
+
+  struct InstanceShard {
+    std::shared_timed_mutex mutex;
+    // Maps: instanceId => instance
+    std::unordered_map<std::string, std::shared_ptr<const Instance>> instances;
+  };
+
+  struct HandleEntry {
+    // Kept alive by the handle, registering a function again under the same
+    // name does not affect the handles resolved to the replaced one
+    std::shared_ptr<Function> function;
+    std::shared_ptr<const Instance> instance;
+    std::uint32_t generation = 0;
+  };
+
+  static constexpr std::size_t _num_shards = 32;
+  static constexpr std::size_t _max_early_cancels = 1024;
 
-  // Maps: class_name => function_name => functionCallback
-  FunctionRegistry _class_function_registry;
-  // Maps: instanceId => function_name => functionCallback
-  FunctionRegistry _function_registry;
-  // Maps: instanceId => instanceObj
-  StringAnyMap _instances;
+  // Latest registry snapshot, readers cache it per thread (see registry())
+  std::shared_ptr<const Registry> _registry = std::make_shared<Registry>();
+  std::atomic<std::uint64_t> _registry_version{1};
+  std::mutex _registry_mutex;
+  // Instances are distributed over shards, each with its own lock
+  std::array<InstanceShard, _num_shards> _instance_shards;
   // Maps: instanceId => class_name
   SharedInstances _shared_instances;
-  // Optional schema information
-  MetaData _meta_data;
+  // Maps: class_name => instanceIds (both guarded by the same mutex)
+  ClassInstances _class_instances;
+  std::mutex _shared_instances_mutex;
+  // Flat table of resolved functions, indexed by the lower half of a handle
+  std::vector<HandleEntry> _handles;
+  // Slots of released handles, ready for re-use
+  std::vector<std::uint32_t> _free_handles;
+  // Maps: context => function_name => handle
+  HandleIndex _handle_index;
+  std::shared_timed_mutex _handles_mutex;
+  // Maps: request id => tokens of the calls running with it
+  std::unordered_multimap<std::string, CancelToken> _calls;
+  // Ids of cancelled calls that did not start yet, oldest first
+  std::deque<std::string> _early_cancels;
+  std::mutex _calls_mutex;
 
  public:
   template <typename Klass, typename... Args>
@@ -808,6 +4358,7 @@ class LocalFactory {
     LocalFactory::inject_create_isolated_function<Klass, Args...>(class_name);
     LocalFactory::inject_create_shared_function<Klass, Args...>(class_name);
     LocalFactory::inject_delete_function<Klass>(class_name);
+    LocalFactory::inject_cancel_function(class_name);
   }
 
   template <typename Klass,
@@ -817,15 +4368,14 @@ class LocalFactory {
             typename... Args>
   static void register_member_function(const std::string& class_name,
                                        const std::string& function_name) {
-    auto func = [](const std::shared_ptr<Klass>& ptr) {
-      return vrpc::variadic_bind_member<Klass, Func, Args...>(f, ptr);
-    };
     auto funcT =
-        std::make_shared<MemberFunction<Klass, decltype(func), Ret, Args...>>(
-            func);
-    detail::init<LocalFactory>()
-        ._class_function_registry[class_name][function_name] =
-        std::static_pointer_cast<Function>(funcT);
+        std::make_shared<MemberFunction<Klass, Func, f, Ret, Args...>>();
+    funcT->_is_const = detail::is_const_member_function<Func>::value;
+    detail::init<LocalFactory>().update_registry([&](Registry& r) {
+      add_function(r.class_functions, class_name, function_name,
+                   detail::signature<Args...>::code(),
+                   std::static_pointer_cast<Function>(funcT));
+    });
     _VRPC_DEBUG << "Registered: " << class_name << "::" << function_name
                 << std::endl;
   }
@@ -833,11 +4383,12 @@ class LocalFactory {
   template <typename Func, Func f, typename Ret, typename... Args>
   static void register_static_function(const std::string& class_name,
                                        const std::string& function_name) {
-    auto func = []() { return vrpc::variadic_bind<Func, Args...>(f); };
-    auto funcT =
-        std::make_shared<StaticFunction<decltype(func), Ret, Args...>>(func);
-    detail::init<LocalFactory>()._function_registry[class_name][function_name] =
-        std::static_pointer_cast<Function>(funcT);
+    auto funcT = std::make_shared<StaticFunction<Func, f, Ret, Args...>>();
+    detail::init<LocalFactory>().update_registry([&](Registry& r) {
+      add_function(r.functions, class_name, function_name,
+                   detail::signature<Args...>::code(),
+                   std::static_pointer_cast<Function>(funcT));
+    });
     _VRPC_DEBUG << "Registered: " << class_name << "::" << function_name
                 << std::endl;
   }
@@ -847,86 +4398,447 @@ class LocalFactory {
                                  const std::string& description,
                                  const json& params,
                                  const json& ret) {
-    LocalFactory& rf = detail::init<LocalFactory>();
-    json& j = rf._meta_data[class_name];
-    j[function_name]["description"] = description;
-    j[function_name]["params"] = params;
-    j[function_name]["ret"] = ret;
+    detail::init<LocalFactory>().update_registry([&](Registry& r) {
+      json& j = r.meta_data[class_name];
+      j[function_name]["description"] = description;
+      j[function_name]["params"] = params;
+      j[function_name]["ret"] = ret;
+    });
   }
 
   static std::vector<std::string> get_instances(const std::string& class_name) {
-    std::vector<std::string> instances;
-    for (const auto& kv : detail::init<LocalFactory>()._shared_instances) {
-      if (kv.second == class_name)
-        instances.push_back(kv.first);
-    }
-    return instances;
+    LocalFactory& rf = detail::init<LocalFactory>();
+    std::lock_guard<std::mutex> lock(rf._shared_instances_mutex);
+    const auto it = rf._class_instances.find(class_name);
+    if (it == rf._class_instances.end())
+      return {};
+    return std::vector<std::string>(it->second.begin(), it->second.end());
   }
 
   static std::vector<std::string> get_member_functions(
       const std::string& class_name) {
-    std::vector<std::string> functions;
-    const auto& it =
-        detail::init<LocalFactory>()._class_function_registry.find(class_name);
-    if (it != detail::init<LocalFactory>()._class_function_registry.end()) {
-      for (const auto& kv : it->second) {
-        functions.push_back(kv.first);
-      }
-    }
-    return functions;
+    return get_function_names(
+        detail::init<LocalFactory>().registry().class_functions, class_name);
   }
 
   static std::vector<std::string> get_static_functions(
       const std::string& class_name) {
-    std::vector<std::string> functions;
-    const auto& it =
-        detail::init<LocalFactory>()._function_registry.find(class_name);
-    if (it != detail::init<LocalFactory>()._function_registry.end()) {
-      for (const auto& kv : it->second) {
-        functions.push_back(kv.first);
-      }
-    }
-    return functions;
+    return get_function_names(detail::init<LocalFactory>().registry().functions,
+                              class_name);
   }
 
   static std::vector<std::string> get_classes() {
     std::vector<std::string> classes;
     for (const auto& kv :
-         detail::init<LocalFactory>()._class_function_registry) {
+         detail::init<LocalFactory>().registry().class_functions) {
       classes.push_back(kv.first);
     }
     return classes;
   }
 
   static json get_meta_data(const std::string& class_name) {
-    LocalFactory& rf = detail::init<LocalFactory>();
-    return rf._meta_data[class_name];
+    const Registry& r = detail::init<LocalFactory>().registry();
+    const auto it = r.meta_data.find(class_name);
+    return it != r.meta_data.end() ? it->second : json();
   }
 
   static std::string call(const std::string& jsonString) {
-    json json;
-    json = json::parse(jsonString);
-    LocalFactory::call(json);
-    return json.dump();
+    std::string response;
+    LocalFactory::call(jsonString, response);
+    return response;
+  }
+
+  /**
+   * Variant of call appending the response to the given buffer, which hence
+   * can be re-used across calls
+   */
+  static void call(const std::string& request, std::string& response) {
+    json json = json::parse(request);
+    JsonWriter writer(response);
+    LocalFactory::call(json, writer);
+  }
+
+  /**
+   * Binary variant of call, using MessagePack encoded requests and responses
+   */
+  static std::vector<std::uint8_t> call(const std::uint8_t* data,
+                                        std::size_t size) {
+    std::vector<std::uint8_t> response;
+    LocalFactory::call(data, size, response);
+    return response;
+  }
+
+  static void call(const std::uint8_t* data,
+                   std::size_t size,
+                   std::vector<std::uint8_t>& response) {
+    json json = json::from_msgpack(data, data + size);
+    MsgpackWriter writer(response);
+    LocalFactory::call(json, writer);
+  }
+
+  /**
+   * Calls the functions addressed by an array of requests and responds with
+   * the array of their responses, crossing into the factory only once
+   *
+   * Requests run in order. If parallel, the requests of different contexts
+   * (instances or classes) run concurrently on the thread pool, while the
+   * requests of each context keep their order.
+   */
+  static std::string call_batch(const std::string& requests,
+                                bool parallel = false) {
+    std::string response;
+    LocalFactory::call_batch(requests, response, parallel);
+    return response;
+  }
+
+  static void call_batch(const std::string& requests,
+                         std::string& response,
+                         bool parallel = false) {
+    json json = json::parse(requests);
+    JsonWriter writer(response);
+    LocalFactory::call_batch(json, writer, parallel);
+  }
+
+  static void call_batch(const std::uint8_t* data,
+                         std::size_t size,
+                         std::vector<std::uint8_t>& response,
+                         bool parallel = false) {
+    json json = json::from_msgpack(data, data + size);
+    MsgpackWriter writer(response);
+    LocalFactory::call_batch(json, writer, parallel);
   }
 
+  /**
+   * Calls the function addressed by the request
+   *
+   * Arguments are moved into the function call, the "a" entry of the request
+   * hence is left in an unspecified state.
+   */
   static void call(json& json) {
-    const std::string context = json["c"].get<std::string>();
-    std::string function = json["f"].get<std::string>();
-    function += vrpc::get_signature(json["a"]);
-    _VRPC_DEBUG << "Calling function: " << function
-                << " with payload: " << json["a"] << std::endl;
-    auto it_t = detail::init<LocalFactory>()._function_registry.find(context);
-    if (it_t != detail::init<LocalFactory>()._function_registry.end()) {
-      auto it_f = it_t->second.find(function);
-      if (it_f != it_t->second.end()) {
-        it_f->second->call_function(json);
-        return;
+    const CallScope scope(json);
+    if (const char* refusal = scope.refusal()) {
+      json["e"] = refusal;
+      return;
+    }
+    if (is_call_all(json)) {
+      try {
+        json["r"] = LocalFactory::call_all(json);
+      } catch (const std::exception& e) {
+        json["e"] = e.what();
+      }
+      return;
+    }
+    std::shared_ptr<const Instance> instance;
+    std::string error;
+    Function* function =
+        detail::init<LocalFactory>().find_function(json, instance, error);
+    if (!function) {
+      json["e"] = error;
+      return;
+    }
+    if (instance) {
+      const InstanceLock lock(*instance, *function);
+      function->call_function(instance->instance, json);
+    } else {
+      function->call_function(json);
+    }
+  }
+
+  /**
+   * Calls the function addressed by the request and streams the response
+   * into the writer, without collecting the return value in json first
+   *
+   * Arguments are moved into the function call, the "a" entry of the request
+   * hence is left in an unspecified state.
+   */
+  template <typename Writer>
+  static void call(json& json, Writer& writer) {
+    const CallScope scope(json);
+    if (const char* refusal = scope.refusal()) {
+      detail::write_error(writer, json, refusal);
+      return;
+    }
+    if (is_call_all(json)) {
+      LocalFactory::write_call_all(json, writer);
+      return;
+    }
+    std::shared_ptr<const Instance> instance;
+    std::string error;
+    Function* function =
+        detail::init<LocalFactory>().find_function(json, instance, error);
+    if (!function) {
+      detail::write_error(writer, json, error);
+    } else if (instance) {
+      const InstanceLock lock(*instance, *function);
+      function->call_function(instance->instance, json, writer);
+    } else {
+      function->call_function(Value(), json, writer);
+    }
+  }
+
+  template <typename Writer>
+  static void call_batch(json& requests, Writer& writer, bool parallel) {
+    if (!requests.is_array())
+      throw std::runtime_error("Batch must be an array of requests");
+    const std::size_t size = requests.size();
+    writer.begin_array(size);
+    if (!parallel || size < 2) {
+      for (std::size_t i = 0; i < size; ++i) {
+        writer.element(i);
+        LocalFactory::call(requests[i], writer);
+      }
+    } else {
+      // Responses are collected per request and written in order
+      std::vector<typename Writer::buffer_type> responses(size);
+      LocalFactory::for_each_context(requests, [&](std::size_t i) {
+        Writer response(responses[i]);
+        LocalFactory::call(requests[i], response);
+      });
+      for (std::size_t i = 0; i < size; ++i) {
+        writer.element(i);
+        writer.raw(responses[i]);
+      }
+    }
+    writer.end_array();
+  }
+
+  /**
+   * Resolves a function to a numeric handle that can be used with call_by_id
+   *
+   * Resolving the same function of the same context again yields the same
+   * handle. Handles stay valid until the instance they refer to is deleted.
+   *
+   * @param context Class name (static functions) or instance id
+   * @param function Function name including its signature, e.g. "foo-string"
+   * @return handle, safely representable as javascript number
+   */
+  static std::uint64_t resolve(const std::string& context,
+                               const std::string& function) {
+    LocalFactory& rf = detail::init<LocalFactory>();
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(rf._handles_mutex);
+      auto it_h = rf._handle_index.find(context);
+      if (it_h != rf._handle_index.end()) {
+        auto it_hf = it_h->second.find(function);
+        if (it_hf != it_h->second.end())
+          return it_hf->second;
       }
-      json["e"] = "Could not find function: " + function;
+    }
+    const FunctionTable* functions = nullptr;
+    const auto instance = rf.find_instance(context);
+    const Registry& r = rf.registry();
+    if (instance) {
+      functions = instance->functions.get();
+    } else {
+      auto it_t = r.functions.find(context);
+      if (it_t == r.functions.end())
+        throw std::runtime_error("Could not find context: " + context);
+      functions = it_t->second.get();
+    }
+    std::shared_ptr<Function> found = functions->find_shared(function);
+    if (!found)
+      throw std::runtime_error("Could not find function: " + function);
+    std::unique_lock<std::shared_timed_mutex> lock(rf._handles_mutex);
+    // The instance may have been deleted (and its handles released) meanwhile,
+    // a handle to it would never be released then
+    if (instance && rf.find_instance(context) != instance)
+      throw std::runtime_error("Could not find context: " + context);
+    // Another thread may have been faster
+    auto& index_entry = rf._handle_index[context];
+    auto it_hf = index_entry.find(function);
+    if (it_hf != index_entry.end())
+      return it_hf->second;
+    std::uint32_t index;
+    if (rf._free_handles.empty()) {
+      index = static_cast<std::uint32_t>(rf._handles.size());
+      rf._handles.emplace_back();
+    } else {
+      index = rf._free_handles.back();
+      rf._free_handles.pop_back();
+    }
+    HandleEntry& entry = rf._handles[index];
+    entry.function = std::move(found);
+    entry.instance = instance;
+    const std::uint64_t handle =
+        (static_cast<std::uint64_t>(entry.generation) << 32) | index;
+    index_entry[function] = handle;
+    return handle;
+  }
+
+  static std::string call_by_id(std::uint64_t handle, const std::string& args) {
+    std::string response;
+    LocalFactory::call_by_id(handle, args, response);
+    return response;
+  }
+
+  static void call_by_id(std::uint64_t handle,
+                         const std::string& args,
+                         std::string& response) {
+    json json;
+    json["a"] = json::parse(args);
+    JsonWriter writer(response);
+    LocalFactory::call_by_id(handle, json, writer);
+  }
+
+  static std::vector<std::uint8_t> call_by_id(std::uint64_t handle,
+                                              const std::uint8_t* data,
+                                              std::size_t size) {
+    std::vector<std::uint8_t> response;
+    LocalFactory::call_by_id(handle, data, size, response);
+    return response;
+  }
+
+  static void call_by_id(std::uint64_t handle,
+                         const std::uint8_t* data,
+                         std::size_t size,
+                         std::vector<std::uint8_t>& response) {
+    json json;
+    json["a"] = json::from_msgpack(data, data + size);
+    MsgpackWriter writer(response);
+    LocalFactory::call_by_id(handle, json, writer);
+  }
+
+  static void call_by_id(std::uint64_t handle, json& json) {
+    std::shared_ptr<const Instance> instance;
+    Function* function =
+        detail::init<LocalFactory>().find_handle(handle, instance);
+    if (!function) {
+      json["e"] = "Invalid function handle: " + std::to_string(handle);
       return;
     }
-    json["e"] = "Could not find context: " + context;
+    if (instance) {
+      const InstanceLock lock(*instance, *function);
+      function->call_function(instance->instance, json);
+    } else {
+      function->call_function(json);
+    }
+  }
+
+  template <typename Writer>
+  static void call_by_id(std::uint64_t handle, json& json, Writer& writer) {
+    std::shared_ptr<const Instance> instance;
+    Function* function =
+        detail::init<LocalFactory>().find_handle(handle, instance);
+    if (!function) {
+      detail::write_error(writer, json,
+                          "Invalid function handle: " + std::to_string(handle));
+    } else if (instance) {
+      const InstanceLock lock(*instance, *function);
+      function->call_function(instance->instance, json, writer);
+    } else {
+      function->call_function(Value(), json, writer);
+    }
+  }
+
+#ifdef VRPC_WITH_V8
+  /**
+   * Direct variant of call_by_id, converting between V8 and C++ values without
+   * any json in between
+   *
+   * @param handle A handle as obtained by resolve
+   * @param scope Isolate and context the arguments belong to
+   * @param args The function arguments
+   * @return The converted return value
+   * @throws std::runtime_error on invalid handles, exceptions raised by
+   * the function or while converting its arguments are passed on
+   */
+  static v8::Local<v8::Value> call_by_id(std::uint64_t handle,
+                                         const V8Scope& scope,
+                                         v8::Local<v8::Array> args) {
+    std::shared_ptr<const Instance> instance;
+    Function* function =
+        detail::init<LocalFactory>().find_handle(handle, instance);
+    if (!function) {
+      throw std::runtime_error("Invalid function handle: " +
+                               std::to_string(handle));
+    }
+    if (instance) {
+      const InstanceLock lock(*instance, *function);
+      return function->call_function(instance->instance, scope, args);
+    }
+    return function->call_function(Value(), scope, args);
+  }
+#endif
+
+  /**
+   * Executes a task on the thread pool, calls addressed to an instance are
+   * kept in order
+   *
+   * Tasks posted for the same instance start in the order they were posted.
+   * Calls of const member functions run alongside each other, any other call
+   * runs alone, also excluding calls on the instance made meanwhile from
+   * other threads. Tasks for any other context (static functions) run
+   * concurrently.
+   *
+   * @param context Instance id or class name, as found by find_target
+   * @param function Name of the called function, as found by find_target
+   * @param task The task, expected to handle its errors
+   */
+  static void post(const std::string& context,
+                   const std::string& function,
+                   std::function<void()> task) {
+    ThreadPool& pool = detail::thread_pool();
+    const auto instance = detail::init<LocalFactory>().find_instance(context);
+    if (instance)
+      instance->strand->post(pool, std::move(task),
+                             is_const(*instance, function));
+    else
+      pool.post(std::move(task));
+  }
+
+  /**
+   * Finds the context (class name or instance id) and function name a
+   * request addresses, parsing only as far as needed
+   *
+   * Both are left empty for malformed requests.
+   */
+  static void find_target(const std::string& request,
+                          std::string& context,
+                          std::string& function) {
+    detail::TargetFinder finder;
+    json::sax_parse(request.begin(), request.end(), &finder);
+    context = std::move(finder.context);
+    function = std::move(finder.function);
+  }
+
+  static void find_target(const std::uint8_t* data,
+                          std::size_t size,
+                          std::string& context,
+                          std::string& function) {
+    detail::TargetFinder finder;
+    json::sax_parse(data, data + size, &finder,
+                    json::input_format_t::msgpack);
+    context = std::move(finder.context);
+    function = std::move(finder.function);
+  }
+
+  // Number of threads running posted tasks, defaults to the number of cores
+  static std::size_t pool_size() { return detail::thread_pool().size(); }
+
+  static void set_pool_size(std::size_t size) {
+    detail::thread_pool().resize(std::max<std::size_t>(size, 1));
+  }
+
+  /**
+   * Cancels the calls of requests with the given id ("i")
+   *
+   * Calls that did not start yet are dropped once they would, the latest
+   * cancellations of such calls are remembered.
+   *
+   * @return true if a running call got cancelled
+   */
+  static bool cancel(const std::string& call_id) {
+    LocalFactory& rf = detail::init<LocalFactory>();
+    std::lock_guard<std::mutex> lock(rf._calls_mutex);
+    const auto range = rf._calls.equal_range(call_id);
+    if (range.first == range.second) {
+      if (rf._early_cancels.size() == _max_early_cancels)
+        rf._early_cancels.pop_front();
+      rf._early_cancels.push_back(call_id);
+      return false;
+    }
+    for (auto it = range.first; it != range.second; ++it) it->second.cancel();
+    return true;
   }
 
   static void load_bindings(const std::string& path) {
@@ -944,10 +4856,382 @@ class LocalFactory {
  private:
   LocalFactory() {}
 
-  LocalFactory(const LocalFactory&) = default;
+  LocalFactory(const LocalFactory&) = delete;
 
   virtual ~LocalFactory() = default;
 
+  /**
+   * Provides the latest registry snapshot without locking
+   *
+   * Each thread keeps a reference to the snapshot it saw last and only
+   * synchronizes if a newer one got published in between. The returned
+   * reference stays valid until the same thread calls registry() again.
+   */
+  const Registry& registry() {
+    static thread_local std::shared_ptr<const Registry> cache;
+    static thread_local std::uint64_t cached_version = 0;
+    if (cached_version != _registry_version.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(_registry_mutex);
+      cache = _registry;
+      cached_version = _registry_version.load(std::memory_order_relaxed);
+    }
+    return *cache;
+  }
+
+  template <typename Modifier>
+  void update_registry(const Modifier& modify) {
+    std::lock_guard<std::mutex> lock(_registry_mutex);
+    auto registry = std::make_shared<Registry>(*_registry);
+    modify(*registry);
+    _registry = registry;
+    _registry_version.fetch_add(1, std::memory_order_release);
+  }
+
+  static void add_function(FunctionRegistry& registry,
+                           const std::string& class_name,
+                           const std::string& function_name,
+                           std::uint64_t signature_code,
+                           const std::shared_ptr<Function>& function) {
+    auto& functions = registry[class_name];
+    auto copy = functions ? std::make_shared<FunctionTable>(*functions)
+                          : std::make_shared<FunctionTable>();
+    copy->add(function_name, signature_code, function);
+    functions = copy;
+  }
+
+  static std::vector<std::string> get_function_names(
+      const FunctionRegistry& registry,
+      const std::string& class_name) {
+    std::vector<std::string> functions;
+    const auto it = registry.find(class_name);
+    if (it != registry.end()) {
+      for (const auto& kv : it->second->functions) {
+        functions.push_back(kv.first);
+      }
+    }
+    return functions;
+  }
+
+  InstanceShard& shard(const std::string& instance_id) {
+    return _instance_shards[std::hash<std::string>()(instance_id) %
+                            _num_shards];
+  }
+
+  std::shared_ptr<const Instance> find_instance(const std::string& instance_id) {
+    InstanceShard& s = shard(instance_id);
+    std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+    auto it = s.instances.find(instance_id);
+    return it != s.instances.end() ? it->second : nullptr;
+  }
+
+  template <typename Klass>
+  bool add_instance(const std::string& class_name,
+                    const std::string& instance_id,
+                    const std::shared_ptr<Klass>& ptr) {
+    const Registry& r = registry();
+    auto instance = std::make_shared<Instance>();
+    instance->instance = Value(ptr);
+    auto it = r.class_functions.find(class_name);
+    instance->functions = it != r.class_functions.end()
+                              ? it->second
+                              : std::make_shared<FunctionTable>();
+    InstanceShard& s = shard(instance_id);
+    std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+    return s.instances.emplace(instance_id, instance).second;
+  }
+
+  bool remove_instance(const std::string& instance_id) {
+    // Destruction of the instance is deferred until all its calls returned
+    std::shared_ptr<const Instance> instance;
+    {
+      InstanceShard& s = shard(instance_id);
+      std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+      auto it = s.instances.find(instance_id);
+      if (it == s.instances.end())
+        return false;
+      instance = std::move(it->second);
+      s.instances.erase(it);
+    }
+    release_handles(instance_id);
+    std::lock_guard<std::mutex> lock(_shared_instances_mutex);
+    const auto it = _shared_instances.find(instance_id);
+    if (it != _shared_instances.end()) {
+      const auto it_c = _class_instances.find(it->second);
+      it_c->second.erase(instance_id);
+      if (it_c->second.empty())
+        _class_instances.erase(it_c);
+      _shared_instances.erase(it);
+    }
+    return true;
+  }
+
+  // Whether all overloads of the function are const, false if there are none
+  static bool is_const(const Instance& instance, const std::string& function) {
+    const auto it = instance.functions->overloads.find(function);
+    if (it == instance.functions->overloads.end())
+      return false;
+    for (const auto& overload : it->second) {
+      if (!overload.function->is_const())
+        return false;
+    }
+    return true;
+  }
+
+  /**
+   * Looks up the function addressed by the request
+   *
+   * The function is kept alive by the instance (member functions) or the
+   * current registry snapshot (static functions).
+   *
+   * @param json The request
+   * @param instance Set to the addressed instance, if any
+   * @param error Set to the reason if no function is found
+   * @return The function or nullptr
+   */
+  Function* find_function(json& json,
+                          std::shared_ptr<const Instance>& instance,
+                          std::string& error) {
+    const std::string& context = json["c"].get_ref<const std::string&>();
+    const std::string& name = json["f"].get_ref<const std::string&>();
+    const vrpc::json& args = json["a"];
+    _VRPC_DEBUG << "Calling function: " << name << vrpc::get_signature(args)
+                << " with payload: " << args << std::endl;
+    // Keeps the instance alive, even if concurrently deleted
+    instance = find_instance(context);
+    const FunctionTable* functions = nullptr;
+    if (instance) {
+      functions = instance->functions.get();
+    } else {
+      const Registry& r = registry();
+      auto it_t = r.functions.find(context);
+      if (it_t == r.functions.end()) {
+        error = "Could not find context: " + context;
+        return nullptr;
+      }
+      functions = it_t->second.get();
+    }
+    // Overloads are told apart by the kinds of their arguments
+    Function* function =
+        functions->find(name, vrpc::get_signature_code(args), args);
+    if (!function)
+      error = "Could not find function: " + name + vrpc::get_signature(args);
+    return function;
+  }
+
+  /**
+   * Runs the requests grouped by their context ("c"), the groups concurrently
+   * on the thread pool and the requests of each group in order
+   */
+  template <typename Run>
+  static void for_each_context(const json& requests, const Run& run) {
+    std::vector<std::vector<std::size_t>> groups;
+    std::unordered_map<std::string, std::size_t> group_of;
+    for (std::size_t i = 0; i < requests.size(); ++i) {
+      const json& request = requests[i];
+      const auto c = request.find("c");
+      const std::string context = c != request.end() && c->is_string()
+                                      ? c->get<std::string>()
+                                      : std::string();
+      const auto it = group_of.emplace(context, groups.size()).first;
+      if (it->second == groups.size())
+        groups.emplace_back();
+      groups[it->second].push_back(i);
+    }
+    LocalFactory::fan_out(groups.size(), [&](std::size_t g) {
+      for (std::size_t i : groups[g]) run(i);
+    });
+  }
+
+  /**
+   * Runs the jobs 0..size-1 concurrently on the thread pool and returns once
+   * all of them finished, rethrowing the first exception of any
+   *
+   * The calling thread takes jobs as well and only waits for the ones taken
+   * by others, a busy pool hence delays but never blocks the jobs.
+   */
+  template <typename Run>
+  static void fan_out(std::size_t size, const Run& run) {
+    struct Jobs {
+      std::size_t size;
+      std::function<void(std::size_t)> run;
+      std::shared_ptr<const EventCallbackHandler> handler;
+      std::atomic<std::size_t> next{0};
+      std::size_t done = 0;
+      std::exception_ptr error;
+      std::mutex mutex;
+      std::condition_variable finished;
+
+      void work() {
+        for (std::size_t i = next++; i < size; i = next++) {
+          std::exception_ptr e;
+          try {
+            run(i);
+          } catch (...) {
+            e = std::current_exception();
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          if (e && !error)
+            error = e;
+          if (++done == size)
+            finished.notify_all();
+        }
+      }
+    };
+    if (size == 0)
+      return;
+    auto jobs = std::make_shared<Jobs>();
+    jobs->size = size;
+    jobs->run = run;
+    jobs->handler = detail::scoped_callback_handler();
+    // The jobs outlive helpers that start late, they find none left
+    ThreadPool& pool = detail::thread_pool();
+    const std::size_t helpers = std::min(size - 1, pool.size());
+    for (std::size_t i = 0; i < helpers; ++i) {
+      pool.post([jobs] {
+        const CallbackScope scope(jobs->handler);
+        jobs->work();
+      });
+    }
+    jobs->work();
+    std::unique_lock<std::mutex> lock(jobs->mutex);
+    jobs->finished.wait(lock, [&jobs] { return jobs->done == jobs->size; });
+    if (jobs->error)
+      std::rethrow_exception(jobs->error);
+  }
+
+  template <typename Writer>
+  static void write_call_all(json& request, Writer& writer) {
+    json result;
+    try {
+      result = LocalFactory::call_all(request);
+    } catch (const std::exception& e) {
+      detail::write_error(writer, request, e.what());
+      return;
+    }
+    writer.begin_response(request, "r");
+    writer.value(result);
+    writer.end_response();
+  }
+
+  static bool is_call_all(const json& request) {
+    const auto f = request.find("f");
+    return f != request.end() && *f == "__callAll__";
+  }
+
+  /**
+   * Calls a member function on all shared instances of a class, concurrently
+   * on the thread pool
+   *
+   * The request addresses the class ("c") and carries the function name
+   * followed by its arguments ("a"). The arguments are split off once into
+   * a request shared read-only by all calls, each converting them directly
+   * into its parameters.
+   *
+   * @return Array of {id, val, err}, one per instance, as VrpcAdapter returns
+   */
+  static json call_all(json& request) {
+    const json& a = request.at("a");
+    if (!a.is_array() || a.empty() || !a[0].is_string())
+      throw std::runtime_error("Expecting the function name as first argument");
+    const std::string class_name = request.at("c").get<std::string>();
+    json call = {{"a", json(a.begin() + 1, a.end())}};
+    const auto s = request.find("s");
+    if (s != request.end())
+      call["s"] = *s;
+    const json& shared = call;
+    const json& args = shared["a"];
+    const std::string& name = a[0].get_ref<const std::string&>();
+    const std::uint64_t code = vrpc::get_signature_code(args);
+    const std::vector<std::string> ids =
+        LocalFactory::get_instances(class_name);
+    json result(json::value_t::array);
+    result.get_ref<json::array_t&>().resize(ids.size());
+    LocalFactory::fan_out(ids.size(), [&](std::size_t i) {
+      json& entry = result[i];
+      entry["id"] = ids[i];
+      entry["val"] = nullptr;
+      entry["err"] = nullptr;
+      // Deleted meanwhile or lacking the function
+      const auto instance = detail::init<LocalFactory>().find_instance(ids[i]);
+      if (!instance) {
+        entry["err"] = "Could not find instance: " + ids[i];
+        return;
+      }
+      Function* function = instance->functions->find(name, code, args);
+      if (!function) {
+        entry["err"] = "Could not find function: " + name +
+                       vrpc::get_signature(args);
+        return;
+      }
+      // Deferred return values are addressed using "f" and "s"
+      json response = {{"c", ids[i]}, {"f", a[0]}};
+      if (s != request.end())
+        response["s"] = *s;
+      {
+        const InstanceLock lock(*instance, *function);
+        function->call_function(instance->instance, shared, response);
+      }
+      const auto e = response.find("e");
+      if (e != response.end())
+        entry["err"] = std::move(*e);
+      else
+        entry["val"] = std::move(response["r"]);
+    });
+    return result;
+  }
+
+  void add_call(const std::string& call_id, const CancelToken& token) {
+    std::lock_guard<std::mutex> lock(_calls_mutex);
+    const auto it =
+        std::find(_early_cancels.begin(), _early_cancels.end(), call_id);
+    if (it != _early_cancels.end()) {
+      _early_cancels.erase(it);
+      token.cancel();
+    }
+    _calls.emplace(call_id, token);
+  }
+
+  void remove_call(const std::string& call_id, const CancelToken& token) {
+    std::lock_guard<std::mutex> lock(_calls_mutex);
+    const auto range = _calls.equal_range(call_id);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second._state == token._state) {
+        _calls.erase(it);
+        return;
+      }
+    }
+  }
+
+  // The function stays valid while the instance is held, handles of static
+  // functions are never released
+  Function* find_handle(std::uint64_t handle,
+                        std::shared_ptr<const Instance>& instance) {
+    const std::uint32_t index = static_cast<std::uint32_t>(handle);
+    std::shared_lock<std::shared_timed_mutex> lock(_handles_mutex);
+    if (index >= _handles.size()) return nullptr;
+    const HandleEntry& entry = _handles[index];
+    if (!entry.function || entry.generation != (handle >> 32)) return nullptr;
+    instance = entry.instance;
+    return entry.function.get();
+  }
+
+  void release_handles(const std::string& context) {
+    std::unique_lock<std::shared_timed_mutex> lock(_handles_mutex);
+    auto it = _handle_index.find(context);
+    if (it == _handle_index.end())
+      return;
+    for (const auto& kv : it->second) {
+      const std::uint32_t index = static_cast<std::uint32_t>(kv.second);
+      HandleEntry& entry = _handles[index];
+      entry.function.reset();
+      entry.instance.reset();
+      // Keep the generation within 21 bits (javascript number precision)
+      entry.generation = (entry.generation + 1) & 0x1FFFFF;
+      _free_handles.push_back(index);
+    }
+    _handle_index.erase(it);
+  }
+
   template <typename Klass>
   static std::string create_instance_id(
       const std::shared_ptr<Klass>& ptr) noexcept {
@@ -960,27 +5244,23 @@ class LocalFactory {
   static void inject_create_isolated_function(const std::string& class_name) {
     auto func = [=](const std::string& instance_id, Args... args) {
       LocalFactory& rf = detail::init<LocalFactory>();
-      const auto& it = rf._instances.find(instance_id);
-      if (it != rf._instances.end())
+      if (rf.find_instance(instance_id))
         return instance_id;
-      // Create instance
+      // Create instance and keep it alive by saving the shared_ptr, member
+      // functions are looked up in the class' function table
       auto ptr = std::shared_ptr<Klass>(new Klass(args...));
-      // Bind member functions
-      for (auto& i : rf._class_function_registry[class_name]) {
-        auto functionCallback = i.second->clone();
-        functionCallback->bind_instance(ptr);
-        rf._function_registry[instance_id][i.first] = functionCallback;
-      }
-      // Keep instance alive by saving the shared_ptr
-      rf._instances[instance_id] = Value(ptr);
+      rf.add_instance(class_name, instance_id, ptr);
       return instance_id;
     };
     auto funcT = std::make_shared<
         ConstructorFunction<decltype(func), const std::string&, Args...>>(func);
     const std::string func_name("__createIsolated__" +
                                 vrpc::get_signature<std::string, Args...>());
-    detail::init<LocalFactory>()._function_registry[class_name][func_name] =
-        std::static_pointer_cast<Function>(funcT);
+    detail::init<LocalFactory>().update_registry([&](Registry& r) {
+      add_function(r.functions, class_name, func_name,
+                   detail::signature<std::string, Args...>::code(),
+                   std::static_pointer_cast<Function>(funcT));
+    });
     _VRPC_DEBUG << "Registered: " << class_name << "::" << func_name
                 << std::endl;
   }
@@ -989,29 +5269,28 @@ class LocalFactory {
   static void inject_create_shared_function(const std::string& class_name) {
     auto func = [=](const std::string& instance_id, Args... args) {
       LocalFactory& rf = detail::init<LocalFactory>();
-      const auto& it = rf._instances.find(instance_id);
-      if (it != rf._instances.end())
+      if (rf.find_instance(instance_id))
         return instance_id;
-      // Create instance
+      // Create instance and keep it alive by saving the shared_ptr, member
+      // functions are looked up in the class' function table
       auto ptr = std::shared_ptr<Klass>(new Klass(args...));
-      // Bind member functions
-      for (auto& i : rf._class_function_registry[class_name]) {
-        auto functionCallback = i.second->clone();
-        functionCallback->bind_instance(ptr);
-        rf._function_registry[instance_id][i.first] = functionCallback;
+      if (rf.add_instance(class_name, instance_id, ptr)) {
+        // Store shared instance
+        std::lock_guard<std::mutex> lock(rf._shared_instances_mutex);
+        rf._shared_instances.insert({instance_id, class_name});
+        rf._class_instances[class_name].insert(instance_id);
       }
-      // Keep instance alive by saving the shared_ptr
-      rf._instances[instance_id] = Value(ptr);
-      // Store shared instance
-      rf._shared_instances.insert({instance_id, class_name});
       return instance_id;
     };
     auto funcT = std::make_shared<
         ConstructorFunction<decltype(func), const std::string&, Args...>>(func);
     const std::string func_name("__createShared__" +
                                 vrpc::get_signature<std::string, Args...>());
-    detail::init<LocalFactory>()._function_registry[class_name][func_name] =
-        std::static_pointer_cast<Function>(funcT);
+    detail::init<LocalFactory>().update_registry([&](Registry& r) {
+      add_function(r.functions, class_name, func_name,
+                   detail::signature<std::string, Args...>::code(),
+                   std::static_pointer_cast<Function>(funcT));
+    });
     _VRPC_DEBUG << "Registered: " << class_name << "::" << func_name
                 << std::endl;
   }
@@ -1019,26 +5298,174 @@ class LocalFactory {
   template <typename Klass>
   static void inject_delete_function(const std::string& class_name) {
     auto func = [=](const std::string& instance_id) {
-      LocalFactory& rf = detail::init<LocalFactory>();
-      const auto& it = rf._instances.find(instance_id);
-      if (it == rf._instances.end())
-        return false;
-      rf._function_registry.erase(instance_id);
-      rf._instances.erase(instance_id);
-      rf._shared_instances.erase(instance_id);
-      return true;
+      return detail::init<LocalFactory>().remove_instance(instance_id);
     };
     auto funcT = std::make_shared<
         ConstructorFunction<decltype(func), const std::string&>>(func);
     const std::string func_name("__delete__" +
                                 vrpc::get_signature<std::string>());
-    detail::init<LocalFactory>()._function_registry[class_name][func_name] =
-        std::static_pointer_cast<Function>(funcT);
+    detail::init<LocalFactory>().update_registry([&](Registry& r) {
+      add_function(r.functions, class_name, func_name,
+                   detail::signature<std::string>::code(),
+                   std::static_pointer_cast<Function>(funcT));
+    });
+    _VRPC_DEBUG << "Registered: " << class_name << "::" << func_name
+                << std::endl;
+  }
+
+  static void inject_cancel_function(const std::string& class_name) {
+    auto func = [](const std::string& call_id) {
+      return LocalFactory::cancel(call_id);
+    };
+    auto funcT = std::make_shared<
+        ConstructorFunction<decltype(func), const std::string&>>(func);
+    const std::string func_name("__cancel__" +
+                                vrpc::get_signature<std::string>());
+    detail::init<LocalFactory>().update_registry([&](Registry& r) {
+      add_function(r.functions, class_name, func_name,
+                   detail::signature<std::string>::code(),
+                   std::static_pointer_cast<Function>(funcT));
+    });
     _VRPC_DEBUG << "Registered: " << class_name << "::" << func_name
                 << std::endl;
   }
 };
 
+/**
+ * Calls functions registered with the LocalFactory from within the same
+ * process
+ *
+ * Functions are resolved once and invoked with their native argument and
+ * return types if the requested signature equals the registered one (e.g.
+ * bool(const std::string&) for a function registered as taking a const
+ * std::string&). Otherwise calls fall back to json, which converts between
+ * compatible types but can not return references or pass callbacks.
+ *
+ * Example:
+ *
+ *   auto bar = vrpc::Proxy::create("Bar", "bar1");
+ *   auto add = bar.method<void(const Bottle&)>("addBottle");
+ *   add(bottle);
+ */
+class Proxy {
+ public:
+  template <typename Signature>
+  class Method;
+
+  /**
+   * @param context Class name (static functions) or instance id
+   */
+  explicit Proxy(std::string context) : _context(std::move(context)) {}
+
+  /**
+   * Creates a shared instance, unless one with the same id exists already
+   *
+   * @param class_name Name of the class to instantiate
+   * @param instance_id Id of the new instance
+   * @param args Constructor arguments
+   * @return Proxy to the instance
+   */
+  template <typename... Args>
+  static Proxy create(const std::string& class_name,
+                      const std::string& instance_id,
+                      const Args&... args) {
+    Proxy(class_name)
+        .method<std::string(const std::string&, const Args&...)>(
+            "__createShared__")(instance_id, args...);
+    return Proxy(instance_id);
+  }
+
+  /**
+   * Resolves a function of this proxy's context
+   *
+   * @param function Name of the function (without signature)
+   * @return Callable with the given signature
+   * @throws std::runtime_error if no matching function is registered
+   */
+  template <typename Signature>
+  Method<Signature> method(const std::string& function) const {
+    return Method<Signature>(_context, function);
+  }
+
+  const std::string& context() const { return _context; }
+
+ private:
+  std::string _context;
+};
+
+template <typename Ret, typename... Args>
+class Proxy::Method<Ret(Args...)> {
+  std::uint64_t _handle;
+
+ public:
+  Method(const std::string& context, const std::string& function)
+      : _handle(LocalFactory::resolve(
+            context, function + vrpc::get_signature<Args...>())) {
+    std::shared_ptr<const LocalFactory::Instance> instance;
+    if (std::is_reference<Ret>::value &&
+        !dynamic_cast<TypedFunction<Ret, Args...>*>(
+            detail::init<LocalFactory>().find_handle(_handle, instance))) {
+      throw std::runtime_error("Signature of " + context + "::" + function +
+                               " differs from the registered one, which is"
+                               " required for returning references");
+    }
+  }
+
+  /**
+   * Calls the function, locking its instance like any other call
+   *
+   * @throws std::runtime_error if the instance got deleted in between,
+   * exceptions raised by the function are passed on
+   */
+  Ret operator()(Args... args) const {
+    std::shared_ptr<const LocalFactory::Instance> instance;
+    Function* function =
+        detail::init<LocalFactory>().find_handle(_handle, instance);
+    if (!function) {
+      throw std::runtime_error("Invalid function handle: " +
+                               std::to_string(_handle));
+    }
+    if (instance) {
+      const LocalFactory::InstanceLock lock(*instance, *function);
+      return call(*function, instance->instance, std::forward<Args>(args)...);
+    }
+    static const Value none;
+    return call(*function, none, std::forward<Args>(args)...);
+  }
+
+ private:
+  static Ret call(Function& function, const Value& target, Args... args) {
+    // Typed if the function has exactly the requested signature
+    auto typed = dynamic_cast<TypedFunction<Ret, Args...>*>(&function);
+    if (typed)
+      return typed->invoke(target, std::forward<Args>(args)...);
+    json json;
+    json["a"] = vrpc::json::array({vrpc::json(args)...});
+    function.call_function(target, json);
+    if (json.contains("e"))
+      throw std::runtime_error(json["e"].get<std::string>());
+    return result(json["r"], Kind());
+  }
+
+  // Return values are extracted from json (2), unless void (0) or references
+  // (1), which typed calls only can return
+  typedef std::integral_constant<int,
+                                 std::is_void<Ret>::value        ? 0
+                                 : std::is_reference<Ret>::value ? 1
+                                                                 : 2>
+      Kind;
+
+  static Ret result(json&, std::integral_constant<int, 0>) {}
+
+  static Ret result(json&, std::integral_constant<int, 1>) {
+    throw std::logic_error("References can only be returned by typed calls");
+  }
+
+  static Ret result(json& r, std::integral_constant<int, 2>) {
+    return detail::move_out<detail::no_ref_no_const<Ret>>::get(r);
+  }
+};
+
 namespace detail {
 
 template <class Klass, typename... Args>
@@ -1158,8 +5585,90 @@ template <typename Func, Func f, typename Ret, typename... Args>
 struct RegisterStaticFunctionX {
   static const StaticFunctionXRegistrar<Func, f, Ret, Args...> registerAs;
 };
+
+// Registrars taking the deduced signature Ret(Args...) instead of the types
+template <class Klass, typename Func, Func f, typename Signature>
+struct MemberFunctionBinder;
+
+template <class Klass, typename Func, Func f, typename Ret, typename... Args>
+struct MemberFunctionBinder<Klass, Func, f, Ret(Args...)>
+    : MemberFunctionRegistrar<Klass, Func, f, Ret, Args...> {
+  using MemberFunctionRegistrar<Klass, Func, f, Ret, Args...>::
+      MemberFunctionRegistrar;
+};
+
+template <typename Func, Func f, typename Signature>
+struct StaticFunctionBinder;
+
+template <typename Func, Func f, typename Ret, typename... Args>
+struct StaticFunctionBinder<Func, f, Ret(Args...)>
+    : StaticFunctionRegistrar<Func, f, Ret, Args...> {
+  using StaticFunctionRegistrar<Func, f, Ret, Args...>::StaticFunctionRegistrar;
+};
 }  // namespace detail
 
+/**
+ * Registers a class without macros, deducing return type, argument types and
+ * const-ness from the function pointers
+ *
+ * Usage (C++17):
+ *
+ *   const auto bar = vrpc::bind_class<Bar>("Bar")
+ *                        .constructor<>()
+ *                        .constructor<const Bar::Selection&>()
+ *                        .method<&Bar::addBottle>("addBottle")
+ *                        .static_method<&Bar::philosophy>("philosophy");
+ *
+ * Before C++17 the pointer's type must be given as well, e.g.
+ * method<decltype(&Bar::addBottle), &Bar::addBottle>("addBottle"). Overloads
+ * are picked by a static_cast to the wanted pointer type. There is no limit on
+ * the number of arguments (beyond 21 overloads are told apart by signature
+ * string rather than code) and functions are invoked directly through the
+ * pointer.
+ */
+template <class Klass>
+class bind_class {
+  std::string _class_name;
+
+ public:
+  explicit bind_class(const std::string& class_name)
+      : _class_name(class_name) {}
+
+  template <typename... Args>
+  bind_class& constructor() {
+    LocalFactory::register_constructor<Klass, Args...>(_class_name);
+    return *this;
+  }
+
+  template <typename Func, Func f>
+  bind_class& method(const std::string& function_name) {
+    detail::MemberFunctionBinder<
+        Klass, Func, f, typename detail::function_signature<Func>::type>(
+        _class_name, function_name);
+    return *this;
+  }
+
+  template <typename Func, Func f>
+  bind_class& static_method(const std::string& function_name) {
+    detail::StaticFunctionBinder<
+        Func, f, typename detail::function_signature<Func>::type>(
+        _class_name, function_name);
+    return *this;
+  }
+
+#ifdef __cpp_nontype_template_parameter_auto
+  template <auto f>
+  bind_class& method(const std::string& function_name) {
+    return this->method<decltype(f), f>(function_name);
+  }
+
+  template <auto f>
+  bind_class& static_method(const std::string& function_name) {
+    return this->static_method<decltype(f), f>(function_name);
+  }
+#endif
+};
+
 // ####################### Macro utility #######################
 
 #define CAT(A, B) A##B
@@ -1199,6 +5708,9 @@ struct RegisterStaticFunctionX {
 
 #define VRPC_CALLBACK(...) const std::function<void(__VA_ARGS__)>&
 
+// Callback with a delivery policy, e.g. VRPC_CALLBACK_X(vrpc::keep_latest, int)
+#define VRPC_CALLBACK_X(Policy, ...) const vrpc::callback<Policy(__VA_ARGS__)>&
+
 //  ####################### Constructors #######################
 
 #define _VRPC_CTOR_RET_DESC "returns the id of the created instance"
@@ -38,9 +38,22 @@ SOFTWARE.
 */
 
 #include <node.h>
+#include <node_buffer.h>
 #include <uv.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Unless bindings are loaded dynamically (and hence compiled independently),
+// functions can convert arguments and return values directly from and to V8
+#if !defined(VRPC_WITH_DL) && !defined(VRPC_WITH_V8)
+#define VRPC_WITH_V8
+#endif
 
 #include <vrpc/json.hpp>
 #include <vrpc/adapter.hpp>
@@ -49,10 +62,9 @@ SOFTWARE.
 #include <adapter.cpp>
 #endif
 
-#define _VRPC_MAX_HANDLERS 32
-
 namespace vrpc_bindings {
 
+using v8::Array;
 using v8::Context;
 using v8::CopyablePersistentTraits;
 using v8::Exception;
@@ -62,16 +74,128 @@ using v8::HandleScope;
 using v8::Isolate;
 using v8::Local;
 using v8::NewStringType;
+using v8::Number;
 using v8::Object;
 using v8::Persistent;
+using v8::Promise;
+using v8::TryCatch;
 using v8::String;
 using v8::Value;
 
-typedef std::pair<Isolate*, std::string> AsyncData;
-static std::vector<AsyncData> _data_queue;
-static std::thread::id _thread_id;
-static std::mutex _data_queue_mutex;
-static uv_async_t async;
+// Callback event on its way to the main thread. Events of registered
+// callbacks are kept as they are, all others are rendered to their envelope.
+struct QueuedEvent {
+  std::unique_ptr<vrpc::CallbackEvent> event;
+  std::string envelope;
+};
+
+// Events of callbacks delivered under a bounding or coalescing policy queue
+// up per callback id, the first event schedules the channel for delivery
+struct CallbackChannel {
+  std::string callback_id;
+  std::mutex mutex;
+  std::condition_variable drained;
+  std::deque<QueuedEvent> events;
+  bool scheduled = false;
+  std::size_t blocked = 0;  // number of producers waiting for space
+  bool closed = false;      // the environment is gone, events are dropped
+};
+
+// Callbacks fired from other threads are pushed onto a lock-free stack and
+// delivered in batches once the loop wakes up
+struct PendingCallback {
+  PendingCallback* next;
+  QueuedEvent queued;
+  std::shared_ptr<CallbackChannel> channel;  // instead of the event
+};
+
+// Javascript functions registered as callbacks, referenced by numeric handles
+// which are embedded into their callback ids
+struct RegisteredCallback {
+  v8::Global<Function> function;
+  bool once;  // released after its first event
+};
+
+struct AsyncCall;
+
+// Everything an instance of the addon needs per node environment (the main
+// thread and each worker thread), the factory is shared by all of them
+struct Environment {
+  Isolate* isolate;
+  std::thread::id thread_id;
+  uv_async_t async;
+  // Guards waking up the loop against closing the handle
+  std::mutex async_mutex;
+  bool closed = false;
+  std::atomic<PendingCallback*> pending_callbacks{nullptr};
+  // Asynchronous calls done on the thread pool, waiting to be settled
+  std::atomic<AsyncCall*> completed_calls{nullptr};
+  // Calls not settled yet, released when the environment closes meanwhile
+  std::unordered_set<AsyncCall*> calls_in_flight;
+  bool worker = false;  // runs the loop of a worker thread
+  // Policies set from javascript (overriding the ones of the bound functions)
+  // and the channels of callbacks with pending events
+  std::mutex channels_mutex;
+  std::unordered_map<std::string, vrpc::CallbackPolicy> callback_policies;
+  std::atomic<std::size_t> n_callback_policies{0};
+  std::unordered_map<std::string, std::shared_ptr<CallbackChannel>> channels;
+  bool channels_closed = false;
+  std::atomic<std::uint64_t> dropped_callbacks{0};
+  // Synchronous calls the loop thread is within, it drains no channels then
+  std::atomic<std::size_t> synchronous_calls{0};
+  std::atomic<std::uint64_t> coalesced_callbacks{0};
+  // Handlers receiving the events of all callbacks that are not registered
+  std::vector<v8::Global<Function>> callback_handlers;
+  std::unordered_map<std::uint32_t, RegisteredCallback> callbacks;
+  std::uint32_t next_callback = 0;
+  // Receives the events of all callbacks created by calls of this environment
+  std::shared_ptr<const vrpc::EventCallbackHandler> handler;
+  // Json responses are written into this buffer, which keeps its capacity
+  // across calls (unless grown very large)
+  std::string response_buffer;
+  // Keeps the environment alive until its loop handle got closed
+  std::shared_ptr<Environment> self;
+
+  ~Environment();
+};
+
+static const std::size_t _max_response_buffer = 16 * 1024 * 1024;
+
+Environment& environment(const FunctionCallbackInfo<Value>& args) {
+  return *static_cast<Environment*>(args.Data().As<v8::External>()->Value());
+}
+
+// Scope of a call blocking the loop thread, callbacks created during the call
+// report to the calling environment
+class SynchronousCall {
+ public:
+  explicit SynchronousCall(Environment& env)
+      : _env(env), _callbackScope(env.handler) {
+    // Only ever changed by the loop thread
+    _env.synchronous_calls.store(
+        _env.synchronous_calls.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+  }
+
+  ~SynchronousCall() {
+    _env.synchronous_calls.store(
+        _env.synchronous_calls.load(std::memory_order_relaxed) - 1,
+        std::memory_order_relaxed);
+  }
+
+ private:
+  Environment& _env;
+  const vrpc::CallbackScope _callbackScope;
+};
+
+// Returns false if the environment is closed already
+bool wakeUp(Environment& env) {
+  std::lock_guard<std::mutex> lock(env.async_mutex);
+  if (env.closed)
+    return false;
+  uv_async_send(&env.async);
+  return true;
+}
 
 std::string singleArgToString(const FunctionCallbackInfo<Value>& args) {
   Isolate* isolate = args.GetIsolate();
@@ -108,30 +232,440 @@ std::string singleArgToString(const FunctionCallbackInfo<Value>& args) {
   return *utf8Buffer;
 }
 
-void call(const FunctionCallbackInfo<Value>& args) {
+// Runs a factory call writing a json response and returns it as string
+template <typename Call>
+void returnJsonResponse(const FunctionCallbackInfo<Value>& args,
+                        const Call& call) {
   Isolate* isolate = args.GetIsolate();
+  Environment& env = environment(args);
+  const SynchronousCall synchronousCall(env);
+  // Borrow the buffer, calls nested within callbacks find it empty
+  std::string response;
+  response.swap(env.response_buffer);
+  try {
+    call(response);
+  } catch (const std::exception& e) {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, e.what(), NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+  args.GetReturnValue().Set(
+      String::NewFromUtf8(isolate, response.data(), NewStringType::kNormal,
+                          static_cast<int>(response.size()))
+          .ToLocalChecked());
+  if (response.capacity() <= _max_response_buffer) {
+    response.clear();
+    response.swap(env.response_buffer);
+  }
+}
 
+void call(const FunctionCallbackInfo<Value>& args) {
   // Expect one argument and parse it to std::string
   std::string arg = singleArgToString(args);
   if (arg.empty())
     return;
 
-  std::string ret;
+  returnJsonResponse(args, [&arg](std::string& response) {
+    vrpc::LocalFactory::call(arg, response);
+  });
+}
+
+Local<Object> bytesToBuffer(Isolate* isolate, std::vector<std::uint8_t>&& bytes) {
+  // Hands the memory over to the buffer instead of copying it
+  auto holder = new std::vector<std::uint8_t>(std::move(bytes));
+  return node::Buffer::New(
+             isolate, reinterpret_cast<char*>(holder->data()), holder->size(),
+             [](char*, void* hint) {
+               delete static_cast<std::vector<std::uint8_t>*>(hint);
+             },
+             holder)
+      .ToLocalChecked();
+}
+
+void callBinary(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect a single buffer holding a MessagePack encoded request
+  if (args.Length() < 1 || !node::Buffer::HasInstance(args[0])) {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "Wrong argument type, expecting buffer",
+                            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+  const auto data = reinterpret_cast<const std::uint8_t*>(
+      node::Buffer::Data(args[0]));
+  const std::size_t size = node::Buffer::Length(args[0]);
+
+  std::vector<std::uint8_t> ret;
   try {
-    ret = vrpc::LocalFactory::call(arg);
+    const SynchronousCall synchronousCall(environment(args));
+    ret = vrpc::LocalFactory::call(data, size);
   } catch (const std::exception& e) {
     isolate->ThrowException(Exception::Error(
         String::NewFromUtf8(isolate, e.what(), NewStringType::kNormal)
             .ToLocalChecked()));
     return;
   }
-  Local<String> localString =
-      String::NewFromUtf8(isolate, ret.c_str(), NewStringType::kNormal)
-          .ToLocalChecked();
+  args.GetReturnValue().Set(bytesToBuffer(isolate, std::move(ret)));
+}
 
-  // Set the return value (using the passed in
-  // FunctionCallbackInfo<Value>&)
-  args.GetReturnValue().Set(localString);
+// Expects an array of requests, as json string or MessagePack encoded buffer,
+// and optionally whether to run the requests of different contexts in
+// parallel. Responds with the array of responses, encoded alike.
+void callBatch(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  const bool parallel = args.Length() > 1 && args[1]->BooleanValue(isolate);
+
+  if (args.Length() > 0 && node::Buffer::HasInstance(args[0])) {
+    const auto data = reinterpret_cast<const std::uint8_t*>(
+        node::Buffer::Data(args[0]));
+    const std::size_t size = node::Buffer::Length(args[0]);
+    std::vector<std::uint8_t> ret;
+    try {
+      const SynchronousCall synchronousCall(environment(args));
+      vrpc::LocalFactory::call_batch(data, size, ret, parallel);
+    } catch (const std::exception& e) {
+      isolate->ThrowException(Exception::Error(
+          String::NewFromUtf8(isolate, e.what(), NewStringType::kNormal)
+              .ToLocalChecked()));
+      return;
+    }
+    args.GetReturnValue().Set(bytesToBuffer(isolate, std::move(ret)));
+    return;
+  }
+
+  std::string arg = singleArgToString(args);
+  if (arg.empty())
+    return;
+
+  returnJsonResponse(args, [&arg, parallel](std::string& response) {
+    vrpc::LocalFactory::call_batch(arg, response, parallel);
+  });
+}
+
+void resolve(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect context and function name
+  if (args.Length() < 2 || !args[0]->IsString() || !args[1]->IsString()) {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate,
+                            "Wrong arguments, expecting context and function",
+                            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+  String::Utf8Value context(isolate, args[0]);
+  String::Utf8Value function(isolate, args[1]);
+
+  std::uint64_t handle;
+  try {
+    handle = vrpc::LocalFactory::resolve(*context, *function);
+  } catch (const std::exception& e) {
+    isolate->ThrowException(Exception::Error(
+        String::NewFromUtf8(isolate, e.what(), NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+  args.GetReturnValue().Set(static_cast<double>(handle));
+}
+
+// Handles are handed out as numbers, any but non-negative safe integers can
+// not be one (and would not convert safely)
+bool toHandle(Local<Value> value, std::uint64_t& handle) {
+  if (!value->IsNumber()) return false;
+  const double number = value.As<Number>()->Value();
+  if (!(number >= 0 && number <= 9007199254740991.0) ||
+      number != static_cast<double>(static_cast<std::uint64_t>(number)))
+    return false;
+  handle = static_cast<std::uint64_t>(number);
+  return true;
+}
+
+void callById(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect a handle and the json (string) or MessagePack (buffer) encoded
+  // array of arguments
+  std::uint64_t handle;
+  if (args.Length() < 2 || !toHandle(args[0], handle) ||
+      !(args[1]->IsString() || node::Buffer::HasInstance(args[1]))) {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate,
+                            "Wrong arguments, expecting handle and arguments",
+                            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+
+  if (node::Buffer::HasInstance(args[1])) {
+    const auto data = reinterpret_cast<const std::uint8_t*>(
+        node::Buffer::Data(args[1]));
+    const std::size_t size = node::Buffer::Length(args[1]);
+    std::vector<std::uint8_t> ret;
+    try {
+      const SynchronousCall synchronousCall(environment(args));
+      ret = vrpc::LocalFactory::call_by_id(handle, data, size);
+    } catch (const std::exception& e) {
+      isolate->ThrowException(Exception::Error(
+          String::NewFromUtf8(isolate, e.what(), NewStringType::kNormal)
+              .ToLocalChecked()));
+      return;
+    }
+    args.GetReturnValue().Set(bytesToBuffer(isolate, std::move(ret)));
+    return;
+  }
+
+  String::Utf8Value utf8Buffer(isolate, args[1]);
+  const std::string arguments(*utf8Buffer, utf8Buffer.length());
+  returnJsonResponse(args, [handle, &arguments](std::string& response) {
+    vrpc::LocalFactory::call_by_id(handle, arguments, response);
+  });
+}
+
+#ifdef VRPC_WITH_V8
+void callDirect(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect a handle and the (not encoded) array of arguments
+  std::uint64_t handle;
+  if (args.Length() < 2 || !toHandle(args[0], handle) || !args[1]->IsArray()) {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate,
+                            "Wrong arguments, expecting handle and arguments",
+                            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+
+  std::string error;
+  {
+    // Conversions may fail due to javascript exceptions (e.g. in getters)
+    TryCatch tryCatch(isolate);
+    try {
+      const SynchronousCall synchronousCall(environment(args));
+      const vrpc::V8Scope scope{isolate, isolate->GetCurrentContext()};
+      args.GetReturnValue().Set(vrpc::LocalFactory::call_by_id(
+          handle, scope, args[1].As<v8::Array>()));
+      return;
+    } catch (const std::exception& e) {
+      if (tryCatch.HasCaught()) {
+        tryCatch.ReThrow();
+        return;
+      }
+      error = e.what();
+    }
+  }
+  isolate->ThrowException(Exception::Error(
+      String::NewFromUtf8(isolate, error.c_str(), NewStringType::kNormal)
+          .ToLocalChecked()));
+}
+#endif
+
+struct AsyncCall {
+  AsyncCall* next = nullptr;
+  std::shared_ptr<Environment> env;
+  Persistent<Object> resource;
+  Persistent<Promise::Resolver> resolver;
+  node::async_context async_context;
+  std::string payload;  // holds the request first, then the response
+  std::string error;
+  bool binary;  // MessagePack instead of json encoded payload
+  bool released = false;
+
+  AsyncCall(Environment& env,
+            Local<Promise::Resolver> resolver,
+            std::string&& payload,
+            bool binary = false)
+      : env(env.self),
+        resolver(env.isolate, resolver),
+        payload(std::move(payload)),
+        binary(binary) {
+    Isolate* isolate = env.isolate;
+    Local<Object> local = Object::New(isolate);
+    resource.Reset(isolate, local);
+    async_context = node::EmitAsyncInit(isolate, local, "vrpc:callAsync");
+  }
+
+  ~AsyncCall() { release(); }
+
+  // Lets go of javascript while the isolate is alive, calls released by a
+  // closing environment are freed without touching it once done
+  void release() {
+    if (released)
+      return;
+    released = true;
+    node::EmitAsyncDestroy(env->isolate, async_context);
+    resource.Reset();
+    resolver.Reset();
+  }
+
+  void settle(Isolate* isolate) {
+    HandleScope handleScope(isolate);
+    // Drains the microtask queue once the promise got settled
+    node::CallbackScope callbackScope(
+        isolate, Local<Object>::New(isolate, resource), async_context);
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Promise::Resolver> local =
+        Local<Promise::Resolver>::New(isolate, resolver);
+    if (error.empty() && binary) {
+      local
+          ->Resolve(context, node::Buffer::Copy(isolate, payload.data(),
+                                                payload.size())
+                                 .ToLocalChecked())
+          .FromJust();
+    } else if (error.empty()) {
+      local
+          ->Resolve(context, String::NewFromUtf8(isolate, payload.c_str(),
+                                                 NewStringType::kNormal)
+                                 .ToLocalChecked())
+          .FromJust();
+    } else {
+      local
+          ->Reject(context,
+                   Exception::Error(String::NewFromUtf8(isolate, error.c_str(),
+                                                        NewStringType::kNormal)
+                                        .ToLocalChecked()))
+          .FromJust();
+    }
+  }
+};
+
+// Frees the calls completed after their environment closed, nothing is
+// waiting for them anymore
+void dropCompletedCalls(Environment& env) {
+  AsyncCall* completed =
+      env.completed_calls.exchange(nullptr, std::memory_order_acquire);
+  while (completed != nullptr) {
+    std::unique_ptr<AsyncCall> x(completed);
+    completed = completed->next;
+  }
+}
+
+Environment::~Environment() {
+  PendingCallback* pending = pending_callbacks.exchange(nullptr);
+  while (pending != nullptr) {
+    std::unique_ptr<PendingCallback> x(pending);
+    pending = pending->next;
+  }
+  dropCompletedCalls(*this);
+}
+
+void executeAsyncCall(AsyncCall* data) {
+  try {
+    const vrpc::CallbackScope callbackScope(data->env->handler);
+    if (data->binary) {
+      const auto ret = vrpc::LocalFactory::call(
+          reinterpret_cast<const std::uint8_t*>(data->payload.data()),
+          data->payload.size());
+      data->payload.assign(ret.begin(), ret.end());
+    } else {
+      data->payload = vrpc::LocalFactory::call(data->payload);
+    }
+  } catch (const std::exception& e) {
+    data->error = e.what();
+  }
+  // Handed back to the loop of the environment, just like callbacks. The loop
+  // may free the call right away, the environment is kept until done here.
+  const std::shared_ptr<Environment> env = data->env;
+  AsyncCall* head = env->completed_calls.load(std::memory_order_relaxed);
+  do {
+    data->next = head;
+  } while (!env->completed_calls.compare_exchange_weak(
+      head, data, std::memory_order_release, std::memory_order_relaxed));
+  if (head == nullptr && !wakeUp(*env))
+    dropCompletedCalls(*env);
+}
+
+void settleAsyncCalls(Environment& env, AsyncCall* head) {
+  // The stack holds the latest call first, restore the completion order
+  AsyncCall* done = nullptr;
+  while (head != nullptr) {
+    AsyncCall* next = head->next;
+    head->next = done;
+    done = head;
+    head = next;
+  }
+  while (done != nullptr) {
+    std::unique_ptr<AsyncCall> data(done);
+    done = done->next;
+    env.calls_in_flight.erase(data.get());
+    // Workers may exit, once no calls are pending anymore
+    if (env.calls_in_flight.empty() && env.worker)
+      uv_unref(reinterpret_cast<uv_handle_t*>(&env.async));
+    data->settle(env.isolate);
+  }
+}
+
+void callAsync(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect one argument, either a MessagePack encoded buffer or a string
+  const bool binary = args.Length() > 0 && node::Buffer::HasInstance(args[0]);
+  std::string arg;
+  if (binary) {
+    // Copied, as the buffer may be gone by the time the request executes
+    arg.assign(node::Buffer::Data(args[0]), node::Buffer::Length(args[0]));
+  } else {
+    arg = singleArgToString(args);
+    if (arg.empty())
+      return;
+  }
+
+  Local<Promise::Resolver> resolver =
+      Promise::Resolver::New(isolate->GetCurrentContext()).ToLocalChecked();
+  // Parsing, dispatching and serializing happens on the libuv thread pool
+  Environment& env = environment(args);
+  // Only context and function are parsed here, they decide whether the call
+  // has to wait for earlier calls on the same instance
+  std::string context;
+  std::string function;
+  if (binary) {
+    vrpc::LocalFactory::find_target(
+        reinterpret_cast<const std::uint8_t*>(arg.data()), arg.size(),
+        context, function);
+  } else {
+    vrpc::LocalFactory::find_target(arg, context, function);
+  }
+  AsyncCall* data = new AsyncCall(env, resolver, std::move(arg), binary);
+  if (env.calls_in_flight.empty() && env.worker)
+    uv_ref(reinterpret_cast<uv_handle_t*>(&env.async));
+  env.calls_in_flight.insert(data);
+  vrpc::LocalFactory::post(context, function,
+                           [data] { executeAsyncCall(data); });
+  args.GetReturnValue().Set(resolver->GetPromise());
+}
+
+void setPoolSize(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect a positive number of threads
+  if (args.Length() < 1 || !args[0]->IsNumber() ||
+      args[0]->NumberValue(isolate->GetCurrentContext()).FromJust() < 1) {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate,
+                            "Wrong argument, expecting a positive number",
+                            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+  // Shared by all environments
+  vrpc::LocalFactory::set_pool_size(static_cast<std::size_t>(
+      args[0]->NumberValue(isolate->GetCurrentContext()).FromJust()));
+}
+
+void getPoolSize(const FunctionCallbackInfo<Value>& args) {
+  args.GetReturnValue().Set(
+      static_cast<double>(vrpc::LocalFactory::pool_size()));
+}
+
+void cancel(const FunctionCallbackInfo<Value>& args) {
+  std::string call_id = singleArgToString(args);
+  if (call_id.empty())
+    return;
+  args.GetReturnValue().Set(vrpc::LocalFactory::cancel(call_id));
 }
 
 void loadBindings(const FunctionCallbackInfo<Value>& args) {
@@ -266,78 +800,546 @@ void getMetaData(const FunctionCallbackInfo<Value>& args) {
   args.GetReturnValue().Set(localString);
 }
 
-typedef Persistent<Function> CallbackHandler;
-static std::vector<CallbackHandler> callback_handlers(_VRPC_MAX_HANDLERS);
-static size_t nHandlers = 0;
+static const char _callback_prefix[] = "__c__";
+static const std::size_t _callback_prefix_size = sizeof(_callback_prefix) - 1;
+
+bool isRegisteredCallback(const std::string& callback_id) {
+  return callback_id.compare(0, _callback_prefix_size, _callback_prefix) == 0;
+}
+
+bool toCallbackHandle(const std::string& callback_id, std::uint32_t& handle) {
+  if (!isRegisteredCallback(callback_id) ||
+      callback_id.size() == _callback_prefix_size)
+    return false;
+  std::uint64_t value = 0;
+  for (std::size_t i = _callback_prefix_size; i < callback_id.size(); ++i) {
+    const char c = callback_id[i];
+    if (c < '0' || c > '9')
+      return false;
+    value = value * 10 + (c - '0');
+    if (value > UINT32_MAX)
+      return false;
+  }
+  handle = static_cast<std::uint32_t>(value);
+  return true;
+}
 
-void executeCallback(Isolate* isolate, const std::string& jString) {
+void executeCallback(Environment& env, Local<Value> data) {
+  Isolate* isolate = env.isolate;
+  Local<Context> context = isolate->GetCurrentContext();
+  for (const auto& handler : env.callback_handlers) {
+    Local<Function> cb = Local<Function>::New(isolate, handler);
+    const unsigned argc = 1;
+    Local<Value> argv[argc] = {data};
+    // Fails if the handler threw, or the environment is shutting down (e.g.
+    // terminated workers run their handles once more)
+    if (cb->Call(context, Null(isolate), argc, argv).IsEmpty())
+      return;
+  }
+}
+
+void executeCallback(Environment& env, const std::string& jString) {
   _VRPC_DEBUG << "will call back with " << jString << std::endl;
+  Isolate* isolate = env.isolate;
+  HandleScope handleScope(isolate);
+  executeCallback(env,
+                  String::NewFromUtf8(isolate, jString.data(),
+                                      NewStringType::kNormal, jString.size())
+                      .ToLocalChecked());
+}
+
+// Invokes exactly the registered function, with the event's arguments
+void executeCallback(Environment& env, const vrpc::CallbackEvent& event) {
+  std::uint32_t handle;
+  if (!toCallbackHandle(event.callback_id(), handle))
+    return;
+  auto it = env.callbacks.find(handle);
+  if (it == env.callbacks.end())
+    return;  // released meanwhile
+  Isolate* isolate = env.isolate;
   HandleScope handleScope(isolate);
   Local<Context> context = isolate->GetCurrentContext();
-  for (size_t i = 0; i < nHandlers; ++i) {
-    Local<Function> cb = Local<Function>::New(isolate, callback_handlers[i]);
-    const unsigned argc = 1;
-    Local<Value> argv[argc] = {
-        String::NewFromUtf8(isolate, jString.c_str(), NewStringType::kNormal)
-            .ToLocalChecked()};
-    cb->Call(context, Null(isolate), argc, argv).ToLocalChecked();
+  Local<Function> cb = Local<Function>::New(isolate, it->second.function);
+  if (it->second.once)
+    env.callbacks.erase(it);
+  std::vector<Local<Value>> argv;
+  try {
+#ifdef VRPC_WITH_V8
+    // Arguments arrive in the shapes json would give them
+    event.arguments({isolate, context, false}, argv);
+#else
+    const std::string envelope(event.envelope());
+    Local<Object> parsed =
+        v8::JSON::Parse(context, String::NewFromUtf8(isolate, envelope.data(),
+                                                     NewStringType::kNormal,
+                                                     envelope.size())
+                                     .ToLocalChecked())
+            .ToLocalChecked()
+            .As<Object>();
+    Local<Array> a =
+        parsed
+            ->Get(context, String::NewFromUtf8(isolate, "a",
+                                               NewStringType::kNormal)
+                               .ToLocalChecked())
+            .ToLocalChecked()
+            .As<Array>();
+    for (uint32_t i = 0; i < a->Length(); ++i)
+      argv.push_back(a->Get(context, i).ToLocalChecked());
+#endif
+  } catch (const std::exception& e) {
+    std::cerr << "[vrpc] Failed converting arguments of callback "
+              << event.callback_id() << ", because: " << e.what() << std::endl;
+    return;
+  }
+  TryCatch tryCatch(isolate);
+  if (cb->Call(context, Null(isolate), static_cast<int>(argv.size()),
+               argv.data())
+          .IsEmpty() &&
+      tryCatch.HasCaught()) {
+    String::Utf8Value message(isolate, tryCatch.Exception());
+    std::cerr << "[vrpc] Failed to execute callback " << event.callback_id()
+              << ", because: " << *message << std::endl;
   }
 }
 
-void triggerAsyncCallback(uv_async_t* handle) {
-  std::vector<AsyncData> data_queue_copy;
+void pushPending(Environment& env, PendingCallback* pending) {
+  PendingCallback* head =
+      env.pending_callbacks.load(std::memory_order_relaxed);
+  do {
+    pending->next = head;
+  } while (!env.pending_callbacks.compare_exchange_weak(
+      head, pending, std::memory_order_release, std::memory_order_relaxed));
+  // Only the first callback of a batch needs to wake up the loop
+  if (head == nullptr)
+    wakeUp(env);
+}
+
+void pushCallback(Environment& env,
+                  std::unique_ptr<vrpc::CallbackEvent> event) {
+  // Stays valid, as the event is moved as a whole
+  const std::string& callback_id = event->callback_id();
+  vrpc::CallbackPolicy policy = event->policy();
+  if (env.n_callback_policies.load(std::memory_order_relaxed) > 0) {
+    std::lock_guard<std::mutex> lock(env.channels_mutex);
+    auto it = env.callback_policies.find(callback_id);
+    if (it != env.callback_policies.end())
+      policy = it->second;
+  }
+  // Rendering happens here rather than on the main thread
+  QueuedEvent queued;
+  if (isRegisteredCallback(callback_id))
+    queued.event = std::move(event);
+  else
+    queued.envelope = event->envelope();
+  if (policy.delivery == vrpc::CallbackPolicy::all) {
+    pushPending(env,
+                new PendingCallback{nullptr, std::move(queued), nullptr});
+    return;
+  }
+  std::shared_ptr<CallbackChannel> channel;
+  std::unique_lock<std::mutex> lock;
   {
-    std::unique_lock<std::mutex> lock(_data_queue_mutex);
-    data_queue_copy = _data_queue;
-    _data_queue.clear();
+    std::lock_guard<std::mutex> channels_lock(env.channels_mutex);
+    if (env.channels_closed)
+      return;
+    std::shared_ptr<CallbackChannel>& entry = env.channels[callback_id];
+    if (!entry) {
+      entry = std::make_shared<CallbackChannel>();
+      entry->callback_id = callback_id;
+    }
+    channel = entry;
+    // Locked before releasing the map, so the channel can not be retired
+    lock = std::unique_lock<std::mutex>(channel->mutex);
+  }
+  const std::size_t capacity = std::max<std::size_t>(policy.capacity, 1);
+  switch (policy.delivery) {
+    case vrpc::CallbackPolicy::latest:
+      if (!channel->events.empty()) {
+        channel->events.back() = std::move(queued);
+        ++env.coalesced_callbacks;
+        return;
+      }
+      break;
+    case vrpc::CallbackPolicy::drop_oldest:
+      while (channel->events.size() >= capacity) {
+        channel->events.pop_front();
+        ++env.dropped_callbacks;
+      }
+      break;
+    case vrpc::CallbackPolicy::block_producer:
+      // A synchronous call may wait for this producer (e.g. for the lock of
+      // its instance), which then stops blocking rather than deadlocking
+      ++channel->blocked;
+      while (!channel->drained.wait_for(
+          lock, std::chrono::milliseconds(10), [&] {
+            return channel->closed || channel->events.size() < capacity;
+          })) {
+        if (env.synchronous_calls.load(std::memory_order_relaxed) > 0)
+          break;
+      }
+      --channel->blocked;
+      if (channel->closed)
+        return;
+      break;
+    default:
+      break;
+  }
+  channel->events.push_back(std::move(queued));
+  if (!channel->scheduled) {
+    channel->scheduled = true;
+    pushPending(env, new PendingCallback{nullptr, QueuedEvent(), channel});
+  }
+}
+
+void takeEvents(Environment& env,
+                CallbackChannel& channel,
+                std::vector<QueuedEvent>& batch) {
+  std::lock_guard<std::mutex> channels_lock(env.channels_mutex);
+  std::lock_guard<std::mutex> lock(channel.mutex);
+  for (auto& x : channel.events) batch.push_back(std::move(x));
+  channel.events.clear();
+  channel.scheduled = false;
+  if (channel.blocked > 0)
+    channel.drained.notify_all();
+  else
+    env.channels.erase(channel.callback_id);
+}
+
+void triggerAsyncCallback(uv_async_t* handle) {
+  Environment& env = *static_cast<Environment*>(handle->data);
+  // Taken first, so that the callbacks fired by these calls get delivered
+  // before the calls settle
+  AsyncCall* completed =
+      env.completed_calls.exchange(nullptr, std::memory_order_acquire);
+  PendingCallback* head =
+      env.pending_callbacks.exchange(nullptr, std::memory_order_acquire);
+  // The stack holds the latest callback first, restore the firing order
+  PendingCallback* pending = nullptr;
+  while (head != nullptr) {
+    PendingCallback* next = head->next;
+    head->next = pending;
+    pending = head;
+    head = next;
+  }
+  std::vector<QueuedEvent> batch;
+  while (pending != nullptr) {
+    std::unique_ptr<PendingCallback> x(pending);
+    pending = pending->next;
+    if (x->channel)
+      takeEvents(env, *x->channel, batch);
+    else
+      batch.push_back(std::move(x->queued));
+  }
+  Isolate* isolate = env.isolate;
+  HandleScope handleScope(isolate);
+  Local<Context> context = isolate->GetCurrentContext();
+  // Registered callbacks are invoked one by one, all others receive the
+  // envelopes of the batch as one array
+  Local<Array> data = Array::New(isolate);
+  uint32_t size = 0;
+  for (const auto& x : batch) {
+    if (x.event) {
+      executeCallback(env, *x.event);
+      continue;
+    }
+    _VRPC_DEBUG << "will call back with " << x.envelope << std::endl;
+    data->Set(context, size++,
+              String::NewFromUtf8(isolate, x.envelope.data(),
+                                  NewStringType::kNormal, x.envelope.size())
+                  .ToLocalChecked())
+        .FromJust();
+  }
+  if (size > 0)
+    executeCallback(env, data);
+  settleAsyncCalls(env, completed);
+}
+
+void setCallbackPolicy(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect the callback id, optionally followed by delivery and capacity
+  if (args.Length() < 1 || !args[0]->IsString() ||
+      (args.Length() > 1 && !args[1]->IsString() && !args[1]->IsUndefined()) ||
+      (args.Length() > 2 && !args[2]->IsNumber() && !args[2]->IsUndefined())) {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(
+            isolate, "Wrong arguments, expecting callback id and delivery",
+            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
   }
-  for (const auto& x : data_queue_copy) {
-    executeCallback(x.first, x.second);
+  String::Utf8Value callback_id(isolate, args[0]);
+  const std::string delivery = args.Length() > 1 && args[1]->IsString()
+                                   ? *String::Utf8Value(isolate, args[1])
+                                   : "";
+  vrpc::CallbackPolicy policy;
+  if (delivery == "latest") {
+    policy.delivery = vrpc::CallbackPolicy::latest;
+  } else if (delivery == "dropOldest") {
+    policy.delivery = vrpc::CallbackPolicy::drop_oldest;
+  } else if (delivery == "blockProducer") {
+    policy.delivery = vrpc::CallbackPolicy::block_producer;
+  } else if (!delivery.empty() && delivery != "all") {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, ("Unknown delivery: " + delivery).c_str(),
+                            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+  if (args.Length() > 2 && args[2]->IsNumber()) {
+    policy.capacity = static_cast<std::size_t>(
+        std::max(args[2]->NumberValue(isolate->GetCurrentContext()).FromJust(),
+                 0.0));
   }
+  Environment& env = environment(args);
+  std::lock_guard<std::mutex> lock(env.channels_mutex);
+  // Without a delivery, the policy of the bound function applies again
+  if (delivery.empty())
+    env.callback_policies.erase(*callback_id);
+  else
+    env.callback_policies[*callback_id] = policy;
+  env.n_callback_policies = env.callback_policies.size();
+}
+
+void getCallbackStats(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+  const Environment& env = environment(args);
+  Local<Context> context = isolate->GetCurrentContext();
+  Local<Object> stats = Object::New(isolate);
+  stats
+      ->Set(context,
+            String::NewFromUtf8(isolate, "dropped", NewStringType::kNormal)
+                .ToLocalChecked(),
+            v8::Number::New(isolate, static_cast<double>(env.dropped_callbacks)))
+      .FromJust();
+  stats
+      ->Set(context,
+            String::NewFromUtf8(isolate, "coalesced", NewStringType::kNormal)
+                .ToLocalChecked(),
+            v8::Number::New(isolate,
+                             static_cast<double>(env.coalesced_callbacks)))
+      .FromJust();
+  args.GetReturnValue().Set(stats);
 }
 
 void onCallback(const FunctionCallbackInfo<Value>& args) {
   Isolate* isolate = args.GetIsolate();
-  if (nHandlers >= _VRPC_MAX_HANDLERS) {
+  if (args.Length() < 1 || !args[0]->IsFunction()) {
     isolate->ThrowException(Exception::TypeError(
-        String::NewFromUtf8(isolate,
-                            "Exceeded maximum number of handler registrations",
+        String::NewFromUtf8(isolate, "Wrong argument type, expecting function",
                             NewStringType::kNormal)
             .ToLocalChecked()));
+    return;
   }
-  callback_handlers[nHandlers++].Reset(isolate, Local<Function>::Cast(args[0]));
-  _thread_id = std::this_thread::get_id();
-  vrpc::Callback::register_callback_handler([=](const vrpc::json& j) {
-    const std::string jString(j.dump());
-    if (std::this_thread::get_id() == _thread_id) {
-      executeCallback(isolate, jString);
-    } else {
-      {
-        std::unique_lock<std::mutex> lock(_data_queue_mutex);
-        _data_queue.push_back({isolate, jString});
+  environment(args).callback_handlers.emplace_back(isolate,
+                                                   args[0].As<Function>());
+}
+
+void registerCallback(const FunctionCallbackInfo<Value>& args) {
+  Isolate* isolate = args.GetIsolate();
+
+  // Expect the function, optionally followed by whether it is called once
+  if (args.Length() < 1 || !args[0]->IsFunction()) {
+    isolate->ThrowException(Exception::TypeError(
+        String::NewFromUtf8(isolate, "Wrong argument type, expecting function",
+                            NewStringType::kNormal)
+            .ToLocalChecked()));
+    return;
+  }
+  Environment& env = environment(args);
+  const bool once = args.Length() > 1 && args[1]->BooleanValue(isolate);
+  // Skips handles still in use, once the counter wrapped around
+  while (env.callbacks.find(env.next_callback) != env.callbacks.end())
+    ++env.next_callback;
+  const std::uint32_t handle = env.next_callback++;
+  env.callbacks.emplace(
+      handle,
+      RegisteredCallback{v8::Global<Function>(isolate, args[0].As<Function>()),
+                         once});
+  const std::string callback_id(_callback_prefix + std::to_string(handle));
+  args.GetReturnValue().Set(
+      String::NewFromUtf8(isolate, callback_id.data(), NewStringType::kNormal,
+                          callback_id.size())
+          .ToLocalChecked());
+}
+
+void releaseCallback(const FunctionCallbackInfo<Value>& args) {
+  std::string callback_id = singleArgToString(args);
+  if (callback_id.empty())
+    return;
+  std::uint32_t handle;
+  args.GetReturnValue().Set(toCallbackHandle(callback_id, handle) &&
+                            environment(args).callbacks.erase(handle) > 0);
+}
+
+// Receives the events of all callbacks created by calls of the environment,
+// those fired on its own thread are delivered right away
+std::shared_ptr<const vrpc::EventCallbackHandler> createEventHandler(
+    const std::shared_ptr<Environment>& env) {
+  std::weak_ptr<Environment> weak(env);
+  return std::make_shared<const vrpc::EventCallbackHandler>(
+      [weak](std::unique_ptr<vrpc::CallbackEvent> event) {
+        std::shared_ptr<Environment> env = weak.lock();
+        if (!env)
+          return;
+        if (std::this_thread::get_id() != env->thread_id) {
+          pushCallback(*env, std::move(event));
+        } else if (env->closed) {
+          return;
+        } else if (isRegisteredCallback(event->callback_id())) {
+          executeCallback(*env, *event);
+        } else {
+          executeCallback(*env, event->envelope());
+        }
+      });
+}
+
+// Environments that loaded the addon, in the order of loading
+struct Environments {
+  std::mutex mutex;
+  std::vector<Environment*> open;
+  // Receives the events of callbacks created outside of any call
+  std::shared_ptr<const vrpc::EventCallbackHandler> fallback;
+
+  // Prefers the main thread, which outlives the workers
+  void bindFallback() {
+    Environment* env = nullptr;
+    for (Environment* x : open) {
+      if (!x->worker) {
+        env = x;
+        break;
       }
-      uv_async_send(&async);
+      if (env == nullptr)
+        env = x;
     }
-  });
+    fallback = env != nullptr ? env->handler : nullptr;
+  }
+};
+
+// Never destroyed, as callbacks may still be fired at exit
+Environments& environments() {
+  static Environments* environments = new Environments();
+  return *environments;
 }
 
-struct Initializer {
-  Initializer() {
-    uv_async_init(uv_default_loop(), &async, triggerAsyncCallback);
+void closeEnvironment(void* arg) {
+  Environment* env = static_cast<Environment*>(arg);
+  {
+    Environments& all = environments();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    all.open.erase(std::remove(all.open.begin(), all.open.end(), env),
+                   all.open.end());
+    all.bindFallback();
   }
-};
-static Initializer runOnce;
+  // Calls still running let go of javascript while it is alive
+  for (AsyncCall* call : env->calls_in_flight) call->release();
+  env->calls_in_flight.clear();
+  {
+    std::lock_guard<std::mutex> lock(env->async_mutex);
+    env->closed = true;
+  }
+  {
+    // Wakes up the producers blocked on a full channel
+    std::lock_guard<std::mutex> lock(env->channels_mutex);
+    env->channels_closed = true;
+    for (const auto& kv : env->channels) {
+      std::lock_guard<std::mutex> channel_lock(kv.second->mutex);
+      kv.second->closed = true;
+      kv.second->drained.notify_all();
+    }
+  }
+  env->callback_handlers.clear();
+  env->callbacks.clear();
+  // Calls done meanwhile are dropped, nothing is waiting for them anymore
+  dropCompletedCalls(*env);
+  uv_close(reinterpret_cast<uv_handle_t*>(&env->async), [](uv_handle_t* h) {
+    Environment* env = static_cast<Environment*>(h->data);
+    // Pending asynchronous calls and callbacks may still hold on to it
+    std::shared_ptr<Environment> self(std::move(env->self));
+  });
+}
 
-void Init(Local<Object> exports) {
-  NODE_SET_METHOD(exports, "loadBindings", loadBindings);
-  NODE_SET_METHOD(exports, "getClasses", getClasses);
-  NODE_SET_METHOD(exports, "getInstances", getInstances);
-  NODE_SET_METHOD(exports, "getMemberFunctions", getMemberFunctions);
-  NODE_SET_METHOD(exports, "getStaticFunctions", getStaticFunctions);
-  NODE_SET_METHOD(exports, "getMetaData", getMetaData);
-  NODE_SET_METHOD(exports, "call", call);
-  NODE_SET_METHOD(exports, "onCallback", onCallback);
+void setMethod(Local<Object> exports,
+               Local<v8::External> env,
+               const char* name,
+               v8::FunctionCallback callback) {
+  Isolate* isolate = exports->GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+  Local<String> key =
+      String::NewFromUtf8(isolate, name, NewStringType::kInternalized)
+          .ToLocalChecked();
+  Local<Function> function = v8::FunctionTemplate::New(isolate, callback, env)
+                                 ->GetFunction(context)
+                                 .ToLocalChecked();
+  function->SetName(key);
+  exports->Set(context, key, function).FromJust();
 }
 
-NODE_MODULE(vrpc, Init)
+// Context-aware, each environment (e.g. worker thread) loading the addon gets
+// its own loop handle, callback queue and handlers
+NODE_MODULE_INIT(/* exports, module, context */) {
+  Isolate* isolate = context->GetIsolate();
+  std::shared_ptr<Environment> shared = std::make_shared<Environment>();
+  Environment* env = shared.get();
+  env->isolate = isolate;
+  env->thread_id = std::this_thread::get_id();
+  env->handler = createEventHandler(shared);
+  env->self = std::move(shared);
+  uv_loop_t* loop = node::GetCurrentEventLoop(isolate);
+  uv_async_init(loop, &env->async, triggerAsyncCallback);
+  env->async.data = env;
+  // Unlike the main thread, workers must be able to exit on their own
+  env->worker = loop != uv_default_loop();
+  if (env->worker)
+    uv_unref(reinterpret_cast<uv_handle_t*>(&env->async));
+  node::AddEnvironmentCleanupHook(isolate, closeEnvironment, env);
+
+  // Callbacks created outside of any call report to the main thread, or the
+  // earliest environment still open if the main thread did not load the addon
+  {
+    Environments& all = environments();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    all.open.push_back(env);
+    all.bindFallback();
+  }
+  static std::once_flag fallback;
+  std::call_once(fallback, [] {
+    vrpc::Callback::register_callback_handler(
+        [](std::unique_ptr<vrpc::CallbackEvent> event) {
+          std::shared_ptr<const vrpc::EventCallbackHandler> handler;
+          {
+            Environments& all = environments();
+            std::lock_guard<std::mutex> lock(all.mutex);
+            handler = all.fallback;
+          }
+          if (handler)
+            (*handler)(std::move(event));
+        });
+  });
+
+  Local<v8::External> data = v8::External::New(isolate, env);
+  setMethod(exports, data, "loadBindings", loadBindings);
+  setMethod(exports, data, "getClasses", getClasses);
+  setMethod(exports, data, "getInstances", getInstances);
+  setMethod(exports, data, "getMemberFunctions", getMemberFunctions);
+  setMethod(exports, data, "getStaticFunctions", getStaticFunctions);
+  setMethod(exports, data, "getMetaData", getMetaData);
+  setMethod(exports, data, "call", call);
+  setMethod(exports, data, "callAsync", callAsync);
+  setMethod(exports, data, "setPoolSize", setPoolSize);
+  setMethod(exports, data, "getPoolSize", getPoolSize);
+  setMethod(exports, data, "cancel", cancel);
+  setMethod(exports, data, "callBinary", callBinary);
+  setMethod(exports, data, "callBatch", callBatch);
+  setMethod(exports, data, "resolve", resolve);
+  setMethod(exports, data, "callById", callById);
+#ifdef VRPC_WITH_V8
+  setMethod(exports, data, "callDirect", callDirect);
+#endif
+  setMethod(exports, data, "onCallback", onCallback);
+  setMethod(exports, data, "registerCallback", registerCallback);
+  setMethod(exports, data, "releaseCallback", releaseCallback);
+  setMethod(exports, data, "setCallbackPolicy", setCallbackPolicy);
+  setMethod(exports, data, "getCallbackStats", getCallbackStats);
+}
 }  // namespace vrpc_bindings
@@ -0,0 +1,348 @@
+/*
+__/\\\________/\\\____/\\\\\\\\\______/\\\\\\\\\\\\\_________/\\\\\\\\\_
+__\/\\\_______\/\\\__/\\\///////\\\___\/\\\/////////\\\____/\\\////////__
+ __\//\\\______/\\\__\/\\\_____\/\\\___\/\\\_______\/\\\__/\\\/___________
+  ___\//\\\____/\\\___\/\\\\\\\\\\\/____\/\\\\\\\\\\\\\/__/\\\_____________
+   ____\//\\\__/\\\____\/\\\//////\\\____\/\\\/////////___\/\\\_____________
+    _____\//\\\/\\\_____\/\\\____\//\\\___\/\\\____________\//\\\____________
+     ______\//\\\\\______\/\\\_____\//\\\__\/\\\_____________\///\\\__________
+      _______\//\\\_______\/\\\______\//\\\_\/\\\_______________\////\\\\\\\\\_
+       ________\///________\///________\///__\///___________________\/////////__
+
+
+Minimal MessagePack codec, used for the binary call path between VrpcNative
+and the native addon.
+Author: Dr. Burkhard C. Heisen (https://github.com/heisenware/vrpc)
+
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2018 - 2022 Dr. Burkhard C. Heisen <burkhard.heisen@heisenware.com>.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// See https://github.com/msgpack/msgpack/blob/master/spec.md
+
+/**
+ * Encodes values into a re-used, growing buffer
+ */
+class Encoder {
+  constructor (size = 4096) {
+    this._buffer = Buffer.allocUnsafe(size)
+    this._pos = 0
+  }
+
+  /**
+   * Encodes a value
+   *
+   * NOTE: The returned buffer is a view on internal memory and only valid
+   * until the next call to encode.
+   *
+   * @param {any} value Any JSON compatible value (or Buffer), other typed
+   * arrays are encoded as arrays
+   * @returns {Buffer} MessagePack encoded value
+   */
+  encode (value) {
+    this._pos = 0
+    this._write(value)
+    return this._buffer.subarray(0, this._pos)
+  }
+
+  _reserve (size) {
+    if (this._pos + size <= this._buffer.length) return
+    let length = this._buffer.length * 2
+    while (length < this._pos + size) length *= 2
+    const buffer = Buffer.allocUnsafe(length)
+    this._buffer.copy(buffer, 0, 0, this._pos)
+    this._buffer = buffer
+  }
+
+  _write (value) {
+    switch (typeof value) {
+      case 'string':
+        return this._writeString(value)
+      case 'number':
+        return this._writeNumber(value)
+      case 'boolean':
+        this._reserve(1)
+        this._buffer[this._pos++] = value ? 0xc3 : 0xc2
+        return
+      case 'object':
+        if (value === null) break
+        if (Array.isArray(value)) return this._writeArray(value)
+        if (value instanceof Uint8Array) return this._writeBinary(value)
+        if (ArrayBuffer.isView(value) && !(value instanceof DataView)) {
+          return this._writeArray(value)
+        }
+        if (typeof value.toJSON === 'function') return this._write(value.toJSON())
+        return this._writeMap(value)
+    }
+    // null, undefined, functions and symbols (same as JSON.stringify in arrays)
+    this._reserve(1)
+    this._buffer[this._pos++] = 0xc0
+  }
+
+  _writeHeader (length, fix, code16) {
+    this._reserve(5)
+    const buffer = this._buffer
+    if (length < 0x10) {
+      buffer[this._pos++] = fix | length
+    } else if (length < 0x10000) {
+      buffer[this._pos++] = code16
+      buffer.writeUInt16BE(length, this._pos)
+      this._pos += 2
+    } else {
+      buffer[this._pos++] = code16 + 1
+      buffer.writeUInt32BE(length, this._pos)
+      this._pos += 4
+    }
+  }
+
+  _writeString (value) {
+    const length = Buffer.byteLength(value)
+    this._reserve(5 + length)
+    const buffer = this._buffer
+    if (length < 0x20) {
+      buffer[this._pos++] = 0xa0 | length
+    } else if (length < 0x100) {
+      buffer[this._pos++] = 0xd9
+      buffer[this._pos++] = length
+    } else if (length < 0x10000) {
+      buffer[this._pos++] = 0xda
+      buffer.writeUInt16BE(length, this._pos)
+      this._pos += 2
+    } else {
+      buffer[this._pos++] = 0xdb
+      buffer.writeUInt32BE(length, this._pos)
+      this._pos += 4
+    }
+    this._pos += buffer.write(value, this._pos, length)
+  }
+
+  _writeNumber (value) {
+    this._reserve(9)
+    const buffer = this._buffer
+    if (!Number.isSafeInteger(value)) {
+      buffer[this._pos++] = 0xcb
+      buffer.writeDoubleBE(value, this._pos)
+      this._pos += 8
+    } else if (value >= 0) {
+      if (value < 0x80) {
+        buffer[this._pos++] = value
+      } else if (value < 0x100) {
+        buffer[this._pos++] = 0xcc
+        buffer[this._pos++] = value
+      } else if (value < 0x10000) {
+        buffer[this._pos++] = 0xcd
+        buffer.writeUInt16BE(value, this._pos)
+        this._pos += 2
+      } else if (value < 0x100000000) {
+        buffer[this._pos++] = 0xce
+        buffer.writeUInt32BE(value, this._pos)
+        this._pos += 4
+      } else {
+        buffer[this._pos++] = 0xcf
+        buffer.writeBigUInt64BE(BigInt(value), this._pos)
+        this._pos += 8
+      }
+    } else {
+      if (value >= -0x20) {
+        buffer[this._pos++] = value & 0xff
+      } else if (value >= -0x80) {
+        buffer[this._pos++] = 0xd0
+        buffer.writeInt8(value, this._pos)
+        this._pos += 1
+      } else if (value >= -0x8000) {
+        buffer[this._pos++] = 0xd1
+        buffer.writeInt16BE(value, this._pos)
+        this._pos += 2
+      } else if (value >= -0x80000000) {
+        buffer[this._pos++] = 0xd2
+        buffer.writeInt32BE(value, this._pos)
+        this._pos += 4
+      } else {
+        buffer[this._pos++] = 0xd3
+        buffer.writeBigInt64BE(BigInt(value), this._pos)
+        this._pos += 8
+      }
+    }
+  }
+
+  _writeArray (value) {
+    this._writeHeader(value.length, 0x90, 0xdc)
+    for (let i = 0; i < value.length; ++i) this._write(value[i])
+  }
+
+  _writeMap (value) {
+    const keys = Object.keys(value).filter(key => {
+      const type = typeof value[key]
+      return type !== 'undefined' && type !== 'function' && type !== 'symbol'
+    })
+    this._writeHeader(keys.length, 0x80, 0xde)
+    for (const key of keys) {
+      this._writeString(key)
+      this._write(value[key])
+    }
+  }
+
+  _writeBinary (value) {
+    const length = value.byteLength
+    this._reserve(5 + length)
+    const buffer = this._buffer
+    if (length < 0x100) {
+      buffer[this._pos++] = 0xc4
+      buffer[this._pos++] = length
+    } else if (length < 0x10000) {
+      buffer[this._pos++] = 0xc5
+      buffer.writeUInt16BE(length, this._pos)
+      this._pos += 2
+    } else {
+      buffer[this._pos++] = 0xc6
+      buffer.writeUInt32BE(length, this._pos)
+      this._pos += 4
+    }
+    buffer.set(value, this._pos)
+    this._pos += length
+  }
+}
+
+/**
+ * Decodes a MessagePack encoded buffer
+ *
+ * @param {Buffer} buffer MessagePack encoded value
+ * @returns {any} Decoded value, binary data is returned as Buffer
+ */
+function decode (buffer) {
+  let pos = 0
+
+  function string (length) {
+    const value = buffer.toString('utf8', pos, pos + length)
+    pos += length
+    return value
+  }
+
+  function array (length) {
+    const value = new Array(length)
+    for (let i = 0; i < length; ++i) value[i] = read()
+    return value
+  }
+
+  function map (length) {
+    const value = {}
+    for (let i = 0; i < length; ++i) {
+      const key = read()
+      value[key] = read()
+    }
+    return value
+  }
+
+  function binary (length) {
+    const value = buffer.subarray(pos, pos + length)
+    pos += length
+    return value
+  }
+
+  function read () {
+    const code = buffer[pos++]
+    let value
+    if (code < 0x80) return code
+    if (code < 0x90) return map(code & 0x0f)
+    if (code < 0xa0) return array(code & 0x0f)
+    if (code < 0xc0) return string(code & 0x1f)
+    if (code >= 0xe0) return code - 0x100
+    switch (code) {
+      case 0xc0: return null
+      case 0xc2: return false
+      case 0xc3: return true
+      case 0xc4: return binary(buffer[pos++])
+      case 0xc5:
+        value = buffer.readUInt16BE(pos)
+        pos += 2
+        return binary(value)
+      case 0xc6:
+        value = buffer.readUInt32BE(pos)
+        pos += 4
+        return binary(value)
+      case 0xca:
+        value = buffer.readFloatBE(pos)
+        pos += 4
+        return value
+      case 0xcb:
+        value = buffer.readDoubleBE(pos)
+        pos += 8
+        return value
+      case 0xcc: return buffer[pos++]
+      case 0xcd:
+        value = buffer.readUInt16BE(pos)
+        pos += 2
+        return value
+      case 0xce:
+        value = buffer.readUInt32BE(pos)
+        pos += 4
+        return value
+      case 0xcf:
+        value = Number(buffer.readBigUInt64BE(pos))
+        pos += 8
+        return value
+      case 0xd0: return buffer.readInt8(pos++)
+      case 0xd1:
+        value = buffer.readInt16BE(pos)
+        pos += 2
+        return value
+      case 0xd2:
+        value = buffer.readInt32BE(pos)
+        pos += 4
+        return value
+      case 0xd3:
+        value = Number(buffer.readBigInt64BE(pos))
+        pos += 8
+        return value
+      case 0xd9: return string(buffer[pos++])
+      case 0xda:
+        value = buffer.readUInt16BE(pos)
+        pos += 2
+        return string(value)
+      case 0xdb:
+        value = buffer.readUInt32BE(pos)
+        pos += 4
+        return string(value)
+      case 0xdc:
+        value = buffer.readUInt16BE(pos)
+        pos += 2
+        return array(value)
+      case 0xdd:
+        value = buffer.readUInt32BE(pos)
+        pos += 4
+        return array(value)
+      case 0xde:
+        value = buffer.readUInt16BE(pos)
+        pos += 2
+        return map(value)
+      case 0xdf:
+        value = buffer.readUInt32BE(pos)
+        pos += 4
+        return map(value)
+    }
+    throw new Error(`Unsupported MessagePack type: 0x${code.toString(16)}`)
+  }
+
+  return read()
+}
+
+module.exports = { Encoder, decode }